@@ -1,4 +1,6 @@
 #include <chrono>
+#include <thread>
+#include <sys/wait.h>
 #include <tuple>
 #include <vector>
 
@@ -72,6 +74,638 @@ void generic_test(const std::string& description, const std::string& schema_str,
     }
 }
 
+template <typename T>
+std::vector<T> make_test_vector(size_t n) {
+    std::vector<T> result(n);
+    for(size_t i = 0; i < n; i++){
+        result[i] = (T)(i * 7 + 0.5);
+    }
+    return result;
+}
+
+std::vector<std::string> make_test_strings(size_t n) {
+    std::vector<std::string> result(n);
+    for(size_t i = 0; i < n; i++){
+        result[i] = std::string(i % 32, 'x');
+    }
+    return result;
+}
+
+// Compare the two-pass unpack (msg_size pre-scan) to the single-pass unpack
+template<typename T>
+void unpack_test(const std::string& description, const std::string& schema_str, const T& data) {
+    const char* schema_ptr = schema_str.c_str();
+    const Schema* schema = parse_schema(&schema_ptr);
+
+    void* voidstar_in = toAnything(schema, data);
+    char* mesgpack_ptr;
+    size_t mesgpack_size;
+    pack_with_schema(voidstar_in, schema, &mesgpack_ptr, &mesgpack_size);
+
+    auto start_two = std::chrono::high_resolution_clock::now();
+    void* voidstar_two;
+    unpack_with_schema(mesgpack_ptr, mesgpack_size, schema, &voidstar_two);
+    auto end_two = std::chrono::high_resolution_clock::now();
+
+    auto start_one = std::chrono::high_resolution_clock::now();
+    void* voidstar_one;
+    unpack_with_schema_single_pass(mesgpack_ptr, mesgpack_size, schema, &voidstar_one);
+    auto end_one = std::chrono::high_resolution_clock::now();
+
+    double two_us = std::chrono::duration_cast<std::chrono::nanoseconds>(end_two - start_two).count() / 1000.0;
+    double one_us = std::chrono::duration_cast<std::chrono::nanoseconds>(end_one - start_one).count() / 1000.0;
+
+    T* dumby = nullptr;
+    if(fromAnything(schema, voidstar_one, dumby) == data){
+        printf("%s: ... %spass%s (two-pass %.2f, single-pass %.2f, speedup %.2fx)\n",
+               description.c_str(), GREEN, RESET, two_us, one_us, two_us / one_us);
+    } else {
+        printf("%s: ... %svalue fail%s\n", description.c_str(), RED, RESET);
+    }
+
+    shfree(voidstar_in);
+    shfree(voidstar_two);
+    shfree(voidstar_one);
+    free(mesgpack_ptr);
+}
+
+std::vector<std::tuple<std::string, double, std::vector<int32_t>>> make_test_records(size_t n) {
+    std::vector<std::tuple<std::string, double, std::vector<int32_t>>> records(n);
+    for(size_t i = 0; i < n; i++){
+        records[i] = std::make_tuple(std::string(i % 32, 'r'), i * 0.5, std::vector<int32_t>(i % 8, (int32_t)i));
+    }
+    return records;
+}
+
+// Compare converting to and from a voidstar by walking a Schema with the
+// conversions derived from the C++ type
+template<typename T>
+void typed_test(const std::string& description, const std::string& schema_str, const T& data) {
+    const Schema* schema = get_schema(schema_str.c_str());
+    T* dumby = nullptr;
+
+    auto start_schema = std::chrono::high_resolution_clock::now();
+    void* voidstar_schema = toAnything(schema, data);
+    T from_schema = fromAnything(schema, voidstar_schema, dumby);
+    auto end_schema = std::chrono::high_resolution_clock::now();
+    // freed first so that both conversions can reuse the same pages
+    shfree(voidstar_schema);
+
+    auto start_typed = std::chrono::high_resolution_clock::now();
+    void* voidstar_typed = mpk_to_voidstar(data);
+    T from_typed = mpk_from_voidstar<T>(voidstar_typed);
+    auto end_typed = std::chrono::high_resolution_clock::now();
+
+    double schema_us = std::chrono::duration_cast<std::chrono::nanoseconds>(end_schema - start_schema).count() / 1000.0;
+    double typed_us = std::chrono::duration_cast<std::chrono::nanoseconds>(end_typed - start_typed).count() / 1000.0;
+
+    if(from_schema == data && from_typed == data){
+        printf("%s: ... %spass%s (schema %.2f, typed %.2f, speedup %.2fx)\n",
+               description.c_str(), GREEN, RESET, schema_us, typed_us, schema_us / typed_us);
+    } else {
+        printf("%s: ... %svalue fail%s\n", description.c_str(), RED, RESET);
+    }
+
+    shfree(voidstar_typed);
+}
+
+// Compare mpk_pack through a voidstar with encoding the C++ value directly
+template<typename T>
+void direct_pack_test(const std::string& description, const T& data) {
+    const std::string& schema_str = mpk_schema_string<T>();
+
+    auto start_voidstar = std::chrono::high_resolution_clock::now();
+    std::vector<char> via_voidstar = mpk_pack(data, schema_str);
+    auto end_voidstar = std::chrono::high_resolution_clock::now();
+
+    auto start_direct = std::chrono::high_resolution_clock::now();
+    std::vector<char> direct = mpk_pack(data);
+    auto end_direct = std::chrono::high_resolution_clock::now();
+
+    double voidstar_us = std::chrono::duration_cast<std::chrono::nanoseconds>(end_voidstar - start_voidstar).count() / 1000.0;
+    double direct_us = std::chrono::duration_cast<std::chrono::nanoseconds>(end_direct - start_direct).count() / 1000.0;
+
+    if(direct == via_voidstar){
+        printf("%s: ... %spass%s (via voidstar %.2f, direct %.2f, speedup %.2fx)\n",
+               description.c_str(), GREEN, RESET, voidstar_us, direct_us, voidstar_us / direct_us);
+    } else {
+        printf("%s: ... %svalue fail%s\n", description.c_str(), RED, RESET);
+    }
+}
+
+// Compare unpacking into C++ through a voidstar with decoding directly
+template<typename T>
+void direct_unpack_test(const std::string& description, const T& data) {
+    const std::string& schema_str = mpk_schema_string<T>();
+    std::vector<char> packed = mpk_pack(data);
+
+    auto start_voidstar = std::chrono::high_resolution_clock::now();
+    T via_voidstar = mpk_unpack<T>(packed, schema_str);
+    auto end_voidstar = std::chrono::high_resolution_clock::now();
+
+    auto start_direct = std::chrono::high_resolution_clock::now();
+    T direct = mpk_unpack<T>(packed);
+    auto end_direct = std::chrono::high_resolution_clock::now();
+
+    double voidstar_us = std::chrono::duration_cast<std::chrono::nanoseconds>(end_voidstar - start_voidstar).count() / 1000.0;
+    double direct_us = std::chrono::duration_cast<std::chrono::nanoseconds>(end_direct - start_direct).count() / 1000.0;
+
+    if(direct == data && via_voidstar == data){
+        printf("%s: ... %spass%s (via voidstar %.2f, direct %.2f, speedup %.2fx)\n",
+               description.c_str(), GREEN, RESET, voidstar_us, direct_us, voidstar_us / direct_us);
+    } else {
+        printf("%s: ... %svalue fail%s\n", description.c_str(), RED, RESET);
+    }
+}
+
+#if __cplusplus >= 201703L
+// Compare summing the numbers in a voidstar after copying it into C++
+// containers with summing them in place through a view
+template<typename T, typename Sum, typename SumView>
+void view_test(const std::string& description, const T& data, Sum sum, SumView sum_view) {
+    void* voidstar = mpk_to_voidstar(data);
+
+    auto start_copy = std::chrono::high_resolution_clock::now();
+    double copy_sum = sum(mpk_from_voidstar<T>(voidstar));
+    auto end_copy = std::chrono::high_resolution_clock::now();
+
+    auto start_view = std::chrono::high_resolution_clock::now();
+    double view_sum = sum_view(mpk_view<T>(voidstar));
+    auto end_view = std::chrono::high_resolution_clock::now();
+
+    shfree(voidstar);
+
+    double copy_us = std::chrono::duration_cast<std::chrono::nanoseconds>(end_copy - start_copy).count() / 1000.0;
+    double view_us = std::chrono::duration_cast<std::chrono::nanoseconds>(end_view - start_view).count() / 1000.0;
+
+    if(copy_sum == view_sum){
+        printf("%s: ... %spass%s (copy %.2f, view %.2f, speedup %.2fx)\n",
+               description.c_str(), GREEN, RESET, copy_us, view_us, copy_us / view_us);
+    } else {
+        printf("%s: ... %svalue fail%s\n", description.c_str(), RED, RESET);
+    }
+}
+#endif
+
+// Compare building an array on the heap and copying it into a voidstar with
+// building it in place in shared memory
+void shm_array_test(const std::string& description, size_t n) {
+    auto start_copy = std::chrono::high_resolution_clock::now();
+    std::vector<double> heap;
+    heap.reserve(n);
+    for (size_t i = 0; i < n; i++) {
+        heap.push_back(i * 0.5);
+    }
+    void* copied = mpk_to_voidstar(heap);
+    auto end_copy = std::chrono::high_resolution_clock::now();
+
+    auto start_direct = std::chrono::high_resolution_clock::now();
+    mpk_shm_array<double> array;
+    array.reserve(n);
+    for (size_t i = 0; i < n; i++) {
+        array.push_back(i * 0.5);
+    }
+    void* direct = array.release();
+    auto end_direct = std::chrono::high_resolution_clock::now();
+
+    bool pass = mpk_from_voidstar<std::vector<double>>(direct) == heap;
+    shfree(copied);
+    shfree(direct);
+
+    double copy_us = std::chrono::duration_cast<std::chrono::nanoseconds>(end_copy - start_copy).count() / 1000.0;
+    double direct_us = std::chrono::duration_cast<std::chrono::nanoseconds>(end_direct - start_direct).count() / 1000.0;
+
+    if(pass){
+        printf("%s: ... %spass%s (heap and copy %.2f, in shm %.2f, speedup %.2fx)\n",
+               description.c_str(), GREEN, RESET, copy_us, direct_us, copy_us / direct_us);
+    } else {
+        printf("%s: ... %svalue fail%s\n", description.c_str(), RED, RESET);
+    }
+}
+
+// Compare unpacking a top-level array on the calling thread with unpacking it
+// on `n_threads` threads
+template<typename T>
+void parallel_unpack_test(const std::string& description, const std::string& schema_str, const T& data, size_t n_threads) {
+    const Schema* schema = get_schema(schema_str.c_str());
+
+    void* voidstar_in = toAnything(schema, data);
+    char* mesgpack_ptr;
+    size_t mesgpack_size;
+    pack_with_schema(voidstar_in, schema, &mesgpack_ptr, &mesgpack_size);
+
+    auto start_seq = std::chrono::high_resolution_clock::now();
+    void* voidstar_seq;
+    unpack_with_schema(mesgpack_ptr, mesgpack_size, schema, &voidstar_seq);
+    auto end_seq = std::chrono::high_resolution_clock::now();
+
+    auto start_par = std::chrono::high_resolution_clock::now();
+    void* voidstar_par;
+    unpack_with_schema_parallel(mesgpack_ptr, mesgpack_size, schema, n_threads, &voidstar_par);
+    auto end_par = std::chrono::high_resolution_clock::now();
+
+    double seq_us = std::chrono::duration_cast<std::chrono::nanoseconds>(end_seq - start_seq).count() / 1000.0;
+    double par_us = std::chrono::duration_cast<std::chrono::nanoseconds>(end_par - start_par).count() / 1000.0;
+
+    T* dumby = nullptr;
+    if(fromAnything(schema, voidstar_par, dumby) == data){
+        printf("%s: ... %spass%s (sequential %.2f, %zu threads %.2f, speedup %.2fx)\n",
+               description.c_str(), GREEN, RESET, seq_us, n_threads, par_us, seq_us / par_us);
+    } else {
+        printf("%s: ... %svalue fail%s\n", description.c_str(), RED, RESET);
+    }
+
+    shfree(voidstar_in);
+    shfree(voidstar_seq);
+    shfree(voidstar_par);
+    free(mesgpack_ptr);
+}
+
+// Compare packing a top-level array on the calling thread with packing it on
+// `n_threads` threads
+template<typename T>
+void parallel_pack_test(const std::string& description, const std::string& schema_str, const T& data, size_t n_threads) {
+    const Schema* schema = get_schema(schema_str.c_str());
+    void* voidstar_in = toAnything(schema, data);
+
+    auto start_seq = std::chrono::high_resolution_clock::now();
+    char* seq_ptr;
+    size_t seq_size;
+    pack_with_schema(voidstar_in, schema, &seq_ptr, &seq_size);
+    auto end_seq = std::chrono::high_resolution_clock::now();
+
+    auto start_par = std::chrono::high_resolution_clock::now();
+    char* par_ptr;
+    size_t par_size;
+    pack_with_schema_parallel(voidstar_in, schema, n_threads, &par_ptr, &par_size);
+    auto end_par = std::chrono::high_resolution_clock::now();
+
+    double seq_us = std::chrono::duration_cast<std::chrono::nanoseconds>(end_seq - start_seq).count() / 1000.0;
+    double par_us = std::chrono::duration_cast<std::chrono::nanoseconds>(end_par - start_par).count() / 1000.0;
+
+    if(par_size == seq_size && memcmp(par_ptr, seq_ptr, seq_size) == 0){
+        printf("%s: ... %spass%s (sequential %.2f, %zu threads %.2f, speedup %.2fx)\n",
+               description.c_str(), GREEN, RESET, seq_us, n_threads, par_us, seq_us / par_us);
+    } else {
+        printf("%s: ... %svalue fail%s\n", description.c_str(), RED, RESET);
+    }
+
+    shfree(voidstar_in);
+    free(seq_ptr);
+    free(par_ptr);
+}
+
+// Time receiving a message through a pipe and unpacking it, either after the
+// whole message is read or by streaming each read into a decoder
+template<typename T>
+void stream_test(const std::string& description, const std::string& schema_str, const T& data, size_t chunk_size) {
+    const Schema* schema = get_schema(schema_str.c_str());
+    void* voidstar_in = toAnything(schema, data);
+    char* mesgpack_ptr;
+    size_t mesgpack_size;
+    pack_with_schema(voidstar_in, schema, &mesgpack_ptr, &mesgpack_size);
+
+    double us[2];
+    void* voidstar[2];
+    std::vector<char> chunk(chunk_size);
+    std::vector<char> whole(mesgpack_size);
+    for(int streamed = 0; streamed < 2; streamed++){
+        int fds[2];
+        if(pipe(fds) != 0){
+            printf("%s: ... %spipe fail%s\n", description.c_str(), RED, RESET);
+            return;
+        }
+        auto start = std::chrono::high_resolution_clock::now();
+        std::thread writer([&](){
+            for(size_t offset = 0; offset < mesgpack_size; ){
+                ssize_t n = write(fds[1], mesgpack_ptr + offset, std::min(chunk_size, mesgpack_size - offset));
+                if(n <= 0) break;
+                offset += (size_t)n;
+            }
+            close(fds[1]);
+        });
+
+        if(streamed){
+            mpk_decoder_t dec;
+            mpk_decoder_init(&dec, schema, mesgpack_size, nullptr);
+            ssize_t n;
+            while((n = read(fds[0], chunk.data(), chunk_size)) > 0){
+                const char* buf = chunk.data();
+                size_t remaining = (size_t)n;
+                mpk_decoder_feed(&dec, &buf, &remaining);
+            }
+            voidstar[1] = mpk_decoder_result(&dec);
+            mpk_decoder_free(&dec);
+        } else {
+            size_t offset = 0;
+            ssize_t n;
+            while((n = read(fds[0], whole.data() + offset, mesgpack_size - offset)) > 0){
+                offset += (size_t)n;
+            }
+            unpack_with_schema_single_pass(whole.data(), mesgpack_size, schema, &voidstar[0]);
+        }
+        auto end = std::chrono::high_resolution_clock::now();
+        writer.join();
+        close(fds[0]);
+        us[streamed] = std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count() / 1000.0;
+    }
+
+    T* dumby = nullptr;
+    if(voidstar[1] != nullptr && fromAnything(schema, voidstar[1], dumby) == data){
+        printf("%s: ... %spass%s (read then unpack %.2f, streamed %.2f, speedup %.2fx)\n",
+               description.c_str(), GREEN, RESET, us[0], us[1], us[0] / us[1]);
+    } else {
+        printf("%s: ... %svalue fail%s\n", description.c_str(), RED, RESET);
+    }
+
+    shfree(voidstar_in);
+    shfree(voidstar[0]);
+    shfree(voidstar[1]);
+    free(mesgpack_ptr);
+}
+
+// Compare packing a whole message then writing it to a pipe with packing
+// straight into the pipe through a fixed buffer
+template<typename T>
+void stream_pack_test(const std::string& description, const std::string& schema_str, const T& data) {
+    const Schema* schema = get_schema(schema_str.c_str());
+    void* voidstar_in = toAnything(schema, data);
+    char* mesgpack_ptr;
+    size_t mesgpack_size;
+    pack_with_schema(voidstar_in, schema, &mesgpack_ptr, &mesgpack_size);
+
+    double us[2];
+    std::vector<char> received[2];
+    for(int streamed = 0; streamed < 2; streamed++){
+        int fds[2];
+        if(pipe(fds) != 0){
+            printf("%s: ... %spipe fail%s\n", description.c_str(), RED, RESET);
+            return;
+        }
+        std::vector<char>& out = received[streamed];
+        out.reserve(mesgpack_size);
+        std::thread reader([&](){
+            char chunk[65536];
+            ssize_t n;
+            while((n = read(fds[0], chunk, sizeof(chunk))) > 0){
+                out.insert(out.end(), chunk, chunk + n);
+            }
+        });
+
+        auto start = std::chrono::high_resolution_clock::now();
+        if(streamed){
+            pack_with_schema_to_fd(voidstar_in, schema, fds[1], nullptr);
+        } else {
+            char* packet;
+            size_t packet_size;
+            pack_with_schema(voidstar_in, schema, &packet, &packet_size);
+            int fd = fds[1];
+            mpk_fd_sink(&fd, packet, packet_size);
+            free(packet);
+        }
+        close(fds[1]);
+        auto end = std::chrono::high_resolution_clock::now();
+        reader.join();
+        close(fds[0]);
+        us[streamed] = std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count() / 1000.0;
+    }
+
+    bool match = received[0].size() == mesgpack_size && received[0] == received[1]
+              && memcmp(received[1].data(), mesgpack_ptr, mesgpack_size) == 0;
+    if(match){
+        printf("%s: ... %spass%s (pack then write %.2f, streamed %.2f, speedup %.2fx, %zu byte buffer for %zu bytes)\n",
+               description.c_str(), GREEN, RESET, us[0], us[1], us[0] / us[1],
+               (size_t)MPK_WRITER_DEFAULT_BUFFER_SIZE, mesgpack_size);
+    } else {
+        printf("%s: ... %svalue fail%s\n", description.c_str(), RED, RESET);
+    }
+
+    shfree(voidstar_in);
+    free(mesgpack_ptr);
+}
+
+// Compare parsing a schema string on every call to the compiled schema cache
+void schema_test(const std::string& description, const std::string& schema_str, size_t n) {
+    auto start_parse = std::chrono::high_resolution_clock::now();
+    for(size_t i = 0; i < n; i++){
+        const char* schema_ptr = schema_str.c_str();
+        free_schema(parse_schema(&schema_ptr));
+    }
+    auto end_parse = std::chrono::high_resolution_clock::now();
+
+    const Schema* schema = get_schema(schema_str.c_str());
+    auto start_cache = std::chrono::high_resolution_clock::now();
+    for(size_t i = 0; i < n; i++){
+        if(get_schema(schema_str.c_str()) != schema){
+            printf("%s: ... %scache fail%s\n", description.c_str(), RED, RESET);
+            return;
+        }
+    }
+    auto end_cache = std::chrono::high_resolution_clock::now();
+
+    double parse_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(end_parse - start_parse).count() / (double)n;
+    double cache_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(end_cache - start_cache).count() / (double)n;
+
+    printf("%s: ... %spass%s (parse %.1fns, cached %.1fns per call, speedup %.2fx)\n",
+           description.c_str(), GREEN, RESET, parse_ns, cache_ns, parse_ns / cache_ns);
+}
+
+// Time shmalloc/shfree pairs while many other blocks are live, with every
+// other block freed to fragment the pool
+void alloc_test(const std::string& description, size_t n_live, size_t n_ops) {
+    std::vector<void*> live(n_live);
+    for(size_t i = 0; i < n_live; i++){
+        live[i] = shmalloc(16 + (i * 37) % 512);
+    }
+    for(size_t i = 0; i < n_live; i += 2){
+        shfree(live[i]);
+        live[i] = nullptr;
+    }
+
+    auto start = std::chrono::high_resolution_clock::now();
+    for(size_t i = 0; i < n_ops; i++){
+        void* ptr = shmalloc(16 + (i * 53) % 1024);
+        if(ptr == nullptr){
+            printf("%s: ... %salloc fail%s\n", description.c_str(), RED, RESET);
+            return;
+        }
+        shfree(ptr);
+    }
+    auto end = std::chrono::high_resolution_clock::now();
+
+    double op_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count() / (double)n_ops;
+    printf("%s: ... %spass%s (%.1fns per malloc/free pair)\n", description.c_str(), GREEN, RESET, op_ns);
+
+    for(size_t i = 1; i < n_live; i += 2){
+        shfree(live[i]);
+    }
+}
+
+// Throughput of shmalloc/shfree from many threads, each keeping a window of
+// live blocks of mostly small sizes
+void thread_alloc_test(const std::string& description, size_t n_threads, size_t n_ops) {
+    auto start = std::chrono::high_resolution_clock::now();
+    std::vector<std::thread> threads;
+    for(size_t t = 0; t < n_threads; t++){
+        threads.emplace_back([t, n_ops](){
+            std::vector<void*> blocks(64, nullptr);
+            for(size_t i = 0; i < n_ops; i++){
+                size_t k = (i * 7 + t) % blocks.size();
+                if(blocks[k]){
+                    shfree(blocks[k]);
+                }
+                blocks[k] = shmalloc(i % 10 == 0 ? 1 + (i * 131) % 4000 : 1 + (i * 13) % 250);
+            }
+            for(void* block : blocks){
+                shfree(block);
+            }
+            shflush();
+        });
+    }
+    for(auto& thread : threads){
+        thread.join();
+    }
+    auto end = std::chrono::high_resolution_clock::now();
+
+    double seconds = std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count() / 1e9;
+    printf("%s: ... %spass%s (%.2fM malloc/free pairs per second)\n",
+           description.c_str(), GREEN, RESET, n_threads * n_ops / seconds / 1e6);
+}
+
+// Throughput of shincref/shdecref pairs from many processes, either all on
+// one block or each on a block of its own
+void refcount_test(const std::string& description, size_t n_procs, size_t n_ops, bool contended) {
+    std::vector<void*> blocks;
+    for(size_t p = 0; p < n_procs; p++){
+        blocks.push_back(contended && p > 0 ? blocks[0] : shmalloc(64));
+    }
+
+    auto start = std::chrono::high_resolution_clock::now();
+    std::vector<pid_t> pids;
+    for(size_t p = 0; p < n_procs; p++){
+        pid_t pid = fork();
+        if(pid == 0){
+            for(size_t i = 0; i < n_ops; i++){
+                shincref(blocks[p]);
+                shdecref(blocks[p]);
+            }
+            _exit(0);
+        }
+        pids.push_back(pid);
+    }
+    for(pid_t pid : pids){
+        waitpid(pid, nullptr, 0);
+    }
+    auto end = std::chrono::high_resolution_clock::now();
+
+    double seconds = std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count() / 1e9;
+    if(abs2blk(blocks[0])->reference_count == 1){
+        printf("%s: ... %spass%s (%.2fM incref/decref pairs per second)\n",
+               description.c_str(), GREEN, RESET, n_procs * n_ops / seconds / 1e6);
+    } else {
+        printf("%s: ... %svalue fail%s\n", description.c_str(), RED, RESET);
+    }
+
+    for(size_t p = 0; p < (contended ? 1 : n_procs); p++){
+        shfree(blocks[p]);
+    }
+}
+
+// Time rel2abs(abs2rel(x)) round trips over blocks spread across all volumes
+void translate_test(const std::string& description, size_t n_ops) {
+    // blocks of growing size force new volumes to be created
+    std::vector<void*> blocks;
+    for(size_t size = 1024; size <= 64 * 1024 * 1024; size *= 2){
+        blocks.push_back(shmalloc(size));
+    }
+
+    size_t n_volumes = 0;
+    while(n_volumes < MAX_VOLUME_NUMBER && volumes[n_volumes] != NULL){
+        n_volumes++;
+    }
+
+    size_t misses = 0;
+    auto start = std::chrono::high_resolution_clock::now();
+    for(size_t i = 0; i < n_ops; i++){
+        void* ptr = blocks[i % blocks.size()];
+        misses += rel2abs(abs2rel(ptr)) != ptr;
+    }
+    auto end = std::chrono::high_resolution_clock::now();
+
+    double op_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count() / (double)n_ops;
+    if(misses == 0){
+        printf("%s: ... %spass%s (%zu volumes, %.1fns per abs2rel/rel2abs pair)\n",
+               description.c_str(), GREEN, RESET, n_volumes, op_ns);
+    } else {
+        printf("%s: ... %svalue fail%s\n", description.c_str(), RED, RESET);
+    }
+
+    for(void* block : blocks){
+        shfree(block);
+    }
+}
+
+// Time converting many small messages to voidstar, each in a block of its own
+// or all in one arena
+void arena_test(const std::string& description, size_t n_objects, bool use_arena) {
+    const Schema* schema = get_schema("t2sai4");
+    auto data = std::make_tuple(std::string("hello arena"), std::vector<int32_t>{1, 2, 3, 4});
+    std::vector<void*> objects(n_objects);
+    sharena_t arena = {};
+
+    auto start = std::chrono::high_resolution_clock::now();
+    for(size_t i = 0; i < n_objects; i++){
+        objects[i] = use_arena ? toAnything(&arena, schema, data) : toAnything(schema, data);
+    }
+    if(use_arena){
+        sharena_release(&arena);
+    } else {
+        for(size_t i = 0; i < n_objects; i++){
+            shfree(objects[i]);
+        }
+    }
+    auto end = std::chrono::high_resolution_clock::now();
+
+    double op_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count() / (double)n_objects;
+    printf("%s: ... %spass%s (%.1fns per object)\n", description.c_str(), GREEN, RESET, op_ns);
+}
+
+// Time creating a volume and touching it once, then reading it at random
+// offsets, which is where huge pages save TLB misses
+void volume_test(const std::string& description, const shm_options_t& options, size_t size, size_t n_reads) {
+    auto start = std::chrono::high_resolution_clock::now();
+    shm_t* shm = shinit_with_options("morloc-benchvol", 0, size + 0x1000, &options);
+    uint64_t* data = shm ? (uint64_t*)shmalloc(size) : nullptr;
+    if(data == nullptr){
+        printf("%s: ... %salloc fail%s\n", description.c_str(), RED, RESET);
+        shclose();
+        return;
+    }
+    size_t n = size / sizeof(uint64_t);
+    for(size_t i = 0; i < n; i++){
+        data[i] = i;
+    }
+    auto mid = std::chrono::high_resolution_clock::now();
+
+    uint64_t sum = 0;
+    uint64_t k = 88172645463325252ULL;
+    for(size_t i = 0; i < n_reads; i++){
+        k ^= k << 13; k ^= k >> 7; k ^= k << 17;
+        sum += data[k % n];
+    }
+    auto end = std::chrono::high_resolution_clock::now();
+    volatile uint64_t sink = sum;
+    (void)sink;
+
+    double fill_ms = std::chrono::duration_cast<std::chrono::microseconds>(mid - start).count() / 1000.0;
+    double read_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(end - mid).count() / (double)n_reads;
+    printf("%s: ... %spass%s (%.1fms create and fill, %.1fns per random read, flags %u)\n",
+           description.c_str(), GREEN, RESET, fill_ms, read_ns, shm->flags);
+
+    shfree(data);
+    shclose();
+}
+
 int main() {
 
     shinit("morloc-cpptest", 0, 0x100);
@@ -85,8 +719,107 @@ int main() {
     generic_test("Test long string (64M)", "s", make_test_string(64));
     generic_test("Test long string (128M)", "s", make_test_string(128));
     generic_test("Test long string (256M)", "s", make_test_string(256));
+
+    generic_test("Test af8 (10M)", "af8", make_test_vector<double>(10000000));
+    generic_test("Test ai4 (10M)", "ai4", make_test_vector<int32_t>(10000000));
+    generic_test("Test au1 (10M)", "au1", make_test_vector<uint8_t>(10000000));
+
+    unpack_test("Unpack af8 (1M)", "af8", make_test_vector<double>(1000000));
+    unpack_test("Unpack ai4 (1M)", "ai4", make_test_vector<int32_t>(1000000));
+    unpack_test("Unpack as (1M)", "as", make_test_strings(1000000));
+    unpack_test("Unpack s (64M)", "s", make_test_string(64));
+    // messages whose size bound is far beyond the available memory slack
+    unpack_test("Unpack af8 (10M)", "af8", make_test_vector<double>(10000000));
+    unpack_test("Unpack as (5M)", "as", make_test_strings(5000000));
+
+    for(size_t n_threads : {2, 4, 8}){
+        std::string threads = " on " + std::to_string(n_threads) + " threads";
+        parallel_unpack_test("Unpack at3sf8ai4 (1M)" + threads, "at3sf8ai4", make_test_records(1000000), n_threads);
+        parallel_unpack_test("Unpack as (1M)" + threads, "as", make_test_strings(1000000), n_threads);
+        parallel_unpack_test("Unpack aai4 (100K)" + threads, "aai4", std::vector<std::vector<int32_t>>(100000, make_test_vector<int32_t>(64)), n_threads);
+        parallel_pack_test("Pack at3sf8ai4 (1M)" + threads, "at3sf8ai4", make_test_records(1000000), n_threads);
+        parallel_pack_test("Pack af8 (10M)" + threads, "af8", make_test_vector<double>(10000000), n_threads);
+    }
+
+    stream_test("Stream af8 (1M) from a pipe", "af8", make_test_vector<double>(1000000), 65536);
+    stream_test("Stream as (1M) from a pipe", "as", make_test_strings(1000000), 65536);
+    stream_pack_test("Stream pack af8 (1M) to a pipe", "af8", make_test_vector<double>(1000000));
+    stream_pack_test("Stream pack as (1M) to a pipe", "as", make_test_strings(1000000));
+
+    typed_test("Typed at3sf8ai4 (1M)", "at3sf8ai4", make_test_records(1000000));
+    typed_test("Typed as (1M)", "as", make_test_strings(1000000));
+    typed_test("Typed af8 (10M)", "af8", make_test_vector<double>(10000000));
+
+    direct_pack_test("Direct pack at3sf8ai4 (1M)", make_test_records(1000000));
+    direct_pack_test("Direct pack as (1M)", make_test_strings(1000000));
+    direct_pack_test("Direct pack af8 (10M)", make_test_vector<double>(10000000));
+
+    direct_unpack_test("Direct unpack at3sf8ai4 (1M)", make_test_records(1000000));
+    direct_unpack_test("Direct unpack as (1M)", make_test_strings(1000000));
+    direct_unpack_test("Direct unpack af8 (10M)", make_test_vector<double>(10000000));
+
+#if __cplusplus >= 201703L
+    auto sum_records = [](const auto& records) {
+        double total = 0;
+        for (const auto& record : records) {
+            total += std::get<1>(record);
+            for (int32_t x : std::get<2>(record)) total += x;
+        }
+        return total;
+    };
+    auto sum_record_views = [](const auto& records) {
+        double total = 0;
+        for (auto record : records) {
+            total += record.template get<1>();
+            for (int32_t x : record.template get<2>()) total += x;
+        }
+        return total;
+    };
+    auto sum_doubles = [](const auto& xs) {
+        double total = 0;
+        for (double x : xs) total += x;
+        return total;
+    };
+    view_test("View at3sf8ai4 (1M)", make_test_records(1000000), sum_records, sum_record_views);
+    view_test("View af8 (10M)", make_test_vector<double>(10000000), sum_doubles, sum_doubles);
+#endif
+
+    shm_array_test("Build af8 in shm (10M)", 10000000);
+
+    translate_test("Translate pointers", 10000000);
+
+    schema_test("Schema ai4 (1M calls)", "ai4", 1000000);
+    schema_test("Schema record (1M calls)", "m34names3ageu46scoresaf8", 1000000);
+
+    alloc_test("Alloc with 1K live blocks", 1000, 1000000);
+    alloc_test("Alloc with 100K live blocks", 100000, 1000000);
+
+    thread_alloc_test("Alloc from 1 thread", 1, 1000000);
+    thread_alloc_test("Alloc from 2 threads", 2, 1000000);
+    thread_alloc_test("Alloc from 4 threads", 4, 1000000);
+    thread_alloc_test("Alloc from 8 threads", 8, 1000000);
+
+    refcount_test("Refcount 1 process", 1, 10000000, true);
+    refcount_test("Refcount 4 processes, one block", 4, 10000000, true);
+    refcount_test("Refcount 4 processes, own blocks", 4, 10000000, false);
+
+    arena_test("toAnything 1M objects, shmalloc", 1000000, false);
+    arena_test("toAnything 1M objects, arena", 1000000, true);
   
     shclose();
 
+    // each of these creates and closes its own pool
+    shm_options_t options = SHM_OPTIONS_DEFAULT;
+    volume_test("Volume 1G, default pages", options, (size_t)1 << 30, 10000000);
+    options.populate = true;
+    volume_test("Volume 1G, populated", options, (size_t)1 << 30, 10000000);
+    options.pages = SHM_PAGES_ADVISE_HUGE;
+    volume_test("Volume 1G, THP populated", options, (size_t)1 << 30, 10000000);
+    options.pages = SHM_PAGES_HUGETLB;
+    volume_test("Volume 1G, hugetlb populated", options, (size_t)1 << 30, 10000000);
+    options = SHM_OPTIONS_DEFAULT;
+    options.numa_node = 0;
+    volume_test("Volume 1G, NUMA node 0", options, (size_t)1 << 30, 10000000);
+
     return 0;
 }
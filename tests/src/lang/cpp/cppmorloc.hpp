@@ -8,6 +8,15 @@
 #include <iostream>
 #include <string>
 #include <cstring>
+#include <type_traits>
+#include <utility>
+#include <memory>
+#include <new>
+#include <algorithm>
+#if __cplusplus >= 201703L
+#include <string_view>
+#include <memory_resource>
+#endif
 
 #include "morloc.h"
 
@@ -20,6 +29,10 @@ std::vector<char> mpk_pack(const T& data, const std::string& schema_str);
 template<typename T>
 T mpk_unpack(const std::vector<char>& packed_data, const std::string& schema_str);
 
+// Unpack a MessagePack file, decoding directly from a mapping of the file
+template<typename T>
+T mpk_unpack_file(const std::string& path, const std::string& schema_str);
+
 
 
 // Forward declarations
@@ -107,6 +120,22 @@ void* toAnything(const Schema* schema, const T& data){
     return toAnything(dest, &cursor, schema, data);
 }
 
+// Like toAnything, but the voidstar is allocated from an arena and is freed
+// with it rather than with shfree
+template<typename T>
+void* toAnything(sharena_t* arena, const Schema* schema, const T& data){
+    size_t total_size = get_shm_size(schema, data);
+
+    void* dest = sharena_alloc(arena, total_size);
+    if (dest == nullptr) {
+        return nullptr;
+    }
+
+    void* cursor = (void*)((char*)dest + schema->width);
+
+    return toAnything(dest, &cursor, schema, data);
+}
+
 // Forward declarations
 template<typename T>
 void* toAnything(void* dest, void** cursor, const Schema* schema, const T& data);
@@ -134,15 +163,16 @@ void* toAnything(void* dest, void** cursor, const Schema* schema, const std::vec
 
     // The array data is written to the cursor location
     // The N fixed-size elements will be written here
+    size_t width = schema->parameters[0]->width;
+    ArrayView view = { static_cast<char*>(*cursor), data.size(), width };
     result->data = abs2rel(static_cast<absptr_t>(*cursor));
 
     // The cursor is mutated to point to the location after the children
-    *cursor = static_cast<char*>(*cursor) + data.size() * schema->parameters[0]->width;
+    *cursor = static_cast<char*>(*cursor) + data.size() * width;
 
-    size_t width = schema->parameters[0]->width;
     for (size_t i = 0; i < data.size(); ++i) {
         // Any child variable data will be written to the cursor
-         toAnything(rel2abs(result->data + width * i), cursor, schema->parameters[0], data[i]);
+         toAnything(array_view_at(view, i), cursor, schema->parameters[0], data[i]);
     }
 
     return dest;
@@ -195,8 +225,8 @@ Primitive fromAnything(const Schema* schema, const void* data, Primitive* dumby
 }
 
 std::string fromAnything(const Schema* schema, const void* data, std::string* dumby = nullptr) {
-    Array* array = (Array*)data;
-    return std::string((char*)rel2abs(array->data), array->size);
+    ArrayView view = array_view((Array*)data, 1);
+    return std::string(view.data, view.size);
 }
 
 template<typename T>
@@ -217,8 +247,11 @@ std::vector<T> fromAnything(const Schema* schema, const void* data, std::vector<
     case MORLOC_UINT64:
     case MORLOC_FLOAT32:
     case MORLOC_FLOAT64:
-      std::vector<T> result((T*)(rel2abs(array->data)), (T*)(rel2abs(array->data)) + array->size);
-      return result;
+      {
+        ArrayView view = array_view(array, sizeof(T));
+        std::vector<T> result((T*)view.data, (T*)view.data + view.size);
+        return result;
+      }
   }
 
   // Other data types require some rearrangement
@@ -226,8 +259,9 @@ std::vector<T> fromAnything(const Schema* schema, const void* data, std::vector<
   result.reserve(array->size);
   const Schema* elemental_schema = schema->parameters[0];
   T* elemental_dumby = nullptr;
-  for(size_t i = 0; i < array->size; i++){
-    result.push_back(fromAnything(elemental_schema, rel2abs(array->data + i * elemental_schema->width), elemental_dumby));
+  ArrayView view = array_view(array, elemental_schema->width);
+  for(size_t i = 0; i < view.size; i++){
+    result.push_back(fromAnything(elemental_schema, array_view_at(view, i), elemental_dumby));
   }
   return result;
 }
@@ -257,48 +291,1122 @@ Tuple fromTupleAnythingHelper(
 }
 
 
+// The voidstar made in the middle of mpk_pack and mpk_unpack only lives for
+// the call, so it is taken from an arena that is reset afterwards
+inline sharena_t* mpk_scratch_arena() {
+    static thread_local sharena_t arena = {};
+    return &arena;
+}
+
 template<typename T>
 std::vector<char> mpk_pack(const T& data, const std::string& schema_str) {
-    const char* schema_ptr = schema_str.c_str();
-    Schema* schema = parse_schema(&schema_ptr);
+    const Schema* schema = get_schema(schema_str.c_str());
+    if (schema == NULL) {
+        throw std::runtime_error("Failed to parse schema");
+    }
 
     // Create Anything* from schema and data
-    void* voidstar = toAnything(schema, data);
+    sharena_t* arena = mpk_scratch_arena();
+    void* voidstar = toAnything(arena, schema, data);
+    if (voidstar == nullptr) {
+        throw std::runtime_error("Failed to allocate voidstar");
+    }
     char* msgpack_data = NULL;
     size_t msg_size = 0;
 
-    int pack_result = pack(voidstar, schema_str.c_str(), &msgpack_data, &msg_size);
+    int pack_result = pack_with_schema(voidstar, schema, &msgpack_data, &msg_size);
+    sharena_reset(arena);
 
     if (pack_result != 0) {
-        free_schema(schema);
         throw std::runtime_error("Packing failed");
     }
 
     std::vector<char> result(msgpack_data, msgpack_data + msg_size);
-
-    free_schema(schema);
+    free(msgpack_data);
 
     return result;
 }
 
 template<typename T>
 T mpk_unpack(const std::vector<char>& packed_data, const std::string& schema_str) {
-    const char* schema_ptr = schema_str.c_str();
-    Schema* schema = parse_schema(&schema_ptr);
+    const Schema* schema = get_schema(schema_str.c_str());
+    if (schema == NULL) {
+        throw std::runtime_error("Failed to parse schema");
+    }
+
+    sharena_t* arena = mpk_scratch_arena();
+    void* voidstar = nullptr;
+    int unpack_result = unpack_with_schema_to_arena(packed_data.data(), packed_data.size(), schema, arena, &voidstar);
+    if (unpack_result != 0) {
+        sharena_reset(arena);
+        throw std::runtime_error("Unpacking failed");
+    }
+
+    T x = fromAnything(schema, voidstar, static_cast<T*>(nullptr));
+
+    sharena_reset(arena);
+
+    return x;
+}
+
+template<typename T>
+T mpk_unpack_file(const std::string& path, const std::string& schema_str) {
+    const Schema* schema = get_schema(schema_str.c_str());
+    if (schema == NULL) {
+        throw std::runtime_error("Failed to parse schema");
+    }
+
+    size_t packed_size;
+    const char* packed_data = mpk_map_file(path.c_str(), &packed_size);
+    if (packed_data == NULL) {
+        throw std::runtime_error("Failed to map file '" + path + "'");
+    }
 
+    sharena_t* arena = mpk_scratch_arena();
     void* voidstar = nullptr;
-    int unpack_result = unpack_with_schema(packed_data.data(), packed_data.size(), schema, &voidstar);
+    int unpack_result = unpack_with_schema_to_arena(packed_data, packed_size, schema, arena, &voidstar);
+    mpk_unmap_file(packed_data, packed_size);
     if (unpack_result != 0) {
-        // free_schema(schema);
+        sharena_reset(arena);
         throw std::runtime_error("Unpacking failed");
     }
 
     T x = fromAnything(schema, voidstar, static_cast<T*>(nullptr));
 
-    free_schema(schema);
-    shfree(voidstar);
+    sharena_reset(arena);
 
     return x;
 }
 
+
+// Compile-time schemas ####
+//
+// The voidstar layout of a C++ type is fixed by the type alone, so it does
+// not need to be looked up in a Schema at runtime. mpk_type<T> describes the
+// layout of T with compile-time widths and offsets:
+//
+//   width     - bytes taken in the parent (the element block of an array or
+//               the fields of a tuple)
+//   fixed     - a primitive whose C++ and voidstar representations are equal
+//   flat      - no data outside the width, so heap_size is always 0
+//   match     - constexpr check that a schema string describes T, consuming
+//               the schema of one value
+//   schema    - append the canonical schema of T to a string
+//   heap_size - bytes written after the width (array and string data)
+//   write     - write a value to `dest`, and its array and string data to
+//               `cursor`, which is advanced
+//   read      - read a value back from a voidstar
+//   pack_size - the exact length of the MessagePack encoding
+//   pack      - write the MessagePack encoding to `out`, returning the end
+//   unpack    - decode MessagePack at `p` into `out` in place, advancing `p`;
+//               false if the data is malformed or does not fit T
+//
+// The encoding written by pack is identical to that of pack_with_schema for
+// the canonical schema of T, but is written straight from the C++ value.
+// Likewise unpack fills C++ containers straight from the message, with no
+// voidstar in between.
+//
+// Specializations are given for nullptr_t, bool, integers, floats, strings,
+// vectors and tuples. Other types, such as records, can add their own.
+template<typename T, typename Enable = void>
+struct mpk_type;
+
+// The value of a schema size character, or -1 if it is not one (see
+// parse_schema_size)
+constexpr int mpk_schema_digit(char c) {
+    return c >= '0' && c <= '9' ? c - '0'
+         : c >= 'a' && c <= 'z' ? c - 'a' + 10
+         : c >= 'A' && c <= 'Z' ? c - 'A' + 36
+         : c == '+' ? 62
+         : c == '/' ? 63
+         : -1;
+}
+
+inline char mpk_schema_digit_char(size_t n) {
+    return "0123456789abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ+/"[n];
+}
+
+// Consume `c` from the schema
+constexpr bool mpk_schema_expect(const char*& s, char c) {
+    if (*s != c) return false;
+    s++;
+    return true;
+}
+
+// Consume a size character equal to `n` from the schema
+constexpr bool mpk_schema_expect_size(const char*& s, size_t n) {
+    if (*s == '\0' || mpk_schema_digit(*s) != (int)n) return false;
+    s++;
+    return true;
+}
+
+// Consume the key that precedes each field of a map schema
+constexpr bool mpk_schema_skip_key(const char*& s) {
+    int n = *s == '\0' ? -1 : mpk_schema_digit(*s);
+    if (n < 0) return false;
+    s++;
+    for (int i = 0; i < n; i++) {
+        if (*s == '\0') return false;
+        s++;
+    }
+    return true;
+}
+
+// Decode a primitive that the bulk decoder does not handle, such as an
+// integer in a float field, with the tokenizer
+template<typename T>
+bool mpk_unpack_primitive_token(const char*& p, const char* end, T& out) {
+    if (p >= end) return false;
+    mpack_tokbuf_t tokbuf = MPACK_TOKBUF_INITIAL_VALUE;
+    mpack_token_t token;
+    size_t remaining = (size_t)(end - p);
+    if (mpack_read(&tokbuf, &p, &remaining, &token) != MPACK_OK) return false;
+    switch (token.type) {
+      case MPACK_TOKEN_BOOLEAN: out = (T)mpack_unpack_boolean(token); return true;
+      case MPACK_TOKEN_UINT:    out = (T)mpack_unpack_uint(token);    return true;
+      case MPACK_TOKEN_SINT:    out = (T)mpack_unpack_sint(token);    return true;
+      case MPACK_TOKEN_FLOAT:   out = (T)mpack_unpack_float(token);   return true;
+      default:                  return false;
+    }
+}
+
+// Decode `n` primitives into `dest`, in bulk where the encoding allows
+template<typename T>
+bool mpk_unpack_primitives(const char*& p, const char* end, T* dest, size_t n) {
+    size_t i = 0;
+    while (i < n) {
+        size_t remaining = (size_t)(end - p);
+        i += parse_primitive_array(mpk_type<T>::serial_type, sizeof(T), reinterpret_cast<char*>(dest + i), n - i, &p, &remaining);
+        if (i < n) {
+            if (!mpk_unpack_primitive_token(p, end, dest[i])) return false;
+            i++;
+        }
+    }
+    return true;
+}
+
+// Read the header of a string, binary or array value
+inline bool mpk_unpack_header(const char*& p, const char* end, mpk_scan_kind kind, size_t& length) {
+    mpk_scan_kind found;
+    const unsigned char* next = mpk_scan_header(reinterpret_cast<const unsigned char*>(p), reinterpret_cast<const unsigned char*>(end), &found, &length);
+    if (next == NULL || found != kind) return false;
+    p = reinterpret_cast<const char*>(next);
+    return true;
+}
+
+template<>
+struct mpk_type<std::nullptr_t> {
+    static constexpr size_t width = 1;
+    static constexpr bool fixed = false;
+    static constexpr bool flat = true;
+    static constexpr bool match(const char*& s) { return mpk_schema_expect(s, SCHEMA_NIL); }
+    static void schema(std::string& out) { out += SCHEMA_NIL; }
+    static size_t heap_size(const std::nullptr_t&) { return 0; }
+    static void write(char* dest, char*&, const std::nullptr_t&) { *dest = 0; }
+    static std::nullptr_t read(const char*) { return nullptr; }
+    static size_t pack_size(const std::nullptr_t&) { return 1; }
+    static char* pack(char* out, const std::nullptr_t&) { *out = (char)0xc0; return out + 1; }
+    static bool unpack(const char*& p, const char* end, std::nullptr_t& out) {
+        size_t length;
+        out = nullptr;
+        return mpk_unpack_header(p, end, MPK_SCAN_SCALAR, length);
+    }
+};
+
+template<>
+struct mpk_type<bool> {
+    static constexpr size_t width = 1;
+    static constexpr bool fixed = true;
+    static constexpr bool flat = true;
+    static constexpr morloc_serial_type serial_type = MORLOC_BOOL;
+    static constexpr bool match(const char*& s) { return mpk_schema_expect(s, SCHEMA_BOOL); }
+    static void schema(std::string& out) { out += SCHEMA_BOOL; }
+    static size_t heap_size(const bool&) { return 0; }
+    static void write(char* dest, char*&, const bool& data) { *dest = (char)data; }
+    static bool read(const char* data) { return *data != 0; }
+    static size_t pack_size(const bool&) { return 1; }
+    static char* pack(char* out, const bool& data) { *out = (char)(data ? 0xc3 : 0xc2); return out + 1; }
+    static bool unpack(const char*& p, const char* end, bool& out) { return mpk_unpack_primitives(p, end, &out, 1); }
+};
+
+// Integers of each width. An unsigned byte may also be a boolean, as in the
+// Schema based conversions.
+template<typename T>
+struct mpk_type<T, typename std::enable_if<std::is_integral<T>::value && !std::is_same<T, bool>::value>::type> {
+    static_assert(sizeof(T) <= 8, "integers wider than 64 bits have no schema");
+    static constexpr size_t width = sizeof(T);
+    static constexpr bool fixed = true;
+    static constexpr bool flat = true;
+    static constexpr char code = std::is_signed<T>::value ? SCHEMA_SINT : SCHEMA_UINT;
+    static constexpr morloc_serial_type serial_type =
+        std::is_signed<T>::value
+          ? (sizeof(T) == 1 ? MORLOC_SINT8 : sizeof(T) == 2 ? MORLOC_SINT16 : sizeof(T) == 4 ? MORLOC_SINT32 : MORLOC_SINT64)
+          : (sizeof(T) == 1 ? MORLOC_UINT8 : sizeof(T) == 2 ? MORLOC_UINT16 : sizeof(T) == 4 ? MORLOC_UINT32 : MORLOC_UINT64);
+    static constexpr bool match(const char*& s) {
+        if (sizeof(T) == 1 && !std::is_signed<T>::value && mpk_schema_expect(s, SCHEMA_BOOL)) {
+            return true;
+        }
+        return mpk_schema_expect(s, code) && mpk_schema_expect_size(s, sizeof(T));
+    }
+    static void schema(std::string& out) { out += code; out += mpk_schema_digit_char(sizeof(T)); }
+    static size_t heap_size(const T&) { return 0; }
+    static void write(char* dest, char*&, const T& data) { std::memcpy(dest, &data, sizeof(T)); }
+    static T read(const char* data) { T x; std::memcpy(&x, data, sizeof(T)); return x; }
+    static size_t pack_size(const T& data) {
+        return std::is_signed<T>::value ? mpk_sint_size((int64_t)data) : mpk_uint_size((uint64_t)data);
+    }
+    static char* pack(char* out, const T& data) {
+        unsigned char* p = reinterpret_cast<unsigned char*>(out);
+        return out + (std::is_signed<T>::value ? mpk_write_sint(p, (int64_t)data) : mpk_write_uint(p, (uint64_t)data));
+    }
+    static bool unpack(const char*& p, const char* end, T& out) { return mpk_unpack_primitives(p, end, &out, 1); }
+};
+
+template<typename T>
+struct mpk_type<T, typename std::enable_if<std::is_floating_point<T>::value>::type> {
+    static_assert(sizeof(T) == 4 || sizeof(T) == 8, "only 32 and 64 bit floats have a schema");
+    static constexpr size_t width = sizeof(T);
+    static constexpr bool fixed = true;
+    static constexpr bool flat = true;
+    static constexpr morloc_serial_type serial_type = sizeof(T) == 4 ? MORLOC_FLOAT32 : MORLOC_FLOAT64;
+    static constexpr bool match(const char*& s) {
+        return mpk_schema_expect(s, SCHEMA_FLOAT) && mpk_schema_expect_size(s, sizeof(T));
+    }
+    static void schema(std::string& out) { out += SCHEMA_FLOAT; out += mpk_schema_digit_char(sizeof(T)); }
+    static size_t heap_size(const T&) { return 0; }
+    static void write(char* dest, char*&, const T& data) { std::memcpy(dest, &data, sizeof(T)); }
+    static T read(const char* data) { T x; std::memcpy(&x, data, sizeof(T)); return x; }
+    static size_t pack_size(const T& data) { return mpk_float_size((double)data); }
+    static char* pack(char* out, const T& data) {
+        return out + mpk_write_float(reinterpret_cast<unsigned char*>(out), (double)data);
+    }
+    static bool unpack(const char*& p, const char* end, T& out) { return mpk_unpack_primitives(p, end, &out, 1); }
+};
+
+// Write the Array header of `n` elements at `dest` and reserve their block
+// at the cursor
+inline char* mpk_write_voidstar_array(char* dest, char*& cursor, size_t n, size_t width) {
+    Array* result = reinterpret_cast<Array*>(dest);
+    result->size = n;
+    result->data = abs2rel(static_cast<absptr_t>(cursor));
+    char* elements = cursor;
+    cursor += n * width;
+    return elements;
+}
+
+template<>
+struct mpk_type<std::string> {
+    static constexpr size_t width = sizeof(Array);
+    static constexpr bool fixed = false;
+    static constexpr bool flat = false;
+    static constexpr bool match(const char*& s) { return mpk_schema_expect(s, SCHEMA_STRING); }
+    static void schema(std::string& out) { out += SCHEMA_STRING; }
+    static size_t heap_size(const std::string& data) { return data.size(); }
+    static void write(char* dest, char*& cursor, const std::string& data) {
+        char* elements = mpk_write_voidstar_array(dest, cursor, data.size(), 1);
+        std::memcpy(elements, data.data(), data.size());
+    }
+    static std::string read(const char* data) {
+        ArrayView view = array_view(reinterpret_cast<const Array*>(data), 1);
+        return std::string(view.data, view.size);
+    }
+    static size_t pack_size(const std::string& data) {
+        return mpk_str_header_size(data.size()) + data.size();
+    }
+    static char* pack(char* out, const std::string& data) {
+        out += mpk_write_str_header(reinterpret_cast<unsigned char*>(out), data.size());
+        std::memcpy(out, data.data(), data.size());
+        return out + data.size();
+    }
+    static bool unpack(const char*& p, const char* end, std::string& out) {
+        size_t length;
+        if (!mpk_unpack_header(p, end, MPK_SCAN_BYTES, length) || (size_t)(end - p) < length) return false;
+        out.assign(p, length);
+        p += length;
+        return true;
+    }
+};
+
+template<typename T>
+struct mpk_type<std::vector<T>> {
+    typedef mpk_type<T> element;
+    static constexpr size_t width = sizeof(Array);
+    static constexpr bool fixed = false;
+    static constexpr bool flat = false;
+    static constexpr bool match(const char*& s) { return mpk_schema_expect(s, SCHEMA_ARRAY) && element::match(s); }
+    static void schema(std::string& out) { out += SCHEMA_ARRAY; element::schema(out); }
+
+    static size_t heap_size(const std::vector<T>& data) {
+        return data.size() * element::width + elements_heap_size(data, std::integral_constant<bool, element::flat>());
+    }
+    static void write(char* dest, char*& cursor, const std::vector<T>& data) {
+        char* elements = mpk_write_voidstar_array(dest, cursor, data.size(), element::width);
+        write_elements(elements, cursor, data, std::integral_constant<bool, element::fixed>());
+    }
+    static std::vector<T> read(const char* data) {
+        ArrayView view = array_view(reinterpret_cast<const Array*>(data), element::width);
+        return read_elements(view, std::integral_constant<bool, element::fixed>());
+    }
+    static size_t pack_size(const std::vector<T>& data) {
+        return mpk_array_header_size(data.size()) + elements_pack_size(data, std::integral_constant<bool, element::fixed>());
+    }
+    static char* pack(char* out, const std::vector<T>& data) {
+        out += mpk_write_array_header(reinterpret_cast<unsigned char*>(out), data.size());
+        return pack_elements(out, data, std::integral_constant<bool, element::fixed>());
+    }
+    static bool unpack(const char*& p, const char* end, std::vector<T>& out) {
+        return unpack_elements(p, end, out, std::integral_constant<bool, element::fixed>());
+    }
+
+private:
+    // primitive elements are encoded in bulk by the C packer
+    static size_t elements_pack_size(const std::vector<T>& data, std::true_type) {
+        return pack_primitive_array_size(element::serial_type, sizeof(T), reinterpret_cast<const char*>(data.data()), data.size());
+    }
+    static size_t elements_pack_size(const std::vector<T>& data, std::false_type) {
+        size_t size = 0;
+        for (const T& x : data) {
+            size += element::pack_size(x);
+        }
+        return size;
+    }
+    static char* pack_elements(char* out, const std::vector<T>& data, std::true_type) {
+        return out + pack_primitive_array(element::serial_type, reinterpret_cast<const char*>(data.data()), data.size(), out);
+    }
+    static char* pack_elements(char* out, const std::vector<T>& data, std::false_type) {
+        for (const T& x : data) {
+            out = element::pack(out, x);
+        }
+        return out;
+    }
+
+    // Every element takes at least one byte, so a length beyond the end of
+    // the message is malformed and is rejected before anything is allocated
+    static bool unpack_elements(const char*& p, const char* end, std::vector<T>& out, std::true_type) {
+        size_t length;
+        const char* start = p;
+        // u1 and i1 arrays may also be encoded as MessagePack binary data
+        if ((element::serial_type == MORLOC_UINT8 || element::serial_type == MORLOC_SINT8) &&
+            mpk_unpack_header(p, end, MPK_SCAN_BYTES, length)) {
+            if ((size_t)(end - p) < length) return false;
+            out.resize(length);
+            std::memcpy(out.data(), p, length);
+            p += length;
+            return true;
+        }
+        p = start;
+        if (!mpk_unpack_header(p, end, MPK_SCAN_ARRAY, length) || (size_t)(end - p) < length) return false;
+        out.resize(length);
+        return mpk_unpack_primitives(p, end, out.data(), length);
+    }
+    static bool unpack_elements(const char*& p, const char* end, std::vector<T>& out, std::false_type) {
+        size_t length;
+        if (!mpk_unpack_header(p, end, MPK_SCAN_ARRAY, length) || (size_t)(end - p) < length) return false;
+        out.resize(length);
+        for (size_t i = 0; i < length; i++) {
+            if (!element::unpack(p, end, out[i])) return false;
+        }
+        return true;
+    }
+
+    static size_t elements_heap_size(const std::vector<T>&, std::true_type) { return 0; }
+    static size_t elements_heap_size(const std::vector<T>& data, std::false_type) {
+        size_t size = 0;
+        for (const T& x : data) {
+            size += element::heap_size(x);
+        }
+        return size;
+    }
+
+    // primitive elements are stored as they are in the vector
+    static void write_elements(char* elements, char*&, const std::vector<T>& data, std::true_type) {
+        if (!data.empty()) {
+            std::memcpy(elements, data.data(), data.size() * sizeof(T));
+        }
+    }
+    static void write_elements(char* elements, char*& cursor, const std::vector<T>& data, std::false_type) {
+        for (size_t i = 0; i < data.size(); i++) {
+            element::write(elements + i * element::width, cursor, data[i]);
+        }
+    }
+
+    static std::vector<T> read_elements(ArrayView view, std::true_type) {
+        const T* first = reinterpret_cast<const T*>(view.data);
+        return std::vector<T>(first, first + view.size);
+    }
+    static std::vector<T> read_elements(ArrayView view, std::false_type) {
+        std::vector<T> result;
+        result.reserve(view.size);
+        for (size_t i = 0; i < view.size; i++) {
+            result.push_back(element::read(static_cast<const char*>(array_view_at(view, i))));
+        }
+        return result;
+    }
+};
+
+// std::vector<bool> packs its elements into bits and has no data() to copy
+// them from, so it is converted one element at a time
+template<>
+struct mpk_type<std::vector<bool>> {
+    typedef mpk_type<bool> element;
+    static constexpr size_t width = sizeof(Array);
+    static constexpr bool fixed = false;
+    static constexpr bool flat = false;
+    static constexpr bool match(const char*& s) { return mpk_schema_expect(s, SCHEMA_ARRAY) && element::match(s); }
+    static void schema(std::string& out) { out += SCHEMA_ARRAY; element::schema(out); }
+
+    static size_t heap_size(const std::vector<bool>& data) { return data.size() * element::width; }
+    static void write(char* dest, char*& cursor, const std::vector<bool>& data) {
+        char* elements = mpk_write_voidstar_array(dest, cursor, data.size(), element::width);
+        for (size_t i = 0; i < data.size(); i++) {
+            elements[i] = (char)data[i];
+        }
+    }
+    static std::vector<bool> read(const char* data) {
+        ArrayView view = array_view(reinterpret_cast<const Array*>(data), element::width);
+        std::vector<bool> result(view.size);
+        for (size_t i = 0; i < view.size; i++) {
+            result[i] = view.data[i] != 0;
+        }
+        return result;
+    }
+    static size_t pack_size(const std::vector<bool>& data) {
+        return mpk_array_header_size(data.size()) + data.size();
+    }
+    static char* pack(char* out, const std::vector<bool>& data) {
+        out += mpk_write_array_header(reinterpret_cast<unsigned char*>(out), data.size());
+        for (bool x : data) {
+            out = element::pack(out, x);
+        }
+        return out;
+    }
+    static bool unpack(const char*& p, const char* end, std::vector<bool>& out) {
+        size_t length;
+        if (!mpk_unpack_header(p, end, MPK_SCAN_ARRAY, length) || (size_t)(end - p) < length) return false;
+        out.assign(length, false);
+        for (size_t i = 0; i < length; i++) {
+            bool x;
+            if (!element::unpack(p, end, x)) return false;
+            out[i] = x;
+        }
+        return true;
+    }
+};
+
+// The offset of field I in a tuple of the given widths
+constexpr size_t mpk_field_offset(const size_t* widths, size_t i) {
+    size_t offset = 0;
+    for (size_t k = 0; k < i; k++) {
+        offset += widths[k];
+    }
+    return offset;
+}
+
+constexpr bool mpk_all(const bool* xs, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        if (!xs[i]) return false;
+    }
+    return true;
+}
+
+template<typename... Args>
+struct mpk_type<std::tuple<Args...>> {
+    // the leading 0 keeps the arrays non-empty for empty tuples
+    static constexpr size_t widths[] = { 0, mpk_type<Args>::width... };
+    static constexpr bool flats[] = { true, mpk_type<Args>::flat... };
+
+    static constexpr size_t offset(size_t i) { return mpk_field_offset(widths + 1, i); }
+
+    static constexpr size_t width = mpk_field_offset(widths, sizeof...(Args) + 1);
+    static constexpr bool fixed = false;
+    static constexpr bool flat = mpk_all(flats, sizeof...(Args) + 1);
+
+    // A tuple also matches a map with the same fields in the same order
+    static constexpr bool match(const char*& s) {
+        if (mpk_schema_expect(s, SCHEMA_TUPLE)) {
+            if (!mpk_schema_expect_size(s, sizeof...(Args))) return false;
+            bool fields[] = { true, mpk_type<Args>::match(s)... };
+            return mpk_all(fields, sizeof...(Args) + 1);
+        }
+        if (mpk_schema_expect(s, SCHEMA_MAP)) {
+            if (!mpk_schema_expect_size(s, sizeof...(Args))) return false;
+            bool fields[] = { true, (mpk_schema_skip_key(s) && mpk_type<Args>::match(s))... };
+            return mpk_all(fields, sizeof...(Args) + 1);
+        }
+        return false;
+    }
+    static void schema(std::string& out) {
+        out += SCHEMA_TUPLE;
+        out += mpk_schema_digit_char(sizeof...(Args));
+        (void)std::initializer_list<int>{ (mpk_type<Args>::schema(out), 0)... };
+    }
+
+    static size_t heap_size(const std::tuple<Args...>& data) {
+        return heap_size(data, std::index_sequence_for<Args...>{});
+    }
+    static void write(char* dest, char*& cursor, const std::tuple<Args...>& data) {
+        write(dest, cursor, data, std::index_sequence_for<Args...>{});
+    }
+    static std::tuple<Args...> read(const char* data) {
+        return read(data, std::index_sequence_for<Args...>{});
+    }
+    static size_t pack_size(const std::tuple<Args...>& data) {
+        return mpk_array_header_size(sizeof...(Args)) + pack_size(data, std::index_sequence_for<Args...>{});
+    }
+    static char* pack(char* out, const std::tuple<Args...>& data) {
+        out += mpk_write_array_header(reinterpret_cast<unsigned char*>(out), sizeof...(Args));
+        return pack(out, data, std::index_sequence_for<Args...>{});
+    }
+    static bool unpack(const char*& p, const char* end, std::tuple<Args...>& out) {
+        size_t length;
+        if (!mpk_unpack_header(p, end, MPK_SCAN_ARRAY, length) || length != sizeof...(Args)) return false;
+        return unpack(p, end, out, std::index_sequence_for<Args...>{});
+    }
+
+private:
+    template<size_t... Is>
+    static size_t heap_size(const std::tuple<Args...>& data, std::index_sequence<Is...>) {
+        size_t size = 0;
+        (void)std::initializer_list<int>{ (size += mpk_type<Args>::heap_size(std::get<Is>(data)), 0)... };
+        return size;
+    }
+    // fields are written in order, so their array and string data is laid
+    // out as in the Schema based toAnything
+    template<size_t... Is>
+    static void write(char* dest, char*& cursor, const std::tuple<Args...>& data, std::index_sequence<Is...>) {
+        (void)std::initializer_list<int>{ (mpk_type<Args>::write(dest + offset(Is), cursor, std::get<Is>(data)), 0)... };
+    }
+    template<size_t... Is>
+    static std::tuple<Args...> read(const char* data, std::index_sequence<Is...>) {
+        return std::tuple<Args...>(mpk_type<Args>::read(data + offset(Is))...);
+    }
+    template<size_t... Is>
+    static size_t pack_size(const std::tuple<Args...>& data, std::index_sequence<Is...>) {
+        size_t size = 0;
+        (void)std::initializer_list<int>{ (size += mpk_type<Args>::pack_size(std::get<Is>(data)), 0)... };
+        return size;
+    }
+    template<size_t... Is>
+    static char* pack(char* out, const std::tuple<Args...>& data, std::index_sequence<Is...>) {
+        (void)std::initializer_list<int>{ (out = mpk_type<Args>::pack(out, std::get<Is>(data)), 0)... };
+        return out;
+    }
+    template<size_t... Is>
+    static bool unpack(const char*& p, const char* end, std::tuple<Args...>& out, std::index_sequence<Is...>) {
+        bool ok = true;
+        (void)std::initializer_list<int>{ (ok = ok && mpk_type<Args>::unpack(p, end, std::get<Is>(out)), 0)... };
+        return ok;
+    }
+};
+
+template<typename... Args>
+constexpr size_t mpk_type<std::tuple<Args...>>::widths[];
+
+template<typename... Args>
+constexpr bool mpk_type<std::tuple<Args...>>::flats[];
+
+// Check at compile time that a schema string describes T, for example
+//   static_assert(mpk_schema_matches<std::vector<double>>("af8"), "bad schema");
+template<typename T>
+constexpr bool mpk_schema_matches(const char* schema) {
+    const char* s = schema;
+    return mpk_type<T>::match(s) && *s == '\0';
+}
+
+// The canonical schema string of T, built once
+template<typename T>
+const std::string& mpk_schema_string() {
+    static const std::string schema_str = [](){
+        std::string out;
+        mpk_type<T>::schema(out);
+        return out;
+    }();
+    return schema_str;
+}
+
+// The compiled schema of T, looked up once, for the C functions that need one
+template<typename T>
+const Schema* mpk_schema() {
+    static const Schema* schema = get_schema(mpk_schema_string<T>().c_str());
+    return schema;
+}
+
+// Write a voidstar of T to a new shared memory block (freed with shfree) or
+// to an arena (freed with the arena)
+template<typename T>
+void* mpk_to_voidstar(const T& data) {
+    size_t size = mpk_type<T>::width + mpk_type<T>::heap_size(data);
+    char* dest = static_cast<char*>(shmalloc(size));
+    if (dest == nullptr) {
+        return nullptr;
+    }
+    char* cursor = dest + mpk_type<T>::width;
+    mpk_type<T>::write(dest, cursor, data);
+    return dest;
+}
+
+template<typename T>
+void* mpk_to_voidstar(sharena_t* arena, const T& data) {
+    size_t size = mpk_type<T>::width + mpk_type<T>::heap_size(data);
+    char* dest = static_cast<char*>(sharena_alloc(arena, size));
+    if (dest == nullptr) {
+        return nullptr;
+    }
+    char* cursor = dest + mpk_type<T>::width;
+    mpk_type<T>::write(dest, cursor, data);
+    return dest;
+}
+
+template<typename T>
+T mpk_from_voidstar(const void* voidstar) {
+    return mpk_type<T>::read(static_cast<const char*>(voidstar));
+}
+
+// mpk_pack and mpk_unpack with the schema taken from the type. Packing
+// encodes the C++ value directly into the returned vector, which is sized
+// exactly beforehand, so there is no voidstar and no intermediate buffer.
+template<typename T>
+std::vector<char> mpk_pack(const T& data) {
+    std::vector<char> result(mpk_type<T>::pack_size(data));
+    mpk_type<T>::pack(result.data(), data);
+    return result;
+}
+
+// Unpacking decodes straight into the C++ containers. Vectors are sized from
+// their array headers and primitive arrays are decoded in bulk.
+template<typename T>
+T mpk_unpack(const char* packed_data, size_t packed_size) {
+    T x;
+    const char* p = packed_data;
+    if (!mpk_type<T>::unpack(p, packed_data + packed_size, x)) {
+        throw std::runtime_error("Unpacking failed");
+    }
+    return x;
+}
+
+template<typename T>
+T mpk_unpack(const std::vector<char>& packed_data) {
+    return mpk_unpack<T>(packed_data.data(), packed_data.size());
+}
+
+template<typename T>
+T mpk_unpack_file(const std::string& path) {
+    size_t packed_size;
+    const char* packed_data = mpk_map_file(path.c_str(), &packed_size);
+    if (packed_data == NULL) {
+        throw std::runtime_error("Failed to map file '" + path + "'");
+    }
+
+    T x;
+    const char* p = packed_data;
+    bool unpacked = mpk_type<T>::unpack(p, packed_data + packed_size, x);
+    mpk_unmap_file(packed_data, packed_size);
+    if (!unpacked) {
+        throw std::runtime_error("Unpacking failed");
+    }
+
+    return x;
+}
+
+#if __cplusplus >= 201703L
+
+// Views read voidstar data in place rather than copying it into owning
+// containers. They are built on std::string_view, so they need C++17; the rest
+// of this header builds as C++14. All views of one voidstar share a single
+// reference to the shared memory block that holds it, so the block stays alive
+// while any view of it does, even after its owner has freed it. The voidstar
+// must be the start of a block, as returned by mpk_to_voidstar, toAnything or
+// the unpack functions, not an object in an arena.
+//
+// mpk_view_t<T> is the view of a T:
+//   primitives      - the value itself
+//   std::string     - mpk_string_view, a std::string_view
+//   std::vector<T>  - mpk_array_view<T>, indexed like a std::span
+//   std::tuple<...> - mpk_tuple_view<...>, fields are read when accessed
+
+// A counted reference to a shared memory block, dropped with shdecref when the
+// last copy is destroyed. Copies within the process share one shm reference.
+typedef std::shared_ptr<const void> mpk_shm_ref;
+
+// Take over a reference the caller already holds
+inline mpk_shm_ref mpk_shm_adopt(const void* block) {
+    return mpk_shm_ref(block, [](const void* ptr) { shdecref(const_cast<void*>(ptr)); });
+}
+
+// Add a new reference to a block
+inline mpk_shm_ref mpk_shm_retain(const void* block) {
+    if (shincref(const_cast<void*>(block)) != 0) {
+        throw std::runtime_error("Cannot reference shared memory block");
+    }
+    return mpk_shm_adopt(block);
+}
+
+template<typename T, typename Enable = void>
+struct mpk_view_type;
+
+template<typename T>
+using mpk_view_t = typename mpk_view_type<T>::type;
+
+template<typename T>
+struct mpk_view_type<T, typename std::enable_if<mpk_type<T>::fixed>::type> {
+    typedef T type;
+    static T make(const char* data, const mpk_shm_ref&) {
+        T x;
+        std::memcpy(&x, data, sizeof(T));
+        return x;
+    }
+};
+
+template<>
+struct mpk_view_type<std::nullptr_t> {
+    typedef std::nullptr_t type;
+    static std::nullptr_t make(const char*, const mpk_shm_ref&) { return nullptr; }
+};
+
+class mpk_string_view : public std::string_view {
+public:
+    mpk_string_view() = default;
+    mpk_string_view(const char* data, size_t size, mpk_shm_ref ref)
+        : std::string_view(data, size), ref_(std::move(ref)) {}
+private:
+    mpk_shm_ref ref_;
+};
+
+template<>
+struct mpk_view_type<std::string> {
+    typedef mpk_string_view type;
+    static mpk_string_view make(const char* data, const mpk_shm_ref& ref) {
+        ArrayView view = array_view(reinterpret_cast<const Array*>(data), 1);
+        return mpk_string_view(view.data, view.size, ref);
+    }
+};
+
+// Iterates over the views of array elements that are not stored as C++ values
+template<typename T>
+class mpk_view_iterator {
+public:
+    typedef std::random_access_iterator_tag iterator_category;
+    typedef mpk_view_t<T> value_type;
+    typedef std::ptrdiff_t difference_type;
+    typedef const value_type* pointer;
+    typedef value_type reference;
+
+    mpk_view_iterator(const char* data, const mpk_shm_ref* ref) : data_(data), ref_(ref) {}
+
+    value_type operator*() const { return mpk_view_type<T>::make(data_, *ref_); }
+    value_type operator[](difference_type i) const { return *(*this + i); }
+    mpk_view_iterator& operator++() { data_ += mpk_type<T>::width; return *this; }
+    mpk_view_iterator operator++(int) { mpk_view_iterator it = *this; ++*this; return it; }
+    mpk_view_iterator& operator--() { data_ -= mpk_type<T>::width; return *this; }
+    mpk_view_iterator operator--(int) { mpk_view_iterator it = *this; --*this; return it; }
+    mpk_view_iterator& operator+=(difference_type n) { data_ += n * (difference_type)mpk_type<T>::width; return *this; }
+    mpk_view_iterator& operator-=(difference_type n) { data_ -= n * (difference_type)mpk_type<T>::width; return *this; }
+    mpk_view_iterator operator+(difference_type n) const { mpk_view_iterator it = *this; return it += n; }
+    mpk_view_iterator operator-(difference_type n) const { mpk_view_iterator it = *this; return it -= n; }
+    difference_type operator-(const mpk_view_iterator& other) const { return (data_ - other.data_) / (difference_type)mpk_type<T>::width; }
+    bool operator==(const mpk_view_iterator& other) const { return data_ == other.data_; }
+    bool operator!=(const mpk_view_iterator& other) const { return data_ != other.data_; }
+    bool operator<(const mpk_view_iterator& other) const { return data_ < other.data_; }
+
+private:
+    const char* data_;
+    const mpk_shm_ref* ref_;
+};
+
+// A view of an array. Primitive elements are read in place as a contiguous
+// C array, other elements are viewed as they are accessed.
+template<typename T>
+class mpk_array_view {
+public:
+    typedef mpk_view_t<T> value_type;
+    // primitive elements are returned by reference, others as views
+    typedef typename std::conditional<mpk_type<T>::fixed, const T&, value_type>::type reference;
+    typedef typename std::conditional<mpk_type<T>::fixed, const T*, mpk_view_iterator<T>>::type iterator;
+
+    mpk_array_view() : data_(nullptr), size_(0) {}
+    mpk_array_view(const char* data, size_t size, mpk_shm_ref ref)
+        : data_(data), size_(size), ref_(std::move(ref)) {}
+
+    size_t size() const { return size_; }
+    bool empty() const { return size_ == 0; }
+
+    reference operator[](size_t i) const { return at(i, std::integral_constant<bool, mpk_type<T>::fixed>()); }
+    reference front() const { return (*this)[0]; }
+    reference back() const { return (*this)[size_ - 1]; }
+
+    iterator begin() const { return iterator_at(0, std::integral_constant<bool, mpk_type<T>::fixed>()); }
+    iterator end() const { return iterator_at(size_, std::integral_constant<bool, mpk_type<T>::fixed>()); }
+
+    // The elements as a C array, for primitive element types only
+    template<typename U = T>
+    typename std::enable_if<mpk_type<U>::fixed, const T*>::type data() const {
+        return reinterpret_cast<const T*>(data_);
+    }
+
+    // A view of `count` elements starting at `offset`
+    mpk_array_view subspan(size_t offset, size_t count) const {
+        return mpk_array_view(data_ + offset * mpk_type<T>::width, count, ref_);
+    }
+
+private:
+    reference at(size_t i, std::true_type) const {
+        return reinterpret_cast<const T*>(data_)[i];
+    }
+    reference at(size_t i, std::false_type) const {
+        return mpk_view_type<T>::make(data_ + i * mpk_type<T>::width, ref_);
+    }
+    iterator iterator_at(size_t i, std::true_type) const {
+        return reinterpret_cast<const T*>(data_) + i;
+    }
+    iterator iterator_at(size_t i, std::false_type) const {
+        return mpk_view_iterator<T>(data_ + i * mpk_type<T>::width, &ref_);
+    }
+
+    const char* data_;
+    size_t size_;
+    mpk_shm_ref ref_;
+};
+
+template<typename T>
+struct mpk_view_type<std::vector<T>> {
+    typedef mpk_array_view<T> type;
+    static mpk_array_view<T> make(const char* data, const mpk_shm_ref& ref) {
+        ArrayView view = array_view(reinterpret_cast<const Array*>(data), mpk_type<T>::width);
+        return mpk_array_view<T>(view.data, view.size, ref);
+    }
+};
+
+// A view of a tuple, each field is read or viewed only when it is accessed
+template<typename... Args>
+class mpk_tuple_view {
+public:
+    template<size_t I>
+    using field_type = typename std::tuple_element<I, std::tuple<Args...>>::type;
+
+    mpk_tuple_view() : data_(nullptr) {}
+    mpk_tuple_view(const char* data, mpk_shm_ref ref) : data_(data), ref_(std::move(ref)) {}
+
+    template<size_t I>
+    mpk_view_t<field_type<I>> get() const {
+        return mpk_view_type<field_type<I>>::make(data_ + mpk_type<std::tuple<Args...>>::offset(I), ref_);
+    }
+
+private:
+    const char* data_;
+    mpk_shm_ref ref_;
+};
+
+template<typename... Args>
+struct mpk_view_type<std::tuple<Args...>> {
+    typedef mpk_tuple_view<Args...> type;
+    static mpk_tuple_view<Args...> make(const char* data, const mpk_shm_ref& ref) {
+        return mpk_tuple_view<Args...>(data, ref);
+    }
+};
+
+// View a voidstar of T, taking a reference to its block
+template<typename T>
+mpk_view_t<T> mpk_view(const void* voidstar) {
+    return mpk_view_type<T>::make(static_cast<const char*>(voidstar), mpk_shm_retain(voidstar));
+}
+
+// Unpack into a new shared memory block that is freed with the last view of it
+template<typename T>
+mpk_view_t<T> mpk_unpack_view(const char* packed_data, size_t packed_size) {
+    void* voidstar = nullptr;
+    if (unpack_with_schema_single_pass(packed_data, packed_size, mpk_schema<T>(), &voidstar) != 0) {
+        if (voidstar != nullptr) {
+            shfree(voidstar);
+        }
+        throw std::runtime_error("Unpacking failed");
+    }
+    return mpk_view_type<T>::make(static_cast<const char*>(voidstar), mpk_shm_adopt(voidstar));
+}
+
+template<typename T>
+mpk_view_t<T> mpk_unpack_view(const std::vector<char>& packed_data) {
+    return mpk_unpack_view<T>(packed_data.data(), packed_data.size());
+}
+
+template<typename T>
+mpk_view_t<T> mpk_unpack_file_view(const std::string& path) {
+    void* voidstar = nullptr;
+    if (unpack_file_with_schema(path.c_str(), mpk_schema<T>(), &voidstar) != 0) {
+        if (voidstar != nullptr) {
+            shfree(voidstar);
+        }
+        throw std::runtime_error("Unpacking failed");
+    }
+    return mpk_view_type<T>::make(static_cast<const char*>(voidstar), mpk_shm_adopt(voidstar));
+}
+
+#endif // __cplusplus >= 201703L
+
+// Containers that live in the shared memory pool. Memory comes from shmalloc
+// and goes back with shfree, so C++ code can build its results in shm rather
+// than on the heap. Blocks are aligned to SHM_ALIGN, larger alignments are
+// refused with std::bad_alloc.
+
+#if defined(__cpp_lib_memory_resource)
+
+// A memory resource for std::pmr containers (C++17), for example
+//   std::pmr::vector<double> xs(mpk_shm_memory_resource());
+class mpk_shm_resource : public std::pmr::memory_resource {
+protected:
+    void* do_allocate(size_t bytes, size_t alignment) override {
+        if (alignment > SHM_ALIGN) {
+            throw std::bad_alloc();
+        }
+        void* ptr = shmalloc(bytes > 0 ? bytes : 1);
+        if (ptr == nullptr) {
+            throw std::bad_alloc();
+        }
+        return ptr;
+    }
+    void do_deallocate(void* ptr, size_t, size_t) override {
+        shfree(ptr);
+    }
+    bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override {
+        return dynamic_cast<const mpk_shm_resource*>(&other) != nullptr;
+    }
+};
+
+inline mpk_shm_resource* mpk_shm_memory_resource() {
+    static mpk_shm_resource resource;
+    return &resource;
+}
+
+#endif // __cpp_lib_memory_resource
+
+// An allocator for the standard containers, for example
+//   std::vector<double, mpk_shm_allocator<double>> xs;
+template<typename T>
+struct mpk_shm_allocator {
+    typedef T value_type;
+
+    mpk_shm_allocator() noexcept = default;
+    template<typename U>
+    mpk_shm_allocator(const mpk_shm_allocator<U>&) noexcept {}
+
+    T* allocate(size_t n) {
+        static_assert(alignof(T) <= SHM_ALIGN, "type is over-aligned for the shm pool");
+        if (n > SIZE_MAX / sizeof(T)) {
+            throw std::bad_array_new_length();
+        }
+        void* ptr = shmalloc(n > 0 ? n * sizeof(T) : 1);
+        if (ptr == nullptr) {
+            throw std::bad_alloc();
+        }
+        return static_cast<T*>(ptr);
+    }
+    void deallocate(T* ptr, size_t) noexcept {
+        shfree(ptr);
+    }
+};
+
+template<typename T, typename U>
+bool operator==(const mpk_shm_allocator<T>&, const mpk_shm_allocator<U>&) { return true; }
+template<typename T, typename U>
+bool operator!=(const mpk_shm_allocator<T>&, const mpk_shm_allocator<U>&) { return false; }
+
+// A growable array of primitives stored as a voidstar array: one shm block
+// holding the Array header followed by the elements. release() fills in the
+// header and hands over the block, which is then a voidstar of schema aT that
+// can be packed, viewed or passed on by relptr with no copy. The caller frees
+// it with shfree.
+template<typename T>
+class mpk_shm_array {
+    static_assert(mpk_type<T>::fixed, "mpk_shm_array holds primitives only");
+public:
+    mpk_shm_array() : block_(nullptr), size_(0), capacity_(0) {}
+    explicit mpk_shm_array(size_t n, T value = T()) : mpk_shm_array() { resize(n, value); }
+    mpk_shm_array(const mpk_shm_array&) = delete;
+    mpk_shm_array& operator=(const mpk_shm_array&) = delete;
+    mpk_shm_array(mpk_shm_array&& other) noexcept
+        : block_(other.block_), size_(other.size_), capacity_(other.capacity_) {
+        other.block_ = nullptr;
+        other.size_ = other.capacity_ = 0;
+    }
+    mpk_shm_array& operator=(mpk_shm_array&& other) noexcept {
+        std::swap(block_, other.block_);
+        std::swap(size_, other.size_);
+        std::swap(capacity_, other.capacity_);
+        return *this;
+    }
+    ~mpk_shm_array() {
+        if (block_ != nullptr) {
+            shfree(block_);
+        }
+    }
+
+    size_t size() const { return size_; }
+    size_t capacity() const { return capacity_; }
+    bool empty() const { return size_ == 0; }
+
+    T* data() { return reinterpret_cast<T*>(block_ + sizeof(Array)); }
+    const T* data() const { return reinterpret_cast<const T*>(block_ + sizeof(Array)); }
+    T& operator[](size_t i) { return data()[i]; }
+    const T& operator[](size_t i) const { return data()[i]; }
+    T* begin() { return data(); }
+    T* end() { return data() + size_; }
+    const T* begin() const { return data(); }
+    const T* end() const { return data() + size_; }
+
+    void reserve(size_t n) {
+        if (block_ != nullptr && n <= capacity_) {
+            return;
+        }
+        if (n > (SIZE_MAX - sizeof(Array)) / sizeof(T)) {
+            throw std::bad_array_new_length();
+        }
+        size_t size = sizeof(Array) + n * sizeof(T);
+        void* block = block_ == nullptr ? shmalloc(size) : shrealloc(block_, size);
+        if (block == nullptr) {
+            throw std::bad_alloc();
+        }
+        block_ = static_cast<char*>(block);
+        capacity_ = n;
+    }
+
+    void resize(size_t n, T value = T()) {
+        reserve(n);
+        if (n > size_) {
+            std::fill(data() + size_, data() + n, value);
+        }
+        size_ = n;
+    }
+
+    void push_back(T x) {
+        if (block_ == nullptr || size_ == capacity_) {
+            reserve(capacity_ > 0 ? 2 * capacity_ : 16);
+        }
+        data()[size_++] = x;
+    }
+
+    void clear() { size_ = 0; }
+
+    // Return the array as a voidstar and leave this array empty. Unused
+    // capacity is returned to the pool first.
+    void* release() {
+        if (block_ == nullptr) {
+            reserve(0);
+        } else if (size_ < capacity_ && shrealloc(block_, sizeof(Array) + size_ * sizeof(T)) == nullptr) {
+            throw std::bad_alloc();
+        }
+        Array* array = reinterpret_cast<Array*>(block_);
+        array->size = size_;
+        array->data = abs2rel(data());
+
+        void* voidstar = block_;
+        block_ = nullptr;
+        size_ = capacity_ = 0;
+        return voidstar;
+    }
+
+private:
+    char* block_;
+    size_t size_;
+    size_t capacity_;
+};
+
 #endif
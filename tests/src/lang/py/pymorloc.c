@@ -120,25 +120,23 @@ PyObject* fromAnything(const Schema* schema, const void* data){
             obj = PyFloat_FromDouble(*(double*)data);
             break;
         case MORLOC_STRING: {
-            Array* str_array = (Array*)data;
-            obj = PyUnicode_FromStringAndSize(rel2abs(str_array->data), str_array->size);
+            ArrayView str_view = array_view((Array*)data, 1);
+            obj = PyUnicode_FromStringAndSize(str_view.data, str_view.size);
             break;
         }
         case MORLOC_ARRAY: {
-            Array* array = (Array*)data;
-            if (schema->parameters[0]->type == MORLOC_UINT8) {
+            Schema* element_schema = schema->parameters[0];
+            ArrayView view = array_view((Array*)data, element_schema->width);
+            if (element_schema->type == MORLOC_UINT8) {
                 // Create a Python bytes object for UINT8 arrays
-                obj = PyBytes_FromStringAndSize((const char*)rel2abs(array->data), array->size);
+                obj = PyBytes_FromStringAndSize(view.data, view.size);
                 if (!obj) goto error;
             } else {
                 // For other types, create a list as before
-                obj = PyList_New(array->size);
+                obj = PyList_New(view.size);
                 if (!obj) goto error;
-                char* start = (char*)rel2abs(array->data);
-                size_t width = schema->parameters[0]->width;
-                Schema* element_schema = schema->parameters[0];
-                for (size_t i = 0; i < array->size; i++) {
-                    PyObject* item = fromAnything(element_schema, start + width * i);
+                for (size_t i = 0; i < view.size; i++) {
+                    PyObject* item = fromAnything(element_schema, array_view_at(view, i));
                     if (!item || PyList_SetItem(obj, i, item) < 0) {
                         Py_XDECREF(item);
                         goto error;
@@ -207,7 +205,7 @@ static PyObject* from_voidstar(PyObject* self, PyObject* args) {
         return NULL;
     }
 
-    Schema* schema = parse_schema(&schema_str);
+    const Schema* schema = get_schema(schema_str);
     if (!schema) {
         PyErr_SetString(PyExc_ValueError, "Failed to parse schema");
         return NULL;
@@ -215,13 +213,10 @@ static PyObject* from_voidstar(PyObject* self, PyObject* args) {
 
     PyObject* obj = fromAnything(schema, voidstar);
     if (obj == NULL) {
-        free_schema(schema);
         PyErr_SetString(PyExc_TypeError, "fromAnything returned NULL");
         return NULL;
     }
 
-    free_schema(schema);
-
     return obj;
 }
 
@@ -480,23 +475,25 @@ int to_voidstar_r(void* dest, void** cursor, const Schema* schema, PyObject* obj
                 result->size = (size_t)size;
                 result->data = abs2rel(*cursor);
 
+                // the elements go at the cursor, which is already absolute
+                char* start = *(char**)cursor;
+
                 if (PyList_Check(obj)) {
                     // Fixed size width of each element (variable size data will
                     // be written to the cursor location)
-                    size_t width = schema->parameters[0]->width;
+                    Schema* element_schema = schema->parameters[0];
+                    ArrayView view = { start, (size_t)size, element_schema->width };
 
                     // Move the cursor to the location immediately after the
                     // fixed sized elements
-                    *cursor = (void*)(*(char**)cursor + size * width);
+                    *cursor = (void*)(start + size * view.stride);
 
-                    char* start = (char*)rel2abs(result->data);
-                    Schema* element_schema = schema->parameters[0];
                     for (Py_ssize_t i = 0; i < size; i++) {
                         PyObject* item = PyList_GetItem(obj, i);
-                        to_voidstar_r(start + width * i, cursor, element_schema, item);
+                        to_voidstar_r(array_view_at(view, i), cursor, element_schema, item);
                     }
                 } else {
-                    memcpy(rel2abs(result->data), data, size);
+                    memcpy(start, data, size);
 
                     // move cursor to the location after the copied data
                     *cursor = (void*)(*(char**)cursor + size);
@@ -552,7 +549,16 @@ error:
     return -1;
 }
 
-void* to_voidstar_c(const Schema* schema, PyObject* obj){
+// Arena used by to_voidstar and to_shm between arena_begin and arena_release
+static sharena_t user_arena;
+static bool user_arena_active = false;
+
+// Arena for voidstars that only live for one call, it is reset after each use
+static sharena_t scratch_arena;
+
+// Convert a python object to voidstar. If arena is NULL, the voidstar is a
+// block of its own, otherwise it is allocated from the arena.
+void* to_voidstar_c(const Schema* schema, PyObject* obj, sharena_t* arena){
   // calculate the required size of the shared memory object
   ssize_t shm_size = get_shm_size(schema, obj);
   if(shm_size == -1){
@@ -561,7 +567,11 @@ void* to_voidstar_c(const Schema* schema, PyObject* obj){
   }
 
   // allocate the required memory as a single block
-  void* dest = shmalloc((size_t)shm_size);
+  void* dest = arena ? sharena_alloc(arena, (size_t)shm_size) : shmalloc((size_t)shm_size);
+  if(!dest){
+      PyErr_SetString(PyExc_MemoryError, "Failed to allocate voidstar");
+      return NULL;
+  }
 
   // set the write location of variable size chunks
   void* cursor = (void*)((char*)dest + schema->width);
@@ -587,9 +597,13 @@ static PyObject* to_voidstar(PyObject* self, PyObject* args){
       return NULL;
   }
 
-  Schema* schema = parse_schema(&schema_str);
+  const Schema* schema = get_schema(schema_str);
+  if (!schema) {
+      PyErr_SetString(PyExc_ValueError, "to_voidstar: Failed to parse schema");
+      return NULL;
+  }
 
-  void* voidstar = to_voidstar_c(schema, obj);
+  void* voidstar = to_voidstar_c(schema, obj, user_arena_active ? &user_arena : NULL);
 
   if(!voidstar){
       return NULL;
@@ -600,8 +614,6 @@ static PyObject* to_voidstar(PyObject* self, PyObject* args){
   // counting. When I do, the destructor will decrement this count.
   PyObject* voidstar_capsule = PyCapsule_New(voidstar, "absptr_t", NULL);
 
-  free_schema(schema);
-
   return voidstar_capsule;
 }
 
@@ -615,16 +627,16 @@ static PyObject* py_to_mesgpack(PyObject* self, PyObject* args) {
       return NULL;
   }
 
-  Schema* schema = parse_schema(&schema_str);
+  const Schema* schema = get_schema(schema_str);
   if (!schema) {
       PyErr_SetString(PyExc_ValueError, "py_to_mesgpack: Failed to parse schema");
       return NULL;
   }
 
-  void* voidstar = to_voidstar_c(schema, obj);
+  void* voidstar = to_voidstar_c(schema, obj, &scratch_arena);
 
   if (!voidstar && PyErr_Occurred()) {
-      free_schema(schema);
+      sharena_reset(&scratch_arena);
       PyErr_SetString(PyExc_ValueError, "py_to_mesgpack: Failed to yield voidstar");
       return NULL;
   }
@@ -633,20 +645,20 @@ static PyObject* py_to_mesgpack(PyObject* self, PyObject* args) {
   size_t msgpck_data_len = 0;
 
   int exitcode = pack_with_schema(voidstar, schema, &msgpck_data, &msgpck_data_len);
+
+  // free voidstar, we shan't be needing it now
+  sharena_reset(&scratch_arena);
+
   if (exitcode != 0 || !msgpck_data) {
       PyErr_SetString(PyExc_RuntimeError, "py_to_mesgpack: Packing failed");
       free(msgpck_data);
-      free_schema(schema);
       return NULL;
   }
 
   // TODO: avoid memory copying here
   PyObject* mesgpack_bytes = PyBytes_FromStringAndSize(msgpck_data, msgpck_data_len);
-  free_schema(schema);
   free(msgpck_data);
 
-  // free voidstar, we shan't be needing it now
-
   return mesgpack_bytes;
 }
 
@@ -661,25 +673,96 @@ static PyObject* mesgpack_to_py(PyObject* self, PyObject* args) {
         return NULL;
     }
 
-    Schema* schema = parse_schema(&schema_str);
+    const Schema* schema = get_schema(schema_str);
+    if (!schema) {
+        PyErr_SetString(PyExc_ValueError, "mesgpack_to_py: Failed to parse schema");
+        return NULL;
+    }
 
-    int exitcode = unpack_with_schema(msgpck_data, msgpck_data_len, schema, &voidstar);
+    int exitcode = unpack_with_schema_to_arena(msgpck_data, msgpck_data_len, schema, &scratch_arena, &voidstar);
     if(exitcode != 0){
+        sharena_reset(&scratch_arena);
         PyErr_SetString(PyExc_TypeError, "unpack_with_schema failed in mesgpack_to_py");
         return NULL;
     }
 
     PyObject* obj = fromAnything(schema, voidstar);
+    sharena_reset(&scratch_arena);
     if (obj == NULL) {
         PyErr_SetString(PyExc_TypeError, "fromAnything returned NULL");
         return NULL;
     }
 
-    free_schema(schema);
+    return obj;
+}
+
+
+// Load python data from a MessagePack file, decoding directly from a mapping
+// of the file
+static PyObject* mesgpack_file_to_py(PyObject* self, PyObject* args) {
+    const char* path;
+    const char* schema_str;
+    void* voidstar = NULL;
+
+    if (!PyArg_ParseTuple(args, "ss", &path, &schema_str)) {
+        return NULL;
+    }
+
+    const Schema* schema = get_schema(schema_str);
+    if (!schema) {
+        PyErr_SetString(PyExc_ValueError, "mesgpack_file_to_py: Failed to parse schema");
+        return NULL;
+    }
+
+    size_t msgpck_data_len;
+    const char* msgpck_data = mpk_map_file(path, &msgpck_data_len);
+    if (msgpck_data == NULL) {
+        PyErr_Format(PyExc_OSError, "mesgpack_file_to_py: Failed to map '%s'", path);
+        return NULL;
+    }
+
+    int exitcode = unpack_with_schema_to_arena(msgpck_data, msgpck_data_len, schema, &scratch_arena, &voidstar);
+    mpk_unmap_file(msgpck_data, msgpck_data_len);
+    if(exitcode != 0){
+        sharena_reset(&scratch_arena);
+        PyErr_SetString(PyExc_TypeError, "unpack_with_schema failed in mesgpack_file_to_py");
+        return NULL;
+    }
+
+    PyObject* obj = fromAnything(schema, voidstar);
+    sharena_reset(&scratch_arena);
+    if (obj == NULL) {
+        PyErr_SetString(PyExc_TypeError, "fromAnything returned NULL");
+        return NULL;
+    }
 
     return obj;
 }
 
+// Load a voidstar from a MessagePack file
+static PyObject* from_mesgpack_file(PyObject* self, PyObject* args) {
+    const char* path;
+    const char* schema;
+    void* voidstar = NULL;
+
+    if (!PyArg_ParseTuple(args, "ss", &path, &schema)) {
+        return NULL;
+    }
+
+    int exitcode = unpack_file(path, schema, &voidstar);
+    if (exitcode != 0) {
+        PyErr_Format(PyExc_RuntimeError, "Unpacking '%s' failed with exit code %d", path, exitcode);
+        return NULL;
+    }
+
+    PyObject* voidstar_capsule = PyCapsule_New(voidstar, "absptr_t", voidstar_destructor);
+    if (!voidstar_capsule) {
+        shfree(voidstar);
+        return NULL;
+    }
+
+    return voidstar_capsule;
+}
 
 
 // initialize a shared memory pool with one volume
@@ -733,6 +816,39 @@ static PyObject* shm_close(PyObject* self, PyObject* args) {
     Py_RETURN_NONE;
 }
 
+// Allocate the voidstars made by to_voidstar and to_shm from an arena until
+// arena_release is called, which frees them all at once
+static PyObject* arena_begin(PyObject* self, PyObject* args) {
+    // 0 selects the default chunk size
+    Py_ssize_t chunk_size = 0;
+    if (!PyArg_ParseTuple(args, "|n", &chunk_size)) {
+        return NULL;
+    }
+    if (chunk_size < 0) {
+        PyErr_SetString(PyExc_ValueError, "arena_begin: chunk size must not be negative");
+        return NULL;
+    }
+
+    if (user_arena_active) {
+        sharena_release(&user_arena);
+    }
+    if (sharena_begin(&user_arena, (size_t)chunk_size) != 0) {
+        user_arena_active = false;
+        PyErr_SetString(PyExc_MemoryError, "Failed to allocate arena");
+        return NULL;
+    }
+    user_arena_active = true;
+    Py_RETURN_NONE;
+}
+
+static PyObject* arena_release(PyObject* self, PyObject* args) {
+    if (user_arena_active) {
+        sharena_release(&user_arena);
+        user_arena_active = false;
+    }
+    Py_RETURN_NONE;
+}
+
 // Take a python object and a schema, convert it to voidstar, write the
 // voidstar to the shared memory pool, and return the relative pointer as an
 // integer.
@@ -744,11 +860,16 @@ static PyObject* to_shm(PyObject* self, PyObject* args) {
       return NULL;
   }
 
-  Schema* schema = parse_schema(&schema_str);
-
-  void* voidstar = to_voidstar_c(schema, obj);
+  const Schema* schema = get_schema(schema_str);
+  if (!schema) {
+      PyErr_SetString(PyExc_ValueError, "to_shm: Failed to parse schema");
+      return NULL;
+  }
 
-  free_schema(schema);
+  void* voidstar = to_voidstar_c(schema, obj, user_arena_active ? &user_arena : NULL);
+  if (!voidstar) {
+      return NULL;
+  }
 
   relptr_t relptr = abs2rel(voidstar);
   return PyLong_FromSize_t(relptr);
@@ -764,13 +885,15 @@ static PyObject* from_shm(PyObject* self, PyObject* args) {
       return NULL;
   }
 
-  Schema* schema = parse_schema(&schema_str);
+  const Schema* schema = get_schema(schema_str);
+  if (!schema) {
+      PyErr_SetString(PyExc_ValueError, "from_shm: Failed to parse schema");
+      return NULL;
+  }
 
   absptr_t voidstar = rel2abs(relptr);
 
   PyObject* obj = fromAnything(schema, voidstar);
-
-  free_schema(schema);
     
   return obj;
 }
@@ -783,10 +906,14 @@ static PyMethodDef Methods[] = {
     {"from_voidstar", from_voidstar, METH_VARARGS, "Convert voidstar to python data"},
     {"py_to_mesgpack", py_to_mesgpack, METH_VARARGS, "Convert python data to mesgpack"},
     {"mesgpack_to_py", mesgpack_to_py, METH_VARARGS, "Convert mesgpack to python data"},
+    {"from_mesgpack_file", from_mesgpack_file, METH_VARARGS, "Deserialize a MessagePack file to voidstar"},
+    {"mesgpack_file_to_py", mesgpack_file_to_py, METH_VARARGS, "Load python data from a MessagePack file"},
     {"shm_rel2abs", shm_rel2abs, METH_VARARGS, "Convert a relative shared memory pointer to an absolute pointer to process memory"},
     {"shm_abs2rel", shm_abs2rel, METH_VARARGS, "Convert an absolute pointer to process memory to a relative shared memory pointer"},
     {"shm_start", shm_start, METH_VARARGS, "Initialize the shared memory pool"},
     {"shm_close", shm_close, METH_VARARGS, "Close shared memory pool"},
+    {"arena_begin", arena_begin, METH_VARARGS, "Allocate new voidstars from an arena until arena_release"},
+    {"arena_release", arena_release, METH_VARARGS, "Free every voidstar allocated since arena_begin"},
     {"to_shm", to_shm, METH_VARARGS, "Write python object to memory pool and return a relative pointer"},
     {"from_shm", from_shm, METH_VARARGS, "Create a python object from a memory pool relative pointer"},
     {NULL, NULL, 0, NULL} // this is a sentinel value
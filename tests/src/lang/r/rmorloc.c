@@ -18,6 +18,8 @@ SEXP from_voidstar(const void* data, const Schema* schema);
 // Shared memory functions
 SEXP shm_start(SEXP shm_basename_r, SEXP shm_size_r);
 SEXP shm_close();
+SEXP arena_begin(SEXP chunk_size_r);
+SEXP arena_release();
 SEXP to_shm(SEXP obj, SEXP schema_str_r);
 SEXP from_shm(SEXP relptr_r, SEXP schema_str_r);
 
@@ -233,7 +235,8 @@ void* to_voidstar_r(void* dest, void** cursor, SEXP obj, const Schema* schema){
                 array->size = (size_t)strlen(str);  // Do not include null terminator
                 array->data = abs2rel(*cursor); 
 
-                memcpy(rel2abs(array->data), str, array->size);
+                // the cursor is already an absolute address
+                memcpy(*cursor, str, array->size);
 
                 // move cursor to the location after the copied data
                 *cursor = (void*)(*(char**)cursor + array->size);
@@ -244,7 +247,9 @@ void* to_voidstar_r(void* dest, void** cursor, SEXP obj, const Schema* schema){
             array->size = (size_t)length(obj);
             array->data = abs2rel(*cursor);
             Schema* element_schema = schema->parameters[0];
-            char* start;
+            // the elements are written at the cursor, which is already absolute
+            ArrayView view = { *(char**)cursor, array->size, element_schema->width };
+            char* start = view.data;
           
             switch (TYPEOF(obj)) {
                 case STRSXP:
@@ -254,7 +259,7 @@ void* to_voidstar_r(void* dest, void** cursor, SEXP obj, const Schema* schema){
                             *cursor = (void*)(*(char**)cursor + array->size * element_schema->width); 
                             for(size_t i = 0; i < array->size; i++){
                                 SEXP elem = STRING_ELT(obj, i);
-                                void* element_ptr = rel2abs(array->data + i * element_schema->width);
+                                void* element_ptr = array_view_at(view, i);
                                 to_voidstar_r(element_ptr, cursor, elem, element_schema); 
                             }
                         } else {
@@ -266,21 +271,20 @@ void* to_voidstar_r(void* dest, void** cursor, SEXP obj, const Schema* schema){
                     if (element_schema->type != MORLOC_UINT8) {
                         error("Expected MORLOC_UINT8 for raw vector");
                     }
-                    memcpy(rel2abs(array->data), RAW(obj), array->size * sizeof(uint8_t));
+                    memcpy(start, RAW(obj), array->size * sizeof(uint8_t));
                     *cursor = (void*)(*(char**)cursor + array->size * sizeof(uint8_t)); 
                     break;
                 case VECSXP:  // This handles lists
                     *cursor = (void*)(*(char**)cursor + array->size * element_schema->width); 
                     for (int i = 0; i < array->size; i++) {
                         SEXP elem = VECTOR_ELT(obj, i);
-                        void* element_ptr = rel2abs(array->data + i * element_schema->width);
+                        void* element_ptr = array_view_at(view, i);
                         to_voidstar_r(element_ptr, cursor, elem, element_schema);
                     }
                     break;
 
                 case LGLSXP:
                     *cursor = (void*)(*(char**)cursor + array->size * element_schema->width); 
-                    start = rel2abs(array->data);
                     for (int i = 0; i < array->size; i++) {
                         SEXP elem = PROTECT(ScalarLogical(LOGICAL(obj)[i]));
                         to_voidstar_r(start + i, cursor, elem, element_schema);
@@ -289,7 +293,6 @@ void* to_voidstar_r(void* dest, void** cursor, SEXP obj, const Schema* schema){
                     break;
                 case INTSXP:
                     *cursor = (void*)(*(char**)cursor + array->size * element_schema->width); 
-                    start = rel2abs(array->data);
                     for (int i = 0; i < array->size; i++) {
                         SEXP elem = PROTECT(ScalarInteger(INTEGER(obj)[i]));
                         to_voidstar_r(start + i * element_schema->width, cursor, elem, element_schema);
@@ -298,7 +301,6 @@ void* to_voidstar_r(void* dest, void** cursor, SEXP obj, const Schema* schema){
                     break;
                 case REALSXP:
                     *cursor = (void*)(*(char**)cursor + array->size * element_schema->width); 
-                    start = rel2abs(array->data);
                     for (int i = 0; i < array->size; i++) {
                         SEXP elem = PROTECT(ScalarReal(REAL(obj)[i]));
                         to_voidstar_r(start + i * element_schema->width, cursor, elem, element_schema);
@@ -368,16 +370,32 @@ void* to_voidstar_r(void* dest, void** cursor, SEXP obj, const Schema* schema){
 }
 
 
-void* to_voidstar(SEXP obj, const Schema* schema) {
+// Arena used by to_voidstar between arena_begin and arena_release
+static sharena_t user_arena;
+static bool user_arena_active = false;
+
+// Arena for voidstars that only live for one call, it is reset after each use
+static sharena_t scratch_arena;
+
+// Convert an R object to voidstar. If arena is NULL, the voidstar is a block
+// of its own, otherwise it is allocated from the arena.
+static void* to_voidstar_in(SEXP obj, const Schema* schema, sharena_t* arena) {
     size_t total_size = get_shm_size(schema, obj);
 
-    void* dest = shmalloc(total_size);
+    void* dest = arena ? sharena_alloc(arena, total_size) : shmalloc(total_size);
+    if (!dest) {
+        error("Failed to allocate voidstar");
+    }
 
     void* cursor = (void*)((char*)dest + schema->width);
 
     return to_voidstar_r(dest, &cursor, obj, schema);
 }
 
+void* to_voidstar(SEXP obj, const Schema* schema) {
+    return to_voidstar_in(obj, schema, user_arena_active ? &user_arena : NULL);
+}
+
 
 SEXP from_voidstar(const void* data, const Schema* schema) {
     SEXP obj = R_NilValue;
@@ -418,8 +436,8 @@ SEXP from_voidstar(const void* data, const Schema* schema) {
             obj = ScalarReal(*(double*)data);
             break;
         case MORLOC_STRING: {
-            Array* str_array = (Array*)data;
-            SEXP chr = PROTECT(mkCharLen(rel2abs(str_array->data), str_array->size));
+            ArrayView str_view = array_view((Array*)data, 1);
+            SEXP chr = PROTECT(mkCharLen(str_view.data, str_view.size));
             obj = PROTECT(ScalarString(chr));
             UNPROTECT(2);
             break;
@@ -428,12 +446,13 @@ SEXP from_voidstar(const void* data, const Schema* schema) {
             {
                 Array* array = (Array*)data;
                 Schema* element_schema = schema->parameters[0];
-                char* start;
+                // translate once, the elements share one block
+                ArrayView view = array_view(array, element_schema->width);
+                char* start = view.data;
                 
                 switch(element_schema->type){
                     case MORLOC_BOOL:
                         obj = PROTECT(allocVector(LGLSXP, array->size));
-                        start = (char*)rel2abs(array->data);
                         for (size_t i = 0; i < array->size; i++) {
                             LOGICAL(obj)[i] = (bool)*(uint8_t*)(start + i) ? TRUE : FALSE;
                         }
@@ -441,7 +460,6 @@ SEXP from_voidstar(const void* data, const Schema* schema) {
                         break;
                     case MORLOC_SINT8:
                         obj = PROTECT(allocVector(INTSXP, array->size));
-                        start = (char*)rel2abs(array->data);
                         for (size_t i = 0; i < array->size; i++) {
                             INTEGER(obj)[i] = (int)(*(int8_t*)(start + i * sizeof(int8_t)));
                         }
@@ -449,7 +467,6 @@ SEXP from_voidstar(const void* data, const Schema* schema) {
                         break;
                     case MORLOC_SINT16:
                         obj = PROTECT(allocVector(INTSXP, array->size));
-                        start = (char*)rel2abs(array->data);
                         for (size_t i = 0; i < array->size; i++) {
                             INTEGER(obj)[i] = (int)(*(int16_t*)(start + i * sizeof(int16_t)));
                         }
@@ -457,12 +474,11 @@ SEXP from_voidstar(const void* data, const Schema* schema) {
                         break;
                     case MORLOC_SINT32:
                         obj = PROTECT(allocVector(INTSXP, array->size));
-                        memcpy(INTEGER(obj), rel2abs(array->data), array->size * sizeof(int32_t));
+                        memcpy(INTEGER(obj), start, array->size * sizeof(int32_t));
                         UNPROTECT(1);
                         break;
                     case MORLOC_SINT64:
                         obj = PROTECT(allocVector(REALSXP, array->size));
-                        start = (char*)rel2abs(array->data);
                         for (size_t i = 0; i < array->size; i++) {
                             REAL(obj)[i] = (double)(*(int64_t*)(start + i * sizeof(int64_t)));
                         }
@@ -471,12 +487,11 @@ SEXP from_voidstar(const void* data, const Schema* schema) {
                     // Interpret the uint8 as a raw vector
                     case MORLOC_UINT8:
                         obj = PROTECT(allocVector(RAWSXP, array->size));
-                        memcpy(RAW(obj), rel2abs(array->data), array->size * sizeof(uint8_t));
+                        memcpy(RAW(obj), start, array->size * sizeof(uint8_t));
                         UNPROTECT(1);
                         break;
                     case MORLOC_UINT16:
                         obj = PROTECT(allocVector(INTSXP, array->size));
-                        start = (char*)rel2abs(array->data);
                         for (size_t i = 0; i < array->size; i++) {
                             INTEGER(obj)[i] = (int)(*(uint16_t*)(start + i * sizeof(uint16_t)));
                         }
@@ -484,7 +499,6 @@ SEXP from_voidstar(const void* data, const Schema* schema) {
                         break;
                     case MORLOC_UINT32:
                         obj = PROTECT(allocVector(REALSXP, array->size));
-                        start = (char*)rel2abs(array->data);
                         for (size_t i = 0; i < array->size; i++) {
                             REAL(obj)[i] = (double)(*(uint32_t*)(start + i * sizeof(uint32_t)));
                         }
@@ -492,7 +506,6 @@ SEXP from_voidstar(const void* data, const Schema* schema) {
                         break;
                     case MORLOC_UINT64:
                         obj = PROTECT(allocVector(REALSXP, array->size));
-                        start = (char*)rel2abs(array->data);
                         for (size_t i = 0; i < array->size; i++) {
                             REAL(obj)[i] = (double)(*(uint64_t*)(start + i * sizeof(uint64_t)));
                         }
@@ -500,7 +513,6 @@ SEXP from_voidstar(const void* data, const Schema* schema) {
                         break;
                     case MORLOC_FLOAT32:
                         obj = PROTECT(allocVector(REALSXP, array->size));
-                        start = (char*)rel2abs(array->data);
                         for (size_t i = 0; i < array->size; i++) {
                             REAL(obj)[i] = (double)(*(float*)(start + i * sizeof(float)));
                         }
@@ -508,17 +520,15 @@ SEXP from_voidstar(const void* data, const Schema* schema) {
                         break;
                     case MORLOC_FLOAT64:
                         obj = PROTECT(allocVector(REALSXP, array->size));
-                        memcpy(REAL(obj), rel2abs(array->data), array->size * sizeof(double));
+                        memcpy(REAL(obj), start, array->size * sizeof(double));
                         UNPROTECT(1);
                         break;
                     case MORLOC_STRING:
                         {
                             obj = PROTECT(allocVector(STRSXP, array->size));
-                            start = (char*)rel2abs(array->data);
-                            size_t width = schema->width;
                             for (size_t i = 0; i < array->size; i++) {
-                                Array* str_array = (Array*)(start + i * width);
-                                SEXP item = PROTECT(mkCharLen(rel2abs(str_array->data), str_array->size));
+                                ArrayView str_view = array_view((Array*)array_view_at(view, i), 1);
+                                SEXP item = PROTECT(mkCharLen(str_view.data, str_view.size));
                                 UNPROTECT(1);
                                 SET_STRING_ELT(obj, i, item);
                             }
@@ -528,10 +538,8 @@ SEXP from_voidstar(const void* data, const Schema* schema) {
                     default:
                         {
                             obj = allocVector(VECSXP, array->size);
-                            start = (char*)rel2abs(array->data);
-                            size_t width = element_schema->width;
                             for (size_t i = 0; i < array->size; i++) {
-                                SEXP item = from_voidstar(start + width * i, element_schema);
+                                SEXP item = from_voidstar(array_view_at(view, i), element_schema);
                                 if (item == R_NilValue) {
                                     obj = R_NilValue;
                                     goto error;
@@ -590,7 +598,7 @@ SEXP to_mesgpack(SEXP r_obj, SEXP r_schema_str) {
     PROTECT(r_schema_str);
 
     const char* schema_str = CHAR(STRING_ELT(r_schema_str, 0));
-    Schema* schema = parse_schema(&schema_str);
+    const Schema* schema = get_schema(schema_str);
 
     if (!schema) {
         UNPROTECT(2);
@@ -600,7 +608,6 @@ SEXP to_mesgpack(SEXP r_obj, SEXP r_schema_str) {
     void* data = to_voidstar(r_obj, schema);
 
     if (!data) {
-        free_schema(schema);
         UNPROTECT(2);
         error("Failed to convert R object to Anything");
     }
@@ -610,7 +617,6 @@ SEXP to_mesgpack(SEXP r_obj, SEXP r_schema_str) {
     int result = pack_with_schema(data, schema, &packed_data, &packed_size);
 
     if (result != 0 || !packed_data) {
-        free_schema(schema);
         UNPROTECT(2);
         error("Packing failed");
     }
@@ -620,7 +626,6 @@ SEXP to_mesgpack(SEXP r_obj, SEXP r_schema_str) {
 
     // Clean up
     /* free(packed_data); */
-    free_schema(schema);
 
     UNPROTECT(3);
     return r_packed;
@@ -634,7 +639,7 @@ SEXP from_mesgpack(SEXP r_packed, SEXP r_schema_str) {
     PROTECT(r_schema_str);
     
     const char* schema_str = CHAR(STRING_ELT(r_schema_str, 0));
-    Schema* schema = parse_schema(&schema_str);
+    const Schema* schema = get_schema(schema_str);
     if (!schema) {
         UNPROTECT(2);
         error("Failed to parse schema");
@@ -647,7 +652,6 @@ SEXP from_mesgpack(SEXP r_packed, SEXP r_schema_str) {
     int result = unpack_with_schema(packed_data, packed_size, schema, &unpacked_data);
 
     if (result != 0 || !unpacked_data) {
-        free_schema(schema);
         UNPROTECT(2);
         error("Unpacking failed");
     }
@@ -656,7 +660,6 @@ SEXP from_mesgpack(SEXP r_packed, SEXP r_schema_str) {
     
     // Assuming unpack_with_schema allocates memory for unpacked_data
     /* free(unpacked_data); */
-    free_schema(schema);
 
     UNPROTECT(3);
     return r_unpacked;
@@ -667,21 +670,25 @@ SEXP r_to_mesgpack(SEXP r_obj, SEXP r_schema_str){
     PROTECT(r_obj);
     PROTECT(r_schema_str);
     const char* schema_str = CHAR(STRING_ELT(r_schema_str, 0));
-    Schema* schema = parse_schema(&schema_str);
+    const Schema* schema = get_schema(schema_str);
+    if (!schema) {
+        UNPROTECT(2);
+        error("Failed to parse schema");
+    }
 
-    void* voidstar = to_voidstar(r_obj, schema);
+    void* voidstar = to_voidstar_in(r_obj, schema, &scratch_arena);
     if (!voidstar) {
+        sharena_reset(&scratch_arena);
         UNPROTECT(2);
-        free_schema(schema);
         error("Failed to convert R object to Anything");
     }
 
     char* packed_data = NULL;
     size_t packed_size = 0;
     int result = pack_with_schema(voidstar, schema, &packed_data, &packed_size);
+    sharena_reset(&scratch_arena);
     if (result != 0 || !packed_data) {
         UNPROTECT(2);
-        free_schema(schema);
         error("Packing failed");
     }
 
@@ -690,7 +697,6 @@ SEXP r_to_mesgpack(SEXP r_obj, SEXP r_schema_str){
 
     // Clean up
     free(packed_data);
-    free_schema(schema);
 
     UNPROTECT(3);
     return r_packed;
@@ -701,7 +707,7 @@ SEXP mesgpack_to_r(SEXP r_mesgpack, SEXP r_schema_str){
     PROTECT(r_schema_str);
     
     const char* schema_str = CHAR(STRING_ELT(r_schema_str, 0));
-    Schema* schema = parse_schema(&schema_str);
+    const Schema* schema = get_schema(schema_str);
     if (!schema) {
         UNPROTECT(2);
         error("Failed to parse schema");
@@ -711,15 +717,53 @@ SEXP mesgpack_to_r(SEXP r_mesgpack, SEXP r_schema_str){
     size_t packed_size = LENGTH(r_mesgpack);
 
     void* voidstar = NULL;
-    int result = unpack_with_schema(packed_data, packed_size, schema, &voidstar);
-
-    SEXP obj = from_voidstar(voidstar, schema);
+    int result = unpack_with_schema_to_arena(packed_data, packed_size, schema, &scratch_arena, &voidstar);
     if (result != 0 || !packed_data) {
+        sharena_reset(&scratch_arena);
         UNPROTECT(2);
-        free_schema(schema);
         error("Packing failed");
     }
 
+    SEXP obj = from_voidstar(voidstar, schema);
+    sharena_reset(&scratch_arena);
+
+    UNPROTECT(2);
+    return obj;
+}
+
+// Load an R object from a MessagePack file, decoding directly from a mapping
+// of the file
+SEXP mesgpack_file_to_r(SEXP r_path, SEXP r_schema_str){
+    PROTECT(r_path);
+    PROTECT(r_schema_str);
+
+    const char* path = CHAR(STRING_ELT(r_path, 0));
+    const char* schema_str = CHAR(STRING_ELT(r_schema_str, 0));
+    const Schema* schema = get_schema(schema_str);
+    if (!schema) {
+        UNPROTECT(2);
+        error("Failed to parse schema");
+    }
+
+    size_t packed_size;
+    const char* packed_data = mpk_map_file(path, &packed_size);
+    if (!packed_data) {
+        UNPROTECT(2);
+        error("Failed to map file '%s'", path);
+    }
+
+    void* voidstar = NULL;
+    int result = unpack_with_schema_to_arena(packed_data, packed_size, schema, &scratch_arena, &voidstar);
+    mpk_unmap_file(packed_data, packed_size);
+    if (result != 0) {
+        sharena_reset(&scratch_arena);
+        UNPROTECT(2);
+        error("Unpacking failed");
+    }
+
+    SEXP obj = from_voidstar(voidstar, schema);
+    sharena_reset(&scratch_arena);
+
     UNPROTECT(2);
     return obj;
 }
@@ -745,15 +789,49 @@ SEXP shm_close() {
 }
 
 
+// Allocate the voidstars made by to_voidstar and to_shm from an arena until
+// arena_release is called, which frees them all at once
+SEXP arena_begin(SEXP chunk_size_r) {
+    if (!(isInteger(chunk_size_r) || isReal(chunk_size_r)) || length(chunk_size_r) != 1) {
+        error("Expected a single number for the arena chunk size");
+    }
+    double chunk_size_d = asReal(chunk_size_r);
+    // 0 selects the default chunk size
+    if (ISNAN(chunk_size_d) || !R_FINITE(chunk_size_d) || chunk_size_d < 0 || chunk_size_d >= 0x1p64) {
+        error("Invalid arena chunk size %f", chunk_size_d);
+    }
+    size_t chunk_size = (size_t)chunk_size_d;
+
+    if (user_arena_active) {
+        sharena_release(&user_arena);
+    }
+    user_arena_active = sharena_begin(&user_arena, chunk_size) == 0;
+    if (!user_arena_active) {
+        error("Failed to allocate arena");
+    }
+    return R_NilValue;
+}
+
+
+SEXP arena_release() {
+    if (user_arena_active) {
+        sharena_release(&user_arena);
+        user_arena_active = false;
+    }
+    return R_NilValue;
+}
+
+
 SEXP to_shm(SEXP obj, SEXP schema_str_r) {
     const char* schema_str = CHAR(STRING_ELT(schema_str_r, 0));
 
-    Schema* schema = parse_schema(&schema_str);
+    const Schema* schema = get_schema(schema_str);
+    if (!schema) {
+        error("Failed to parse schema");
+    }
 
     absptr_t voidstar = to_voidstar(obj, schema);
 
-    free_schema(schema);
-
     // relptr_t type is the integer representation of a pointer, so a 64bit integer
     relptr_t relptr = abs2rel(voidstar);
 
@@ -768,14 +846,15 @@ SEXP from_shm(SEXP relptr_r, SEXP schema_str_r) {
     relptr_t relptr = (relptr_t)asReal(relptr_r);
     const char* schema_str = CHAR(STRING_ELT(schema_str_r, 0));
 
-    Schema* schema = parse_schema(&schema_str);
+    const Schema* schema = get_schema(schema_str);
+    if (!schema) {
+        error("Failed to parse schema");
+    }
 
     absptr_t voidstar = rel2abs(relptr);
 
     SEXP obj = from_voidstar(voidstar, schema);
 
-    free_schema(schema);
-
     return obj;
 }
 
@@ -787,9 +866,12 @@ void R_init_rmorloc(DllInfo *info) {
         {"to_mesgpack", (DL_FUNC) &to_mesgpack, 2},
         {"from_mesgpack", (DL_FUNC) &from_mesgpack, 2},
         {"mesgpack_to_r", (DL_FUNC) &mesgpack_to_r, 2},
+        {"mesgpack_file_to_r", (DL_FUNC) &mesgpack_file_to_r, 2},
         {"r_to_mesgpack", (DL_FUNC) &r_to_mesgpack, 2},
         {"shm_start", (DL_FUNC) &shm_start, 2},
         {"shm_close", (DL_FUNC) &shm_close, 0},
+        {"arena_begin", (DL_FUNC) &arena_begin, 1},
+        {"arena_release", (DL_FUNC) &arena_release, 0},
         {"to_shm", (DL_FUNC) &to_shm, 2},
         {"from_shm", (DL_FUNC) &from_shm, 2},
         {NULL, NULL, 0}
@@ -78,7 +78,7 @@ MPACK_API int mpack_read(mpack_tokbuf_t *tb, const char **b, size_t *bl,
 MPACK_API int mpack_write(mpack_tokbuf_t *tb, char **b, size_t *bl,
     const mpack_token_t *tok) FUNUSED FNONULL;
 
-#ifndef bool
+#if !defined(bool) && !defined(__cplusplus)
 # define bool unsigned
 #endif
 
@@ -484,7 +484,7 @@ static int mpack_wnint(char **buf, size_t *buflen, mpack_value_t val)
   uint32_t hi = val.hi;
   uint32_t lo = val.lo;
 
-  if (lo <= 0x80000000) {
+  if (hi != 0xffffffff || lo < 0x80000000) {
     /* int 64 */
     return mpack_w1(buf, buflen, 0xd3) ||
            mpack_w4(buf, buflen, hi)   ||
@@ -860,6 +860,9 @@ static int mpack_is_be(void)
 #include <stdbool.h>
 #include <pthread.h>
 #include <errno.h>
+#include <sys/statfs.h>
+#include <time.h>
+#include <sys/syscall.h>
 
 #define SHM_MAGIC 0xFECA0DF0
 #define BLK_MAGIC 0x0CB10DF0
@@ -880,6 +883,59 @@ typedef void* absptr_t;
 #define VOLNULL -1
 #define RELNULL -1
 
+// Free blocks are kept in segregated free lists, one for each size class, in
+// the style of TLSF (two-level segregated fit). The first level splits block
+// sizes by powers of two and the second level splits each power of two into
+// SHM_SL_COUNT equal ranges. Sizes below SHM_SMALL_SIZE all fall in the first
+// first-level class, which is split into ranges of SHM_ALIGN bytes.
+#define SHM_SL_BITS 4
+#define SHM_SL_COUNT (1 << SHM_SL_BITS)
+#define SHM_FL_COUNT 64
+#define SHM_ALIGN 8
+#define SHM_SMALL_SIZE (SHM_SL_COUNT * SHM_ALIGN)
+
+// Volume flags, recorded in the volume so that every process maps it the
+// same way
+#define SHM_FLAG_HUGETLB 0x1   // the volume is a file on a hugetlbfs mount
+#define SHM_FLAG_HUGEPAGE 0x2  // transparent huge pages were requested
+#define SHM_FLAG_TRIMMED 0x4   // shtrim removed the pages, nothing was allocated since
+#define SHM_FLAG_RESERVED 0x8  // address space for shreserve, not backed up front
+
+// How the pages of new volumes are backed
+typedef enum {
+  SHM_PAGES_DEFAULT,     // normal pages from POSIX shared memory
+  SHM_PAGES_ADVISE_HUGE, // ask for transparent huge pages (MADV_HUGEPAGE)
+  SHM_PAGES_HUGETLB      // explicit huge pages from a hugetlbfs mount
+} shm_page_mode_t;
+
+// Options for creating volumes, set with shinit_with_options. They apply to
+// every volume the process creates afterwards, including those added when
+// the pool grows. A request that the system cannot satisfy falls back to the
+// next best mode rather than failing: hugetlb falls back to transparent huge
+// pages, which fall back to normal pages, and a NUMA binding that the kernel
+// rejects is ignored.
+typedef struct shm_options_s {
+  shm_page_mode_t pages;
+  // Pre-fault every page when a volume is created, so the page faults are
+  // paid once up front rather than on first touch
+  bool populate;
+  // Preferred NUMA node for the pages of new volumes, -1 for the default
+  // policy
+  int numa_node;
+  // Mount point of the hugetlbfs used by SHM_PAGES_HUGETLB, NULL for
+  // /dev/hugepages
+  const char* hugetlbfs_dir;
+  // When the pool is full, the new volume is sized so the whole pool grows
+  // by this factor, but never smaller than min_volume_size or the request
+  double growth_factor;
+  size_t min_volume_size;
+} shm_options_t;
+
+#define SHM_OPTIONS_DEFAULT { SHM_PAGES_DEFAULT, false, -1, NULL, 2.0, 0x400000 }
+
+// /proc/meminfo is read at most this often when choosing volume sizes
+#define SHM_MEMINFO_TTL_NS 1000000000
+
 typedef struct shm_s {
   // A constant identifying this as a morloc shared memory file
   unsigned int magic;
@@ -906,22 +962,53 @@ typedef struct shm_s {
   // the relative pointers they use point to positions in that pool.
   size_t relative_offset;
 
+  // SHM_FLAG_* bits describing how the volume is backed
+  unsigned int flags;
+
   // A global lock that allows many readers but only one writer at a time
   pthread_rwlock_t rwlock;
 
-  // Pointer to the current free memory block header
-  volptr_t cursor;
+  // Bitmap of the first-level size classes that have free blocks
+  uint64_t fl_bitmap;
+
+  // For each first-level class, a bitmap of its second-level classes that
+  // have free blocks
+  uint32_t sl_bitmap[SHM_FL_COUNT];
+
+  // Head of the free list of each size class, VOLNULL if the list is empty
+  volptr_t free_lists[SHM_FL_COUNT][SHM_SL_COUNT];
 } shm_t;
 
 typedef struct block_header_s {
     // a constant magic number identifying a block header
     unsigned int magic;
-    // the number of references to this block
+    // the number of references to this block, only changed with atomic
+    // operations since it is shared by every thread and process using the
+    // block
     unsigned int reference_count;
     // the amount of memory that is stored in the header
     size_t size;
 } block_header_t;
 
+// Every block ends with a boundary tag holding a copy of its size. This lets
+// a block find the header of the block before it, so a freed block can be
+// merged with both of its neighbors in constant time.
+typedef struct block_footer_s {
+    size_t size;
+} block_footer_t;
+
+// The payload of a free block links it into the free list of its size class
+typedef struct free_links_s {
+    volptr_t prev;
+    volptr_t next;
+} free_links_t;
+
+// Block sizes are multiples of SHM_ALIGN and large enough to hold the links
+#define SHM_MIN_BLOCK_SIZE sizeof(free_links_t)
+
+// Space taken by a block beyond its payload
+#define BLK_OVERHEAD (sizeof(block_header_t) + sizeof(block_footer_t))
+
 
 // The index of the current volum
 static size_t current_volume = 0;
@@ -929,15 +1016,51 @@ static char common_basename[MAX_FILENAME_SIZE];
 
 static shm_t* volumes[MAX_VOLUME_NUMBER] = {NULL};
 
+// Serializes the creation of new volumes by threads of this process
+static pthread_mutex_t volumes_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Incremented when the pool is closed, invalidating all thread caches
+static size_t shm_generation = 1;
+
+// Options used for creating new volumes
+static shm_options_t shm_options = SHM_OPTIONS_DEFAULT;
+static char shm_hugetlbfs_dir[MAX_FILENAME_SIZE] = "/dev/hugepages";
+
 shm_t* shinit(const char* shm_basename, size_t volume_index, size_t shm_size);
+shm_t* shinit_with_options(const char* shm_basename, size_t volume_index, size_t shm_size, const shm_options_t* options);
 shm_t* shopen(size_t volume_index);
 void shclose();
 void* shmalloc(size_t size);
+void* shreserve(size_t size);
 void* shmemcpy(void* dest, size_t size);
 int shfree(absptr_t ptr);
+int shincref(absptr_t ptr);
+int shdecref(absptr_t ptr);
 void* shcalloc(size_t nmemb, size_t size);
 void* shrealloc(void* ptr, size_t size);
 size_t total_shm_size();
+void shflush();
+size_t shtrim();
+
+// An arena is a region of the pool for many bump allocations that are all
+// released together. Memory is taken from the pool in large chunks, so an
+// allocation is a pointer increment and releasing the arena costs one shfree
+// per chunk no matter how many objects were allocated. Objects in an arena
+// must not be passed to shfree. A zeroed arena is ready to use.
+typedef struct sharena_s {
+    void* chunk;       // payload of the newest chunk, chunks are linked through their first word
+    size_t used;       // bytes of the newest chunk in use, including the link
+    size_t capacity;   // bytes in the newest chunk
+    size_t chunk_size; // minimum size of new chunks
+    size_t generation; // pool generation the chunks belong to
+} sharena_t;
+
+#define SHARENA_DEFAULT_CHUNK_SIZE 0x100000
+
+int sharena_begin(sharena_t* arena, size_t chunk_size);
+void* sharena_alloc(sharena_t* arena, size_t size);
+void sharena_reset(sharena_t* arena);
+void sharena_release(sharena_t* arena);
 
 volptr_t rel2vol(relptr_t ptr);
 absptr_t rel2abs(relptr_t ptr);
@@ -948,6 +1071,9 @@ relptr_t abs2rel(absptr_t ptr);
 shm_t* abs2shm(absptr_t ptr);
 block_header_t* abs2blk(void* ptr);
 
+static void set_block_size(block_header_t* blk, size_t size);
+static void insert_free_block(shm_t* shm, block_header_t* blk);
+
 
 //             head of volume 1   inter-memory    head of volume 2
 //              n=6  block1          n=20                block2
@@ -966,7 +1092,149 @@ block_header_t* abs2blk(void* ptr);
 //  * relptr abstracts away volumes, viewing the shared memory pool as a
 //    single contiguous block
 
+// Lookup tables for translating pointers in constant time. Volumes are found
+// with a branch-free binary search over MAX_VOLUME_NUMBER sorted entries, so
+// the cost does not depend on how many volumes are mapped or which one holds
+// the pointer. A new table is built whenever a volume is mapped and published
+// with an atomic store, so readers never see a table that is being changed.
+// Pointers in volumes this process has not mapped yet miss the table and fall
+// back to the linear search, which maps them.
+typedef struct volume_table_s {
+    // the relative pointer range of each volume, in volume order, with unused
+    // entries starting at SSIZE_MAX
+    relptr_t rel_start[MAX_VOLUME_NUMBER];
+    relptr_t rel_end[MAX_VOLUME_NUMBER];
+    // absolute address of relative pointer 0 as seen from each volume
+    char* rel_base[MAX_VOLUME_NUMBER];
+    // the data section of each volume, sorted by address, with unused entries
+    // starting at UINTPTR_MAX
+    uintptr_t abs_start[MAX_VOLUME_NUMBER];
+    uintptr_t abs_end[MAX_VOLUME_NUMBER];
+    shm_t* abs_shm[MAX_VOLUME_NUMBER];
+    // tables replaced by this one, they are freed when the pool is closed
+    // since other threads may still be reading them
+    struct volume_table_s* retired;
+} volume_table_t;
+
+static volume_table_t* volume_table = NULL;
+static pthread_mutex_t volume_table_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Index of the last entry in a sorted table that is less than or equal to x
+static size_t search_rel_table(const relptr_t* table, relptr_t x){
+    size_t i = 0;
+    for (size_t step = MAX_VOLUME_NUMBER / 2; step > 0; step /= 2) {
+        i += (size_t)(table[i + step] <= x) * step;
+    }
+    return i;
+}
+
+static size_t search_abs_table(const uintptr_t* table, uintptr_t x){
+    size_t i = 0;
+    for (size_t step = MAX_VOLUME_NUMBER / 2; step > 0; step /= 2) {
+        i += (size_t)(table[i + step] <= x) * step;
+    }
+    return i;
+}
+
+// Rebuild the lookup tables from the volumes mapped by this process
+static void update_volume_table(){
+    volume_table_t* table = (volume_table_t*)malloc(sizeof(volume_table_t));
+    if (table == NULL) {
+        perror("malloc");
+        return;
+    }
+
+    size_t n = 0;
+    for (size_t i = 0; i < MAX_VOLUME_NUMBER; i++) {
+        shm_t* shm = __atomic_load_n(&volumes[i], __ATOMIC_ACQUIRE);
+        table->rel_start[i] = SSIZE_MAX;
+        table->rel_end[i] = SSIZE_MAX;
+        table->rel_base[i] = NULL;
+        table->abs_start[i] = UINTPTR_MAX;
+        table->abs_end[i] = UINTPTR_MAX;
+        table->abs_shm[i] = NULL;
+        if (shm == NULL) {
+            continue;
+        }
+
+        char* data_start = (char*)(shm + 1);
+        table->rel_start[i] = (relptr_t)shm->relative_offset;
+        table->rel_end[i] = (relptr_t)(shm->relative_offset + shm->volume_size);
+        table->rel_base[i] = data_start - shm->relative_offset;
+
+        // insertion sort by address
+        size_t j = n++;
+        while (j > 0 && table->abs_start[j - 1] > (uintptr_t)data_start) {
+            table->abs_start[j] = table->abs_start[j - 1];
+            table->abs_end[j] = table->abs_end[j - 1];
+            table->abs_shm[j] = table->abs_shm[j - 1];
+            j--;
+        }
+        table->abs_start[j] = (uintptr_t)data_start;
+        table->abs_end[j] = (uintptr_t)data_start + shm->volume_size;
+        table->abs_shm[j] = shm;
+    }
+
+    // a gap left by a volume that is not mapped yet must not be skipped
+    // over, so every later volume is left to the linear search
+    for (size_t i = 1; i < MAX_VOLUME_NUMBER; i++) {
+        if (table->rel_start[i - 1] == SSIZE_MAX) {
+            table->rel_start[i] = SSIZE_MAX;
+            table->rel_end[i] = SSIZE_MAX;
+        }
+    }
+
+    pthread_mutex_lock(&volume_table_lock);
+    table->retired = volume_table;
+    __atomic_store_n(&volume_table, table, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&volume_table_lock);
+}
+
+// Free the lookup tables, only safe when no other thread is using the pool
+static void clear_volume_table(){
+    pthread_mutex_lock(&volume_table_lock);
+    volume_table_t* table = volume_table;
+    __atomic_store_n(&volume_table, NULL, __ATOMIC_RELEASE);
+    while (table != NULL) {
+        volume_table_t* retired = table->retired;
+        free(table);
+        table = retired;
+    }
+    pthread_mutex_unlock(&volume_table_lock);
+}
+
+// Find the volume holding a relative pointer, returns -1 if not mapped
+static ssize_t rel_volume_index(const volume_table_t* table, relptr_t ptr){
+    if (table == NULL) {
+        return -1;
+    }
+    size_t i = search_rel_table(table->rel_start, ptr);
+    if (ptr >= table->rel_start[i] && ptr < table->rel_end[i]) {
+        return (ssize_t)i;
+    }
+    return -1;
+}
+
+// Find the table entry of the volume holding an absolute pointer, returns -1
+// if it is not in a mapped volume
+static ssize_t abs_volume_entry(const volume_table_t* table, absptr_t ptr){
+    if (table == NULL) {
+        return -1;
+    }
+    size_t i = search_abs_table(table->abs_start, (uintptr_t)ptr);
+    if ((uintptr_t)ptr >= table->abs_start[i] && (uintptr_t)ptr < table->abs_end[i]) {
+        return (ssize_t)i;
+    }
+    return -1;
+}
+
 volptr_t rel2vol(relptr_t ptr) {
+    const volume_table_t* table = __atomic_load_n(&volume_table, __ATOMIC_ACQUIRE);
+    ssize_t i = rel_volume_index(table, ptr);
+    if (i >= 0) {
+        return (volptr_t)(ptr - table->rel_start[i]);
+    }
+
     for (size_t i = 0; i < MAX_VOLUME_NUMBER; i++) {
         shm_t* shm = volumes[i];
         if (shm == NULL) {
@@ -981,6 +1249,12 @@ volptr_t rel2vol(relptr_t ptr) {
 }
 
 absptr_t rel2abs(relptr_t ptr) {
+    const volume_table_t* table = __atomic_load_n(&volume_table, __ATOMIC_ACQUIRE);
+    ssize_t i = rel_volume_index(table, ptr);
+    if (i >= 0) {
+        return (absptr_t)(table->rel_base[i] + ptr);
+    }
+
     for (size_t i = 0; i < MAX_VOLUME_NUMBER; i++) {
         shm_t* shm = volumes[i];
         if (shm == NULL) {
@@ -1019,6 +1293,12 @@ volptr_t abs2vol(absptr_t ptr, shm_t* shm) {
             return VOLNULL;
         }
     } else {
+        const volume_table_t* table = __atomic_load_n(&volume_table, __ATOMIC_ACQUIRE);
+        ssize_t i = abs_volume_entry(table, ptr);
+        if (i >= 0) {
+            return (volptr_t)((uintptr_t)ptr - table->abs_start[i]);
+        }
+
         for (size_t i = 0; i < MAX_VOLUME_NUMBER; i++) {
             shm_t* current_shm = volumes[i];
             if (current_shm) {
@@ -1036,6 +1316,12 @@ volptr_t abs2vol(absptr_t ptr, shm_t* shm) {
 }
 
 relptr_t abs2rel(absptr_t ptr) {
+    const volume_table_t* table = __atomic_load_n(&volume_table, __ATOMIC_ACQUIRE);
+    ssize_t i = abs_volume_entry(table, ptr);
+    if (i >= 0) {
+        return (relptr_t)((uintptr_t)ptr - table->abs_start[i] + table->abs_shm[i]->relative_offset);
+    }
+
     for (size_t i = 0; i < MAX_VOLUME_NUMBER; i++) {
         shm_t* shm = volumes[i];
         if (shm == NULL) {
@@ -1053,6 +1339,12 @@ relptr_t abs2rel(absptr_t ptr) {
 }
 
 shm_t* abs2shm(absptr_t ptr) {
+    const volume_table_t* table = __atomic_load_n(&volume_table, __ATOMIC_ACQUIRE);
+    ssize_t i = abs_volume_entry(table, ptr);
+    if (i >= 0) {
+        return table->abs_shm[i];
+    }
+
     for (size_t i = 0; i < MAX_VOLUME_NUMBER; i++) {
         shm_t* shm = volumes[i];
         if (shm == NULL) {
@@ -1081,7 +1373,103 @@ block_header_t* abs2blk(void* ptr){
     return blk;
 }
 
+// Build the path of a hugetlb-backed volume
+static void shm_hugetlb_path(char* path, size_t path_size, const char* shm_name){
+    // POSIX shared memory names may start with a slash
+    while (*shm_name == '/') {
+        shm_name++;
+    }
+    snprintf(path, path_size, "%s/%s", shm_hugetlbfs_dir, shm_name);
+}
+
+// Open the file backing a volume. Volumes normally live in POSIX shared
+// memory, hugetlb volumes are files on a hugetlbfs mount.
+static int shm_open_volume(const char* shm_name, int oflag, bool hugetlb){
+    if (hugetlb) {
+        char path[2 * MAX_FILENAME_SIZE];
+        shm_hugetlb_path(path, sizeof(path), shm_name);
+        return open(path, oflag, 0666);
+    }
+    return shm_open(shm_name, oflag, 0666);
+}
+
+static void shm_unlink_volume(const char* shm_name, bool hugetlb){
+    if (hugetlb) {
+        char path[2 * MAX_FILENAME_SIZE];
+        shm_hugetlb_path(path, sizeof(path), shm_name);
+        if (unlink(path) == -1) {
+            perror("unlink");
+        }
+    } else if (shm_unlink(shm_name) == -1 && errno != ENOENT) {
+        // another process that shares the pool may have unlinked it already
+        perror("shm_unlink");
+    }
+}
+
+// Set the preferred NUMA node of a mapping. The policy of a shared mapping
+// belongs to the shared object, so it holds for every process that faults
+// the pages in. The raw system call is used to avoid depending on libnuma.
+static int shm_bind_node(void* addr, size_t size, int node){
+#ifdef SYS_mbind
+    const int mpol_preferred = 1;
+    unsigned long nodemask[16] = { 0 };
+    const size_t bits = 8 * sizeof(unsigned long);
+    if (node < 0 || (size_t)node >= 16 * bits) {
+        errno = EINVAL;
+        return -1;
+    }
+    nodemask[node / bits] = 1UL << (node % bits);
+    // the kernel reads one bit less than maxnode
+    return (int)syscall(SYS_mbind, addr, size, mpol_preferred, nodemask, 16 * bits + 1, 0);
+#else
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+// Fault in every page of a fresh mapping
+static void shm_populate(void* addr, size_t size){
+#ifdef MADV_POPULATE_WRITE
+    if (madvise(addr, size, MADV_POPULATE_WRITE) == 0) {
+        return;
+    }
+#endif
+    // the volume is new, so its pages are still zero
+    size_t page_size = (size_t)sysconf(_SC_PAGESIZE);
+    for (size_t i = 0; i < size; i += page_size) {
+        ((volatile char*)addr)[i] = 0;
+    }
+}
+
 shm_t* shinit(const char* shm_basename, size_t volume_index, size_t shm_size) {
+    return shinit_with_options(shm_basename, volume_index, shm_size, NULL);
+}
+
+static shm_t* shinit_volume(const char* shm_basename, size_t volume_index, size_t shm_size, shm_page_mode_t pages, bool reserved);
+
+// Create or open a volume. If options is NULL, the options of the last call
+// (or the defaults) are used.
+shm_t* shinit_with_options(const char* shm_basename, size_t volume_index, size_t shm_size, const shm_options_t* options) {
+    if (options != NULL) {
+        shm_options = *options;
+        if (options->hugetlbfs_dir != NULL) {
+            strncpy(shm_hugetlbfs_dir, options->hugetlbfs_dir, MAX_FILENAME_SIZE - 1);
+        }
+        shm_options.hugetlbfs_dir = NULL;
+    }
+    return shinit_volume(shm_basename, volume_index, shm_size, shm_options.pages, false);
+}
+
+// Reserved volumes hold worst case reservations that are trimmed once the
+// real size is known, so most of their pages are never written. They are
+// never populated or placed on hugetlbfs, either of which would back every
+// page up front.
+static shm_t* shinit_volume(const char* shm_basename, size_t volume_index, size_t shm_size, shm_page_mode_t pages, bool reserved) {
+    size_t requested_size = shm_size;
+    if (reserved && pages == SHM_PAGES_HUGETLB) {
+        pages = SHM_PAGES_ADVISE_HUGE;
+    }
+
     // Calculate the total size needed for the shared memory segment
     size_t full_size = shm_size + sizeof(shm_t);
     
@@ -1093,22 +1481,36 @@ shm_t* shinit(const char* shm_basename, size_t volume_index, size_t shm_size) {
     // Set the global basename, this will be used to name future volumes
     strncpy(common_basename, shm_basename, MAX_FILENAME_SIZE - 1);
     
-    // Create or open a shared memory object
+    // Open the volume if it already exists, on either backing as in shopen,
+    // so that a volume another process put on hugetlbfs is not shadowed by a
+    // new POSIX object of the same name (or the reverse)
+    int fd = shm_open_volume(shm_name, O_RDWR, false);
+    if (fd != -1 && pages == SHM_PAGES_HUGETLB) {
+        pages = SHM_PAGES_ADVISE_HUGE;
+    }
+    if (fd == -1) {
+        fd = shm_open_volume(shm_name, O_RDWR, true);
+        if (fd != -1) {
+            pages = SHM_PAGES_HUGETLB;
+        }
+    }
+
+    // Otherwise create a shared memory object
     // O_RDWR: Open for reading and writing
     // O_CREAT: Create if it doesn't exist
     // 0666: Set permissions (rw-rw-rw-)
-    int fd = shm_open(shm_name, O_RDWR | O_CREAT, 0666);
+    if (fd == -1 && pages == SHM_PAGES_HUGETLB) {
+        fd = shm_open_volume(shm_name, O_RDWR | O_CREAT, true);
+        if (fd == -1) {
+            // no hugetlbfs mount, try transparent huge pages instead
+            pages = SHM_PAGES_ADVISE_HUGE;
+        }
+    }
     if (fd == -1) {
-        perror("shm_open");
-        return NULL;
+        fd = shm_open_volume(shm_name, O_RDWR | O_CREAT, false);
     }
-
-    // Map the shared memory object into the process's address space
-    volumes[volume_index] = (shm_t*)mmap(NULL, full_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
-
-    if (volumes[volume_index] == MAP_FAILED) {
-        perror("mmap");
-        close(fd);
+    if (fd == -1) {
+        perror("shm_open");
         return NULL;
     }
 
@@ -1122,6 +1524,16 @@ shm_t* shinit(const char* shm_basename, size_t volume_index, size_t shm_size) {
 
     // Check if we've just created the shared memory object
     bool created = (sb.st_size == 0);
+
+    if (created && pages == SHM_PAGES_HUGETLB) {
+        // hugetlbfs files are mapped in whole huge pages
+        struct statfs sfs;
+        if (fstatfs(fd, &sfs) == 0 && sfs.f_bsize > 0) {
+            size_t huge_size = (size_t)sfs.f_bsize;
+            full_size = (full_size + huge_size - 1) / huge_size * huge_size;
+        }
+    }
+
     if (created && ftruncate(fd, full_size) == -1) {
         // Set the size of the shared memory object
         perror("ftruncate");
@@ -1133,8 +1545,48 @@ shm_t* shinit(const char* shm_basename, size_t volume_index, size_t shm_size) {
     full_size = created ? full_size : (size_t)sb.st_size;
     shm_size = full_size - sizeof(shm_t);
 
-    // Cast the mapped memory to our shared memory structure
-    shm_t* shm = (shm_t*)volumes[volume_index];
+    // Pages can be pre-faulted by mmap only if nothing has to be set on the
+    // mapping before the first fault
+    bool populate = created && shm_options.populate && !reserved;
+    bool late_populate = populate && (pages == SHM_PAGES_ADVISE_HUGE || shm_options.numa_node >= 0);
+    int map_flags = MAP_SHARED;
+    if (populate && !late_populate) {
+        map_flags |= MAP_POPULATE;
+    }
+
+    // Map the shared memory object into the process's address space
+    shm_t* shm = (shm_t*)mmap(NULL, full_size, PROT_READ | PROT_WRITE, map_flags, fd, 0);
+
+    if (shm == MAP_FAILED && pages == SHM_PAGES_HUGETLB && created) {
+        // not enough huge pages are reserved, start over with normal pages
+        close(fd);
+        shm_unlink_volume(shm_name, true);
+        return shinit_volume(shm_basename, volume_index, requested_size, SHM_PAGES_ADVISE_HUGE, reserved);
+    }
+
+    if (shm == MAP_FAILED) {
+        perror("mmap");
+        close(fd);
+        return NULL;
+    }
+
+    if (created) {
+        // The backing is chosen before the first page is touched. Failures
+        // here are not errors, the volume just uses normal pages or the
+        // default NUMA policy.
+        if (pages == SHM_PAGES_ADVISE_HUGE) {
+            madvise(shm, full_size, MADV_HUGEPAGE);
+        }
+        if (shm_options.numa_node >= 0) {
+            shm_bind_node(shm, full_size, shm_options.numa_node);
+        }
+        if (late_populate) {
+            shm_populate(shm, full_size);
+        }
+    } else if (shm->flags & SHM_FLAG_HUGEPAGE) {
+        madvise(shm, full_size, MADV_HUGEPAGE);
+    }
+
     if (created) {
         // Initialize the shared memory structure
         shm->magic = SHM_MAGIC;
@@ -1142,6 +1594,15 @@ shm_t* shinit(const char* shm_basename, size_t volume_index, size_t shm_size) {
         shm->volume_name[sizeof(shm->volume_name) - 1] = '\0';
         shm->volume_index = volume_index;
         shm->relative_offset = 0;
+        shm->flags = 0;
+        if (pages == SHM_PAGES_HUGETLB) {
+            shm->flags |= SHM_FLAG_HUGETLB;
+        } else if (pages == SHM_PAGES_ADVISE_HUGE) {
+            shm->flags |= SHM_FLAG_HUGEPAGE;
+        }
+        if (reserved) {
+            shm->flags |= SHM_FLAG_RESERVED;
+        }
         
         // Calculate the relative offset based on previous volumes
         // POTENTIAL ISSUE: This assumes volumes[] is initialized and accessible
@@ -1152,23 +1613,41 @@ shm_t* shinit(const char* shm_basename, size_t volume_index, size_t shm_size) {
         // volume size does not count the shm header
         shm->volume_size = shm_size;
         
-        // Initialize the read-write lock
-        if (pthread_rwlock_init(&shm->rwlock, NULL) != 0) {
+        // Initialize the read-write lock, it is shared by every process that
+        // maps this volume
+        pthread_rwlockattr_t lock_attr;
+        pthread_rwlockattr_init(&lock_attr);
+        pthread_rwlockattr_setpshared(&lock_attr, PTHREAD_PROCESS_SHARED);
+        int lock_status = pthread_rwlock_init(&shm->rwlock, &lock_attr);
+        pthread_rwlockattr_destroy(&lock_attr);
+        if (lock_status != 0) {
             perror("pthread_rwlock_init");
-            munmap(volumes[volume_index], full_size);
+            munmap(shm, full_size);
             close(fd);
             return NULL;
         }
-        shm->cursor = 0;
+        shm->fl_bitmap = 0;
+        memset(shm->sl_bitmap, 0, sizeof(shm->sl_bitmap));
+        for (size_t i = 0; i < SHM_FL_COUNT; i++) {
+            for (size_t j = 0; j < SHM_SL_COUNT; j++) {
+                shm->free_lists[i][j] = VOLNULL;
+            }
+        }
 
-        // Initialize the first block header
+        // Initialize the first block header, the block size does not count
+        // the block header and footer and is rounded down to keep them aligned
         block_header_t* first_block = (block_header_t*)(shm + 1);
         first_block->magic = BLK_MAGIC;
         first_block->reference_count = 0;
-        // block size does not count the block headers
-        first_block->size = shm_size - sizeof(block_header_t);
+        set_block_size(first_block, (shm_size - BLK_OVERHEAD) & ~((size_t)SHM_ALIGN - 1));
+        insert_free_block(shm, first_block);
     }
 
+    // other threads may read the volume table without locking, so the volume
+    // is only published once it is initialized
+    __atomic_store_n(&volumes[volume_index], shm, __ATOMIC_RELEASE);
+    update_volume_table();
+
     close(fd);
     return shm;
 }
@@ -1192,7 +1671,11 @@ shm_t* shopen(size_t volume_index) {
     // Create or open a shared memory object
     // O_RDWR: Open for reading and writing
     // 0666: Set permissions (rw-rw-rw-)
-    int fd = shm_open(shm_name, O_RDWR, 0666);
+    int fd = shm_open_volume(shm_name, O_RDWR, false);
+    if (fd == -1) {
+        // the volume may have been created on hugetlbfs
+        fd = shm_open_volume(shm_name, O_RDWR, true);
+    }
     if (fd == -1) {
         return NULL;
     }
@@ -1206,14 +1689,19 @@ shm_t* shopen(size_t volume_index) {
     size_t volume_size = (size_t)sb.st_size;
 
     // Map the shared memory object into the process's address space
-    volumes[volume_index] = (shm_t*)mmap(NULL, volume_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    shm_t* shm = (shm_t*)mmap(NULL, volume_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
 
-    if (volumes[volume_index] == MAP_FAILED) {
+    if (shm == MAP_FAILED) {
         close(fd);
         return NULL;
     }
 
-    shm_t* shm = (shm_t*)volumes[volume_index];
+    if (shm->flags & SHM_FLAG_HUGEPAGE) {
+        madvise(shm, volume_size, MADV_HUGEPAGE);
+    }
+
+    __atomic_store_n(&volumes[volume_index], shm, __ATOMIC_RELEASE);
+    update_volume_table();
 
     close(fd);
     return shm;
@@ -1221,11 +1709,19 @@ shm_t* shopen(size_t volume_index) {
 
 
 void shclose() {
+    // Return this thread's cached blocks while the volumes are still mapped,
+    // since other processes may go on using them. Blocks cached by other
+    // threads are dropped with the mappings.
+    shflush();
+    __atomic_add_fetch(&shm_generation, 1, __ATOMIC_RELEASE);
+    clear_volume_table();
+
     for (int i = 0; i < MAX_VOLUME_NUMBER; i++) {
         if (volumes[i] != NULL) {
             // Get the name of the shared memory object
             char shm_name[MAX_FILENAME_SIZE];
             strncpy(shm_name, volumes[i]->volume_name, MAX_FILENAME_SIZE);
+            bool hugetlb = volumes[i]->flags & SHM_FLAG_HUGETLB;
 
             // Unmap the shared memory
             size_t full_size = volumes[i]->volume_size + sizeof(shm_t);
@@ -1234,11 +1730,9 @@ void shclose() {
                 // Continue with other volumes even if this one fails
             }
 
-            // Mark the shared memory object for deletion
-            if (shm_unlink(shm_name) == -1) {
-                perror("shm_unlink");
-                // Continue with other volumes even if this one fails
-            }
+            // Mark the shared memory object for deletion, continue with
+            // other volumes even if this one fails
+            shm_unlink_volume(shm_name, hugetlb);
 
             // Set the pointer to NULL to indicate it's no longer valid
             volumes[i] = NULL;
@@ -1264,22 +1758,37 @@ size_t get_available_memory() {
     return total_memory * 1024; // convert from kB to bytes
 }
 
+// The last reading of the available memory, minus the volumes created since.
+// Only used while holding volumes_lock.
+static size_t cached_available_memory = 0;
+static uint64_t cached_available_memory_time = 0;
+
+static size_t probe_available_memory() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    uint64_t now = (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+    if (cached_available_memory_time == 0 || now - cached_available_memory_time > SHM_MEMINFO_TTL_NS) {
+        cached_available_memory = get_available_memory();
+        cached_available_memory_time = now;
+    }
+    return cached_available_memory;
+}
+
 
 static size_t choose_next_volume_size(size_t new_data_size) {
     size_t total_shm_size = 0;
-    size_t last_shm_size = 0;
-    size_t new_volume_size;
-    size_t minimum_required_size = sizeof(shm_t) + sizeof(block_header_t) + new_data_size;
+    size_t minimum_required_size = sizeof(shm_t) + BLK_OVERHEAD + new_data_size;
 
-    // Iterate through volumes to calculate total and last shared memory sizes
     for (size_t i = 0; i < MAX_VOLUME_NUMBER; i++) {
         shm_t* shm = volumes[i];
         if (!shm) break;
-        total_shm_size += shm->volume_size;
-        last_shm_size = shm->volume_size;
+        // reserved volumes are mostly unbacked address space
+        if (!(shm->flags & SHM_FLAG_RESERVED)) {
+            total_shm_size += shm->volume_size;
+        }
     }
 
-    size_t available_memory = get_available_memory();
+    size_t available_memory = probe_available_memory();
 
     // Check if there's enough memory for the new data
     if (minimum_required_size > available_memory) {
@@ -1287,18 +1796,56 @@ static size_t choose_next_volume_size(size_t new_data_size) {
         return 0;
     }
 
-    // Determine the new volume size based on available memory and existing volumes
-    if (total_shm_size < available_memory && minimum_required_size < total_shm_size) {
-        new_volume_size = total_shm_size;
-    } else if (last_shm_size < available_memory && minimum_required_size < last_shm_size) {
-        new_volume_size = last_shm_size;
-    } else {
+    // Grow the pool geometrically, so a growing workload needs a logarithmic
+    // number of volumes
+    size_t new_volume_size = shm_options.min_volume_size;
+    if (shm_options.growth_factor > 1.0) {
+        size_t geometric_size = (size_t)((double)total_shm_size * (shm_options.growth_factor - 1.0));
+        if (geometric_size > new_volume_size) {
+            new_volume_size = geometric_size;
+        }
+    }
+    if (new_volume_size > available_memory) {
+        new_volume_size = available_memory;
+    }
+    if (new_volume_size < minimum_required_size) {
         new_volume_size = minimum_required_size;
     }
 
+    // whole pages, the shm header shares the first page
+    size_t page_size = (size_t)sysconf(_SC_PAGESIZE);
+    new_volume_size = (new_volume_size + sizeof(shm_t) + page_size - 1) / page_size * page_size - sizeof(shm_t);
+
+    cached_available_memory -= new_volume_size < cached_available_memory ? new_volume_size : cached_available_memory;
+
     return new_volume_size;
 }
 
+// Reserved volumes take no memory until they are written, so they are not
+// limited by the available memory. They grow geometrically like other
+// volumes, so reservations that are kept alive use few volumes.
+static size_t choose_reserved_volume_size(size_t new_data_size) {
+    size_t total_reserved_size = 0;
+    for (size_t i = 0; i < MAX_VOLUME_NUMBER; i++) {
+        shm_t* shm = volumes[i];
+        if (!shm) break;
+        if (shm->flags & SHM_FLAG_RESERVED) {
+            total_reserved_size += shm->volume_size;
+        }
+    }
+
+    size_t new_volume_size = sizeof(shm_t) + BLK_OVERHEAD + new_data_size;
+    if (shm_options.growth_factor > 1.0) {
+        size_t geometric_size = (size_t)((double)total_reserved_size * (shm_options.growth_factor - 1.0));
+        if (geometric_size > new_volume_size) {
+            new_volume_size = geometric_size;
+        }
+    }
+
+    size_t page_size = (size_t)sysconf(_SC_PAGESIZE);
+    return (new_volume_size + sizeof(shm_t) + page_size - 1) / page_size * page_size - sizeof(shm_t);
+}
+
 
 
 
@@ -1324,224 +1871,497 @@ block_header_t* get_block(shm_t* shm, ssize_t cursor){
     return blk;
 }
 
-block_header_t* scan_volume(block_header_t* blk, size_t size, char* end){
-    while ((char*)blk + sizeof(block_header_t) + size <= end) {
-        if (!blk){
-            return NULL;
-        }
-        if (blk->magic != BLK_MAGIC) {
-            fprintf(stderr, "Corrupted memory: invalid block magic\n");
-            return NULL;
-        }
+// Find the size class of a block with `size` bytes of payload
+static void size_class(size_t size, size_t* fl, size_t* sl){
+    if (size < SHM_SMALL_SIZE) {
+        *fl = 0;
+        *sl = size / SHM_ALIGN;
+    } else {
+        size_t log2_size = 63 - __builtin_clzll(size);
+        *fl = log2_size - (63 - __builtin_clzll(SHM_SMALL_SIZE)) + 1;
+        *sl = (size >> (log2_size - SHM_SL_BITS)) - SHM_SL_COUNT;
+    }
+}
 
-        // Merge all following free blocks
-        while (blk->reference_count == 0) {
-            block_header_t* next_blk = (block_header_t*)((char*)blk + sizeof(block_header_t) + blk->size);
-            
-            if ((char*)next_blk >= end || next_blk->reference_count != 0) {
-                break;
-            }
+static free_links_t* free_links(block_header_t* blk){
+    return (free_links_t*)(blk + 1);
+}
 
-            // merge the blocks
-            blk->size += sizeof(block_header_t) + next_blk->size;
-            // set the merged block to 0, this step could be skipped
-            memset(next_blk, 0, sizeof(block_header_t) + next_blk->size);
-        }
+// Set the size of a block in both its header and its footer
+static void set_block_size(block_header_t* blk, size_t size){
+    blk->size = size;
+    ((block_footer_t*)((char*)(blk + 1) + size))->size = size;
+}
 
-        // if this block is suitable, return it
-        if (blk->reference_count == 0 && blk->size >= size) {
-            return blk;
-        }
+static block_header_t* next_block(block_header_t* blk){
+    return (block_header_t*)((char*)blk + BLK_OVERHEAD + blk->size);
+}
 
-        blk = (block_header_t*)((char*)blk + sizeof(block_header_t) + blk->size);
-    }
+// Add a free block to the head of the free list for its size class. The
+// caller must hold the volume write lock.
+static void insert_free_block(shm_t* shm, block_header_t* blk){
+    size_t fl, sl;
+    size_class(blk->size, &fl, &sl);
 
-    return NULL;
-}
+    volptr_t blk_vol = abs2vol(blk, shm);
+    volptr_t head = shm->free_lists[fl][sl];
 
-block_header_t* find_free_block_in_volume(shm_t* shm, size_t size) {
-    if (shm == NULL || size == 0) {
-        return NULL;
+    free_links(blk)->prev = VOLNULL;
+    free_links(blk)->next = head;
+    if (head != VOLNULL) {
+        free_links((block_header_t*)vol2abs(head, shm))->prev = blk_vol;
     }
 
-    // try to get the current block at the cursor
-    block_header_t* blk = get_block(shm, shm->cursor);
+    shm->free_lists[fl][sl] = blk_vol;
+    shm->sl_bitmap[fl] |= (uint32_t)1 << sl;
+    shm->fl_bitmap |= (uint64_t)1 << fl;
+}
 
-    if (blk != NULL && blk->size >= size + sizeof(block_header_t) && blk->reference_count == 0) {
-        return blk;
-    }
+// Remove a free block from its free list. The caller must hold the volume
+// write lock.
+static void remove_free_block(shm_t* shm, block_header_t* blk){
+    size_t fl, sl;
+    size_class(blk->size, &fl, &sl);
 
-    char* shm_end = (char*)shm + sizeof(shm_t) + shm->volume_size;
+    free_links_t* links = free_links(blk);
+    if (links->prev != VOLNULL) {
+        free_links((block_header_t*)vol2abs(links->prev, shm))->next = links->next;
+    } else {
+        shm->free_lists[fl][sl] = links->next;
+    }
+    if (links->next != VOLNULL) {
+        free_links((block_header_t*)vol2abs(links->next, shm))->prev = links->prev;
+    }
 
-    // Lock this pool while searching for a non-cursor block. This is necessary
-    // since adjacent free blocks will be merged, which could potentially lead to
-    // conflicts.
-    if (pthread_rwlock_wrlock(&shm->rwlock) != 0) {
-        perror("Failed to acquire write lock");
-        return NULL;
+    if (shm->free_lists[fl][sl] == VOLNULL) {
+        shm->sl_bitmap[fl] &= ~((uint32_t)1 << sl);
+        if (shm->sl_bitmap[fl] == 0) {
+            shm->fl_bitmap &= ~((uint64_t)1 << fl);
+        }
     }
+}
 
-    block_header_t* new_blk = scan_volume(blk, size, shm_end);
+// Find a free block with at least `size` bytes of payload. The smallest size
+// class whose blocks are all large enough is found from the bitmaps. If there
+// is none, the blocks in the class of `size` itself may still be large enough
+// and are checked one by one. The caller must hold the volume write lock.
+block_header_t* find_free_block_in_volume(shm_t* shm, size_t size) {
+    size_t fl, sl;
 
-    if(!new_blk){
-        blk = get_block(shm, 0);
-        shm_end = (char*)shm + sizeof(shm_t) + shm->cursor;
-        new_blk = scan_volume(blk, size, shm_end);
+    // round up to the start of the next size class
+    size_t search_size = size;
+    if (size >= SHM_SMALL_SIZE) {
+        search_size += ((size_t)1 << (63 - __builtin_clzll(size) - SHM_SL_BITS)) - 1;
     }
 
-    pthread_rwlock_unlock(&shm->rwlock);
-
-    return new_blk;
-}
+    if (search_size >= size) {
+        size_class(search_size, &fl, &sl);
 
+        uint32_t sl_map = shm->sl_bitmap[fl] & (~(uint32_t)0 << sl);
+        if (sl_map == 0 && fl + 1 < SHM_FL_COUNT) {
+            uint64_t fl_map = shm->fl_bitmap & (~(uint64_t)0 << (fl + 1));
+            if (fl_map != 0) {
+                fl = __builtin_ctzll(fl_map);
+                sl_map = shm->sl_bitmap[fl];
+            }
+        }
 
-// Find a free block that can allocate a given size of memory. If no lbock is
-// found, create a new volume.
-static block_header_t* find_free_block(size_t size, shm_t** shm_ptr) {
-    block_header_t* blk;
-    shm_t* shm = volumes[current_volume];
-    if (shm != NULL) {
-        blk = get_block(shm, shm->cursor);
+        if (sl_map != 0) {
+            sl = __builtin_ctz(sl_map);
+            return (block_header_t*)vol2abs(shm->free_lists[fl][sl], shm);
+        }
+    }
 
-        if(blk && blk->size >= size + sizeof(block_header_t)){
-            if(blk && blk->reference_count != 0){
-                perror("Bad cursor (1)");
-            } else {
-                goto success;
-            }
+    size_class(size, &fl, &sl);
+    for (volptr_t v = shm->free_lists[fl][sl]; v != VOLNULL; ) {
+        block_header_t* blk = (block_header_t*)vol2abs(v, shm);
+        if (blk->size >= size) {
+            return blk;
         }
+        v = free_links(blk)->next;
     }
 
-    // If no suitable block is found at the cursor, search through all volumes
-    // for a suitable block, merging free blocks as they are observed
-    for(size_t i = 0; i < MAX_VOLUME_NUMBER; i++){
-      shm = volumes[i]; 
+    return NULL;
+}
 
-      // If no block is found in any volume, create a new volume
-      if(!shm){
-        size_t new_volume_size = choose_next_volume_size(size);
-        shm = shinit(common_basename, i, new_volume_size);
-        blk = (block_header_t*)(shm + 1);
-      }
+// Merge the block following `blk` into it if that block is free. `blk` must
+// not be in a free list. The caller must hold the volume write lock.
+static void merge_next_free_block(shm_t* shm, block_header_t* blk){
+    char* shm_end = (char*)shm + sizeof(shm_t) + shm->volume_size;
+    block_header_t* next_blk = next_block(blk);
+
+    if ((char*)next_blk + BLK_OVERHEAD <= shm_end &&
+        next_blk->magic == BLK_MAGIC &&
+        __atomic_load_n(&next_blk->reference_count, __ATOMIC_RELAXED) == 0) {
+        remove_free_block(shm, next_blk);
+        set_block_size(blk, blk->size + BLK_OVERHEAD + next_blk->size);
+        memset(next_blk, 0, sizeof(block_header_t));
+    }
+}
 
-      blk = find_free_block_in_volume(shm, size);
-      if(blk) {
-          if(blk->reference_count != 0){
-              perror("Bad cursor (2)");
-          } else {
-              current_volume = i;
-              goto success;
-         }
-      }
+// Merge `blk` into the block before it if that block is free and return the
+// merged block. `blk` must not be in a free list. The caller must hold the
+// volume write lock.
+static block_header_t* merge_prev_free_block(shm_t* shm, block_header_t* blk){
+    if ((char*)blk == (char*)(shm + 1)) {
+        return blk;
     }
 
-    perror("Could not find suitable block");
-    return NULL;
+    block_footer_t* prev_footer = (block_footer_t*)blk - 1;
+    block_header_t* prev_blk = (block_header_t*)((char*)prev_footer - prev_footer->size) - 1;
+
+    if (prev_blk->magic == BLK_MAGIC && __atomic_load_n(&prev_blk->reference_count, __ATOMIC_RELAXED) == 0) {
+        remove_free_block(shm, prev_blk);
+        set_block_size(prev_blk, prev_blk->size + BLK_OVERHEAD + blk->size);
+        memset(blk, 0, sizeof(block_header_t));
+        return prev_blk;
+    }
 
-success:
-    *shm_ptr = shm;
     return blk;
 }
 
+// Trim a block that is not in a free list down to `size` bytes. If the
+// remainder can hold a block of its own, it becomes a new free block.
+// The caller must hold the volume write lock.
 static block_header_t* split_block(shm_t* shm, block_header_t* old_block, size_t size) {
-    if (old_block->reference_count > 0){
-        perror("Cannot split block since reference_count > 0");
-        return NULL;
-    }
-    if (old_block->size == size){
-        // hello goldilocks, this block is just the right size
-        return old_block;
-    }
     if (old_block->size < size){
         perror("This block is too small");
         return NULL;
     }
 
-    // lock memory in this pool
-    pthread_rwlock_wrlock(&shm->rwlock);
-
     size_t remaining_free_space = old_block->size - size;
-    old_block->size = size;
 
-    block_header_t* new_free_block = (block_header_t*)((char*)old_block + sizeof(block_header_t) + size);
-    ssize_t new_cursor = abs2vol(new_free_block, shm);
+    // if there is enough free space remaining to create a new block, do so,
+    // otherwise the whole block is used
+    if (remaining_free_space >= BLK_OVERHEAD + SHM_MIN_BLOCK_SIZE){
+        set_block_size(old_block, size);
 
-    // if there is enough free space remaining to create a new block, do so
-    if (remaining_free_space > sizeof(block_header_t)){
-        // start of the new free block
-        shm->cursor = new_cursor;
+        block_header_t* new_free_block = next_block(old_block);
         new_free_block->magic = BLK_MAGIC;
         new_free_block->reference_count = 0;
-        new_free_block->size = remaining_free_space - sizeof(block_header_t);
-    } else {
-        old_block->size += remaining_free_space;
-        memset((void*)new_free_block, 0, remaining_free_space);
-        shm->cursor = -1; 
-    }
+        set_block_size(new_free_block, remaining_free_space - BLK_OVERHEAD);
 
-    pthread_rwlock_unlock(&shm->rwlock);
+        merge_next_free_block(shm, new_free_block);
+        insert_free_block(shm, new_free_block);
+    }
 
     return old_block;
 }
 
-
-void* shmalloc(size_t size) {
-    // Can't allocate nothing ... though technically I could make a 0-sized
-    // block, but why?
-    if (size == 0)
-        return NULL;
-
-    shm_t* shm = NULL;
-    // find a block with sufficient free space
-    block_header_t* blk = find_free_block(size, &shm);
-
-    // If a suitable block is found
-    if (blk) {
-        // trim the block down to size and reset the cursor to the next free block
-        block_header_t* final_blk = split_block(shm, blk, size);
-        if(final_blk){
-            final_blk->reference_count++;
-            return (void*)(final_blk + 1);
-        } else {
-            perror("Failed to allocate block");
-            return NULL;
-        }
-    } else {
-        // No suitable block found
+// Shrink an allocated block in place. The released tail becomes a new free
+// block (merged with the following block if that one is free too). Unlike
+// allocation, this works on blocks that are in use, so a caller may reserve
+// more space than needed and commit the final size later.
+static block_header_t* shrink_block(shm_t* shm, block_header_t* blk, size_t size) {
+    if (blk->size < size){
+        perror("Cannot shrink a block to a larger size");
         return NULL;
     }
-}
 
-void* shmemcpy(void* dest, size_t size){
-    void* src = shmalloc(size);
-    memmove(dest, src, size);
-    return src;
+    pthread_rwlock_wrlock(&shm->rwlock);
+    split_block(shm, blk, size);
+    pthread_rwlock_unlock(&shm->rwlock);
+
+    return blk;
 }
 
-void* shcalloc(size_t nmemb, size_t size) {
-    void* data = shmalloc(nmemb * size);
-    if(data){
-       memset(data, 0, nmemb * size);
+// Round a requested size up to a valid block size, 0 if it is too large
+static size_t block_size(size_t size){
+    if (size > SIZE_MAX - SHM_ALIGN) {
+        return 0;
     }
-    return data;
+    size = (size + SHM_ALIGN - 1) & ~((size_t)SHM_ALIGN - 1);
+    return size < SHM_MIN_BLOCK_SIZE ? SHM_MIN_BLOCK_SIZE : size;
 }
 
+// Take up to `n` blocks with `size` bytes of payload from the free lists of a
+// volume under a single lock. Returns the number of blocks taken.
+static size_t shmalloc_in_volume(shm_t* shm, size_t size, block_header_t** blks, size_t n) {
+    size_t taken = 0;
 
-void* shrealloc(void* ptr, size_t size) {
-    block_header_t* blk = (block_header_t*)((char*)ptr - sizeof(block_header_t));
-    shm_t* shm = abs2shm(ptr);
-    void* new_ptr;
+    pthread_rwlock_wrlock(&shm->rwlock);
 
-    if (!ptr) return shmalloc(size);
+    // pages may be written again, so the next shtrim counts them
+    shm->flags &= ~SHM_FLAG_TRIMMED;
 
-    if (size == 0) {
-        shfree(ptr);
-        return NULL;
+    for (; taken < n; taken++) {
+        block_header_t* blk = find_free_block_in_volume(shm, size);
+        if (!blk) {
+            break;
+        }
+        remove_free_block(shm, blk);
+        split_block(shm, blk, size);
+        __atomic_store_n(&blk->reference_count, 1, __ATOMIC_RELAXED);
+        blks[taken] = blk;
+    }
+
+    pthread_rwlock_unlock(&shm->rwlock);
+
+    return taken;
+}
+
+// Return a block whose reference count has reached zero to the free lists of
+// its volume, merged with any free neighbors. A reference count only becomes
+// zero while the volume lock is held, so every block with a zero count is in
+// a free list. The caller must hold the volume write lock.
+static void release_block_locked(shm_t* shm, block_header_t* blk) {
+    __atomic_store_n(&blk->reference_count, 0, __ATOMIC_RELAXED);
+    merge_next_free_block(shm, blk);
+    blk = merge_prev_free_block(shm, blk);
+    insert_free_block(shm, blk);
+}
+
+static void release_block(shm_t* shm, block_header_t* blk) {
+    pthread_rwlock_wrlock(&shm->rwlock);
+    release_block_locked(shm, blk);
+    pthread_rwlock_unlock(&shm->rwlock);
+}
+
+// per-thread caches ####
+
+// Each thread keeps a cache of small free blocks, binned by exact size, so
+// most small allocations and frees in a busy thread do not touch the volume
+// lock. Cached blocks keep the reference count BLK_CACHED, so to the rest of
+// the pool they look like they are in use and are never merged. The cache is
+// refilled in batches and blocks that do not fit are returned to the pool.
+// Set MORLOC_SHM_THREAD_CACHE to 0 to disable the caches.
+#ifndef MORLOC_SHM_THREAD_CACHE
+#define MORLOC_SHM_THREAD_CACHE 1
+#endif
+
+#define BLK_CACHED UINT_MAX
+#define SHM_CACHE_MAX_SIZE 256
+#define SHM_CACHE_CLASSES (SHM_CACHE_MAX_SIZE / SHM_ALIGN + 1)
+#define SHM_CACHE_DEPTH 32
+#define SHM_CACHE_REFILL 16
+
+typedef struct shm_cache_s {
+    // the pool generation the cached blocks belong to
+    size_t generation;
+    size_t count[SHM_CACHE_CLASSES];
+    block_header_t* blocks[SHM_CACHE_CLASSES][SHM_CACHE_DEPTH];
+} shm_cache_t;
+
+static __thread shm_cache_t shm_cache;
+
+static pthread_once_t shm_cache_once = PTHREAD_ONCE_INIT;
+static pthread_key_t shm_cache_key;
+
+// Return all blocks in a thread cache to the pool
+static void shm_cache_flush(shm_cache_t* cache){
+    if (cache->generation == __atomic_load_n(&shm_generation, __ATOMIC_ACQUIRE)) {
+        for (size_t i = 0; i < SHM_CACHE_CLASSES; i++) {
+            for (size_t j = 0; j < cache->count[i]; j++) {
+                block_header_t* blk = cache->blocks[i][j];
+                shm_t* shm = abs2shm(blk + 1);
+                if (shm) {
+                    release_block(shm, blk);
+                }
+            }
+        }
+    }
+    memset(cache->count, 0, sizeof(cache->count));
+}
+
+// Flush the cache of a thread when it exits
+static void shm_cache_destructor(void* cache){
+    shm_cache_flush((shm_cache_t*)cache);
+}
+
+// Thread-specific destructors are not run for the thread that calls exit(),
+// so the cache of that thread is flushed here. Otherwise its blocks would
+// stay cached in the shared volumes, never merged, after the process is gone.
+static void shm_cache_atexit(){
+    shm_cache_flush(&shm_cache);
+}
+
+// A forked child inherits the caches of its parent, but the cached blocks
+// still belong to the parent, so the child drops them
+static void shm_cache_atfork_child(){
+    __atomic_add_fetch(&shm_generation, 1, __ATOMIC_RELEASE);
+}
+
+static void shm_cache_key_init(){
+    pthread_key_create(&shm_cache_key, shm_cache_destructor);
+    pthread_atfork(NULL, NULL, shm_cache_atfork_child);
+    atexit(shm_cache_atexit);
+}
+
+// Get the cache of this thread, emptied if the pool was closed since it was
+// last used
+static shm_cache_t* get_shm_cache(){
+    size_t generation = __atomic_load_n(&shm_generation, __ATOMIC_ACQUIRE);
+    if (shm_cache.generation != generation) {
+        if (shm_cache.generation == 0) {
+            pthread_once(&shm_cache_once, shm_cache_key_init);
+            pthread_setspecific(shm_cache_key, &shm_cache);
+        }
+        memset(shm_cache.count, 0, sizeof(shm_cache.count));
+        shm_cache.generation = generation;
+    }
+    return &shm_cache;
+}
+
+// Take a block of exactly `size` bytes from this thread's cache
+static block_header_t* shm_cache_pop(size_t size){
+    shm_cache_t* cache = get_shm_cache();
+    size_t i = size / SHM_ALIGN;
+    if (cache->count[i] == 0) {
+        return NULL;
+    }
+    block_header_t* blk = cache->blocks[i][--cache->count[i]];
+    __atomic_store_n(&blk->reference_count, 1, __ATOMIC_RELAXED);
+    return blk;
+}
+
+// Move a block from one reference to cached, returns false if it was not cached
+static bool shm_cache_push(block_header_t* blk){
+    if (blk->size > SHM_CACHE_MAX_SIZE) {
+        return false;
+    }
+    shm_cache_t* cache = get_shm_cache();
+    size_t i = blk->size / SHM_ALIGN;
+    if (cache->count[i] == SHM_CACHE_DEPTH) {
+        return false;
+    }
+    // another thread may have taken a reference in the meantime
+    unsigned int expected = 1;
+    if (!__atomic_compare_exchange_n(&blk->reference_count, &expected, BLK_CACHED, false, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+        return false;
+    }
+    cache->blocks[i][cache->count[i]++] = blk;
+    return true;
+}
+
+// Return this thread's cached blocks to the pool, so they can be merged with
+// their neighbors
+void shflush() {
+#if MORLOC_SHM_THREAD_CACHE
+    shm_cache_flush(get_shm_cache());
+#endif
+}
+
+static void* shmalloc_pool(size_t size, bool reserve) {
+    // Can't allocate nothing ... though technically I could make a 0-sized
+    // block, but why?
+    if (size == 0)
+        return NULL;
+
+    size = block_size(size);
+    if (size == 0) {
+        fprintf(stderr, "Cannot allocate a block this large\n");
+        return NULL;
+    }
+
+    // small blocks are taken from the thread cache, which is refilled in
+    // batches from the pool
+    block_header_t* blks[SHM_CACHE_REFILL];
+    size_t n = 1;
+#if MORLOC_SHM_THREAD_CACHE
+    if (size <= SHM_CACHE_MAX_SIZE) {
+        block_header_t* blk = shm_cache_pop(size);
+        if (blk) {
+            return (void*)(blk + 1);
+        }
+        n = SHM_CACHE_REFILL;
+    }
+#endif
+
+    // try the volume of the last allocation first
+    size_t volume = __atomic_load_n(&current_volume, __ATOMIC_RELAXED);
+    shm_t* shm = __atomic_load_n(&volumes[volume], __ATOMIC_ACQUIRE);
+    size_t taken = shm ? shmalloc_in_volume(shm, size, blks, n) : 0;
+
+    // otherwise search all volumes, creating a new volume if none has space
+    for (size_t i = 0; taken == 0 && i < MAX_VOLUME_NUMBER; i++) {
+        shm = __atomic_load_n(&volumes[i], __ATOMIC_ACQUIRE);
+        if (!shm) {
+            pthread_mutex_lock(&volumes_lock);
+            // another thread may have created the volume in the meantime
+            shm = volumes[i];
+            if (!shm && reserve) {
+                size_t new_volume_size = choose_reserved_volume_size(size);
+                shm = shinit_volume(common_basename, i, new_volume_size, shm_options.pages, true);
+            } else if (!shm) {
+                size_t new_volume_size = choose_next_volume_size(size);
+                if (new_volume_size > 0) {
+                    shm = shinit(common_basename, i, new_volume_size);
+                }
+            }
+            pthread_mutex_unlock(&volumes_lock);
+            if (!shm) {
+                break;
+            }
+        }
+
+        taken = shmalloc_in_volume(shm, size, blks, n);
+        if (taken > 0) {
+            __atomic_store_n(&current_volume, i, __ATOMIC_RELAXED);
+        }
+    }
+
+    if (taken == 0) {
+        perror("Could not find suitable block");
+        return NULL;
+    }
+
+#if MORLOC_SHM_THREAD_CACHE
+    for (size_t i = 1; i < taken; i++) {
+        if (!shm_cache_push(blks[i])) {
+            release_block(shm, blks[i]);
+        }
+    }
+#endif
+
+    return (void*)(blks[0] + 1);
+}
+
+void* shmalloc(size_t size) {
+    return shmalloc_pool(size, false);
+}
+
+// Allocate a worst case block whose unused tail will be returned with
+// shrealloc. Volume pages are only backed by memory once they are written,
+// so if no volume has room, a reserved volume is created without checking
+// the size against the available memory. Only the part of the block that is
+// written uses memory.
+void* shreserve(size_t size) {
+    return shmalloc_pool(size, true);
+}
+
+void* shmemcpy(void* dest, size_t size){
+    void* src = shmalloc(size);
+    memmove(dest, src, size);
+    return src;
+}
+
+void* shcalloc(size_t nmemb, size_t size) {
+    void* data = shmalloc(nmemb * size);
+    if(data){
+       memset(data, 0, nmemb * size);
+    }
+    return data;
+}
+
+
+void* shrealloc(void* ptr, size_t size) {
+    block_header_t* blk = (block_header_t*)((char*)ptr - sizeof(block_header_t));
+    shm_t* shm = abs2shm(ptr);
+    void* new_ptr;
+
+    if (!ptr) return shmalloc(size);
+
+    if (size == 0) {
+        shfree(ptr);
+        return NULL;
     }
 
     if (blk->size >= size) {
-        // The current block is large enough
-        return split_block(shm, blk, size);
+        // The current block is large enough, release any unneeded tail
+        if (!shrink_block(shm, blk, block_size(size))) {
+            return NULL;
+        }
+        return ptr;
     } else {
         // Need to allocate a new block
         new_ptr = shmalloc(size);
@@ -1558,50 +2378,150 @@ void* shrealloc(void* ptr, size_t size) {
 }
 
 
-// Free a chunk of memory. The pointer points to the start of the memory that
-// the user is given relative to the user's process. The block header is just
-// upstream of this position.
-//
-// return 0 for success
-int shfree(absptr_t ptr) {
-
+// Check that a pointer is the start of the payload of a shared memory block
+// and return the block header
+static block_header_t* checked_block(absptr_t ptr){
     // Check if the pointer is accessible
     if (ptr == NULL) {
         errno = EFAULT;
         perror("Invalid or inaccessible shared memory pool pointer - perhaps the pool is closed?");
-        return 1;
+        return NULL;
     }
 
     block_header_t* blk = (block_header_t*)((char*)ptr - sizeof(block_header_t));
 
+    if(blk->magic != BLK_MAGIC){
+      perror("Corrupted memory");
+      return NULL;
+    }
+
+    return blk;
+}
+
+// Add a reference to a block. Reference counts are updated with atomic
+// operations on the shared volume, so any thread of any process that maps the
+// volume may take or drop references concurrently.
+//
+// return 0 for success
+int shincref(absptr_t ptr) {
+    block_header_t* blk = checked_block(ptr);
     if(!blk){
-      perror("Out-of-bounds relative pointer");
       return 1;
     }
 
-    if(blk->magic != BLK_MAGIC){
-      perror("Corrupted memory");
+    unsigned int count = __atomic_load_n(&blk->reference_count, __ATOMIC_RELAXED);
+    do {
+        if(count == 0 || count == BLK_CACHED){
+          perror("Cannot add a reference to a free block");
+          return 1;
+        }
+        if(count == BLK_CACHED - 1){
+          perror("Too many references to block");
+          return 1;
+        }
+    } while (!__atomic_compare_exchange_n(&blk->reference_count, &count, count + 1, true, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED));
+
+    return 0;
+}
+
+// Drop a reference to a block. The pointer points to the start of the memory
+// that the user is given relative to the user's process. The block header is
+// just upstream of this position. When the last reference is dropped, the
+// block is freed.
+//
+// return 0 for success
+int shdecref(absptr_t ptr) {
+    block_header_t* blk = checked_block(ptr);
+    if(!blk){
       return 1;
     }
 
-    if(blk->reference_count == 0){
+    // drop a reference without locking unless it is the last one
+    unsigned int count = __atomic_load_n(&blk->reference_count, __ATOMIC_ACQUIRE);
+    while (count > 1 && count != BLK_CACHED) {
+        if (__atomic_compare_exchange_n(&blk->reference_count, &count, count - 1, true, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            return 0;
+        }
+    }
+
+    if(count == 0 || count == BLK_CACHED){
       perror("Cannot free memory, reference count is already 0");
       return 1;
     }
 
-    // This is an atomic operation, so no need to lock
-    blk->reference_count--;
+#if MORLOC_SHM_THREAD_CACHE
+    if (shm_cache_push(blk)) {
+        return 0;
+    }
+#endif
+
+    shm_t* shm = abs2shm(ptr);
+    if(!shm){
+      perror("Pointer is not in the shared memory pool");
+      return 1;
+    }
 
-    if (blk->reference_count == 0) {
-        // Set memory to 0, this may be perhaps be removed in the future for
-        // performance sake, but for now it helps with diagnostics. Note that the
-        // head remains, it may be used to merge free blocks in the future.
-        memset(blk + 1, 0, blk->size);
+    // the count may have changed since it was read, it only reaches zero
+    // under the volume lock
+    pthread_rwlock_wrlock(&shm->rwlock);
+    if (__atomic_sub_fetch(&blk->reference_count, 1, __ATOMIC_ACQ_REL) == 0) {
+        release_block_locked(shm, blk);
     }
+    pthread_rwlock_unlock(&shm->rwlock);
 
     return 0;
 }
 
+// Free a chunk of memory, that is, drop one reference to it
+//
+// return 0 for success
+int shfree(absptr_t ptr) {
+    return shdecref(ptr);
+}
+
+// Return the memory of trailing volumes that hold no data to the system. The
+// volumes stay mapped, since other processes may still use them, but the
+// pages between the free block's links and its footer are punched out of the
+// shared object, so they take no memory until they are written again. Blocks
+// cached by other threads keep their volumes alive. A volume is only counted
+// once, until a block is allocated in it again.
+//
+// return the number of bytes released
+size_t shtrim(){
+    shflush();
+
+    size_t released = 0;
+    size_t page_size = (size_t)sysconf(_SC_PAGESIZE);
+    for (ssize_t i = MAX_VOLUME_NUMBER - 1; i > 0; i--) {
+        shm_t* shm = __atomic_load_n(&volumes[i], __ATOMIC_ACQUIRE);
+        if (shm == NULL) {
+            continue;
+        }
+
+        pthread_rwlock_wrlock(&shm->rwlock);
+        block_header_t* blk = (block_header_t*)(shm + 1);
+        bool empty = __atomic_load_n(&blk->reference_count, __ATOMIC_RELAXED) == 0 &&
+                     blk->size + BLK_OVERHEAD + SHM_ALIGN > shm->volume_size;
+        if (empty && !(shm->flags & SHM_FLAG_TRIMMED)) {
+            uintptr_t start = (uintptr_t)free_links(blk) + sizeof(free_links_t);
+            uintptr_t end = (uintptr_t)(blk + 1) + blk->size;
+            start = (start + page_size - 1) / page_size * page_size;
+            end = end / page_size * page_size;
+            if (end > start && madvise((void*)start, end - start, MADV_REMOVE) == 0) {
+                released += end - start;
+                shm->flags |= SHM_FLAG_TRIMMED;
+            }
+        }
+        pthread_rwlock_unlock(&shm->rwlock);
+
+        // only trailing volumes are released
+        if (!empty) {
+            break;
+        }
+    }
+    return released;
+}
+
 size_t total_shm_size(){
     size_t total_size = 0;
     shm_t* shm;
@@ -1615,6 +2535,128 @@ size_t total_shm_size(){
 }
 
 
+// Start an arena whose chunks hold at least chunk_size bytes, 0 for the
+// default. The first chunk is allocated up front.
+//
+// return 0 for success
+int sharena_begin(sharena_t* arena, size_t chunk_size) {
+    memset(arena, 0, sizeof(sharena_t));
+    arena->chunk_size = chunk_size;
+    return sharena_alloc(arena, 0) == NULL;
+}
+
+// Drop the chunks of an arena that outlived the pool they were taken from
+static void sharena_check_generation(sharena_t* arena) {
+    size_t generation = __atomic_load_n(&shm_generation, __ATOMIC_ACQUIRE);
+    if (arena->generation != generation) {
+        arena->chunk = NULL;
+        arena->used = 0;
+        arena->capacity = 0;
+        arena->generation = generation;
+    }
+}
+
+void* sharena_alloc(sharena_t* arena, size_t size) {
+    sharena_check_generation(arena);
+
+    size = (size + SHM_ALIGN - 1) & ~((size_t)SHM_ALIGN - 1);
+    if (arena->chunk == NULL || arena->capacity - arena->used < size) {
+        size_t link_size = (sizeof(void*) + SHM_ALIGN - 1) & ~((size_t)SHM_ALIGN - 1);
+        size_t chunk_size = arena->chunk_size > 0 ? arena->chunk_size : SHARENA_DEFAULT_CHUNK_SIZE;
+        if (chunk_size < link_size + size) {
+            chunk_size = link_size + size;
+        }
+        void* chunk = shmalloc(chunk_size);
+        if (chunk == NULL) {
+            return NULL;
+        }
+        *(void**)chunk = arena->chunk;
+        arena->chunk = chunk;
+        arena->used = link_size;
+        arena->capacity = chunk_size;
+    }
+
+    void* ptr = (char*)arena->chunk + arena->used;
+    arena->used += size;
+    return ptr;
+}
+
+// Reserve `size` bytes at the end of the arena for an object whose final size
+// is not known yet. Nothing else may be allocated from the arena until the
+// size is settled with sharena_commit. A reservation that does not fit in the
+// newest chunk gets a chunk of its own from shreserve, which is trimmed to
+// the space that was used.
+static void* sharena_reserve(sharena_t* arena, size_t size) {
+    sharena_check_generation(arena);
+
+    size = (size + SHM_ALIGN - 1) & ~((size_t)SHM_ALIGN - 1);
+    if (arena->chunk != NULL && arena->capacity - arena->used >= size) {
+        return (char*)arena->chunk + arena->used;
+    }
+
+    size_t link_size = (sizeof(void*) + SHM_ALIGN - 1) & ~((size_t)SHM_ALIGN - 1);
+    void* chunk = shreserve(link_size + size);
+    if (chunk == NULL) {
+        return NULL;
+    }
+    *(void**)chunk = arena->chunk;
+    arena->chunk = chunk;
+    arena->used = link_size;
+    arena->capacity = link_size + size;
+    return (char*)chunk + link_size;
+}
+
+// Keep the first `size` bytes of the reservation at `ptr`
+static int sharena_commit(sharena_t* arena, void* ptr, size_t size) {
+    size = (size + SHM_ALIGN - 1) & ~((size_t)SHM_ALIGN - 1);
+    arena->used = (size_t)((char*)ptr - (char*)arena->chunk) + size;
+    size_t chunk_size = arena->chunk_size > 0 ? arena->chunk_size : SHARENA_DEFAULT_CHUNK_SIZE;
+    if (arena->capacity > chunk_size && arena->capacity > arena->used) {
+        // return the tail of a chunk of its own to the pool
+        if (shrealloc(arena->chunk, arena->used) == NULL) {
+            return 1;
+        }
+        arena->capacity = arena->used;
+    }
+    return 0;
+}
+
+// Release everything allocated from the arena but keep its newest chunk, so
+// an arena reused for one message after another does not touch the pool.
+// Oversized chunks made for a single large allocation are not kept.
+void sharena_reset(sharena_t* arena) {
+    sharena_check_generation(arena);
+    size_t chunk_size = arena->chunk_size > 0 ? arena->chunk_size : SHARENA_DEFAULT_CHUNK_SIZE;
+    if (arena->chunk == NULL || arena->capacity > chunk_size) {
+        sharena_release(arena);
+        return;
+    }
+    void* chunk = *(void**)arena->chunk;
+    while (chunk != NULL) {
+        void* prev = *(void**)chunk;
+        shfree(chunk);
+        chunk = prev;
+    }
+    *(void**)arena->chunk = NULL;
+    arena->used = (sizeof(void*) + SHM_ALIGN - 1) & ~((size_t)SHM_ALIGN - 1);
+}
+
+// Release everything allocated from the arena and return its chunks to the
+// pool
+void sharena_release(sharena_t* arena) {
+    sharena_check_generation(arena);
+    void* chunk = arena->chunk;
+    while (chunk != NULL) {
+        void* prev = *(void**)chunk;
+        shfree(chunk);
+        chunk = prev;
+    }
+    arena->chunk = NULL;
+    arena->used = 0;
+    arena->capacity = 0;
+}
+
+
 
 // ===== morloc mesgpack and voidstar handling =====
 
@@ -1692,16 +2734,115 @@ typedef struct Array {
   relptr_t data;
 } Array;
 
+// An Array resolved to process memory. The elements of an array are always
+// written into a single shm block (shmalloc never splits a block across
+// volumes and the voidstar writers carve children out of one allocation), so
+// one pointer translation covers every element and walkers can step through
+// the span with plain pointer arithmetic.
+typedef struct ArrayView {
+  char* data;    // absolute address of the first element
+  size_t size;   // number of elements
+  size_t stride; // bytes between consecutive elements
+} ArrayView;
+
+static inline ArrayView array_view(const Array* array, size_t stride){
+    ArrayView view;
+    view.size = array->size;
+    view.stride = stride;
+    // empty arrays may carry a relptr that was never allocated
+    view.data = array->size > 0 ? (char*)rel2abs(array->data) : NULL;
+    return view;
+}
+
+static inline void* array_view_at(ArrayView view, size_t i){
+    return view.data + i * view.stride;
+}
+
 // Prototypes
 
 Schema* parse_schema(const char** schema_ptr);
+Schema* compile_schema(const char* schema_str);
+const Schema* get_schema(const char* schema_str);
 
 // Main pack function for creating morloc-encoded MessagePack data
 int pack(const void* mlc, const char* schema_str, char** mpkptr, size_t* mpk_size);
 int pack_with_schema(const void* mlc, const Schema* schema, char** mpkptr, size_t* mpk_size);
+int pack_with_schema_to_buffer(const void* mlc, const Schema* schema, char* mpk, size_t mpk_size, size_t* mpk_used);
+int pack_with_schema_parallel(const void* mlc, const Schema* schema, size_t n_threads, char** mpkptr, size_t* mpk_size);
+size_t pack_size(const void* mlc, const Schema* schema);
+
+// A sink receives packed bytes as they are produced and returns 0 on success
+typedef int (*mpk_sink_t)(void* ctx, const char* data, size_t size);
+
+#define MPK_WRITER_DEFAULT_BUFFER_SIZE 0x10000
+
+// Streaming pack through a fixed buffer that is flushed to a sink whenever it
+// fills, so memory use does not depend on the size of the message.
+// `mpk_size` (which may be NULL) is set to the number of bytes written.
+int pack_with_schema_to_sink(const void* mlc, const Schema* schema, mpk_sink_t sink, void* ctx, size_t buffer_size, size_t* mpk_size);
+int pack_with_schema_to_fd(const void* mlc, const Schema* schema, int fd, size_t* mpk_size);
+int pack_with_schema_to_file(const void* mlc, const Schema* schema, FILE* file, size_t* mpk_size);
+int mpk_fd_sink(void* ctx, const char* data, size_t size);
+int mpk_file_sink(void* ctx, const char* data, size_t size);
 
 int unpack(const char* mpk, size_t mpk_size, const char* schema_str, void** mlcptr);
 int unpack_with_schema(const char* mpk, size_t mpk_size, const Schema* schema, void** mlcptr);
+int unpack_with_schema_single_pass(const char* mpk, size_t mpk_size, const Schema* schema, void** mlcptr);
+int unpack_with_schema_zero_copy(const char* mpk, size_t mpk_size, const Schema* schema, void** mlcptr);
+int unpack_with_schema_to_arena(const char* mpk, size_t mpk_size, const Schema* schema, sharena_t* arena, void** mlcptr);
+int unpack_with_schema_parallel(const char* mpk, size_t mpk_size, const Schema* schema, size_t n_threads, void** mlcptr);
+
+// Unpack a MessagePack file by decoding straight from a read-only mapping of
+// it rather than reading it into memory first
+const char* mpk_map_file(const char* path, size_t* size);
+void mpk_unmap_file(const char* data, size_t size);
+int unpack_file(const char* path, const char* schema_str, void** mlcptr);
+int unpack_file_with_schema(const char* path, const Schema* schema, void** mlcptr);
+
+// A push decoder that unpacks a message delivered in arbitrary chunks, for
+// example as it is read from a socket or pipe. Decoding resumes wherever the
+// last chunk ended, both inside a token (the tokenizer keeps partial tokens)
+// and inside the data structure (an explicit stack records the position in
+// every open array and tuple).
+typedef struct mpk_decoder_frame_s {
+    const Schema* schema; // schema of the container, or of the root value
+    char* base;           // where the container's elements are written
+    size_t index;         // the next element
+    size_t size;          // the number of elements
+    int kind;             // MPK_FRAME_*
+} mpk_decoder_frame_t;
+
+#define MPK_FRAME_ROOT 0
+#define MPK_FRAME_ARRAY 1
+#define MPK_FRAME_TUPLE 2
+
+typedef struct mpk_decoder_s {
+    const Schema* schema;
+    mpack_tokbuf_t tokbuf;
+
+    mpk_decoder_frame_t* stack;
+    size_t depth;
+    size_t capacity;
+
+    // string or binary payload being copied
+    char* bytes_dest;
+    size_t bytes_remaining;
+
+    // Output space. If the message size is known, the voidstar is one block
+    // reserved up front, otherwise it is allocated from an arena.
+    sharena_t* arena;
+    char* block;
+    char* cursor;
+    char* block_end;
+
+    void* result;
+    int status;
+} mpk_decoder_t;
+
+int mpk_decoder_init(mpk_decoder_t* dec, const Schema* schema, size_t mgk_size, sharena_t* arena);
+int mpk_decoder_feed(mpk_decoder_t* dec, const char** buf_ptr, size_t* buf_remaining);
+void* mpk_decoder_result(mpk_decoder_t* dec);
+void mpk_decoder_free(mpk_decoder_t* dec);
 
 
 // Helper function to create a schema with parameters
@@ -1717,7 +2858,7 @@ Schema* create_schema_with_params(morloc_serial_type type, size_t width, size_t
     schema->keys = keys;
 
     // for tuples and maps, generate the element offsets
-    if(params){
+    if(params && size > 0){
       schema->offsets = (size_t*)calloc(size, sizeof(size_t));
       schema->offsets[0] = 0;
       for(size_t i = 1; i < size; i++){
@@ -1821,11 +2962,39 @@ void* get_ptr(const Schema* schema){
     return ptr;
 }
 
+// Primitives are stored inline with a constant width
+static bool is_fixed_width(morloc_serial_type type){
+    switch(type){
+      case MORLOC_NIL:
+      case MORLOC_BOOL:
+      case MORLOC_SINT8:
+      case MORLOC_SINT16:
+      case MORLOC_SINT32:
+      case MORLOC_SINT64:
+      case MORLOC_UINT8:
+      case MORLOC_UINT16:
+      case MORLOC_UINT32:
+      case MORLOC_UINT64:
+      case MORLOC_FLOAT32:
+      case MORLOC_FLOAT64:
+        return true;
+      default:
+        return false;
+    }
+}
+
+// Only u1 and i1 arrays may be sent as MessagePack binary data
+static bool is_byte_type(morloc_serial_type type){
+    return type == MORLOC_UINT8 || type == MORLOC_SINT8;
+}
+
 // packing ####
 
 // Try to add `added_size` bytes of space to a buffer, if there is not enough
 // space, increase the buffer size.
-void upsize(
+//
+// return 0 for success, 1 if the buffer is too small and cannot be resized
+int upsize(
   char** data,            // data that will be resized
   char** data_ptr,        // pointer that will be updated to preserve offset
   size_t* remaining_size, // remaining data size
@@ -1833,7 +3002,14 @@ void upsize(
 ){
     // check if any action is needed
     if (added_size <= *remaining_size) {
-        return;
+        return 0;
+    }
+
+    // a NULL buffer belongs to the caller and cannot be resized, it must
+    // already be large enough (see pack_size)
+    if (data == NULL) {
+        fprintf(stderr, "MessagePack output is larger than its buffer\n");
+        return 1;
     }
 
     size_t used_size = *data_ptr - *data;
@@ -1850,15 +3026,24 @@ void upsize(
     }
 
     // allocate memory for the new data
-    *data = (char*)realloc(*data, buffer_size);
+    char* new_data = (char*)realloc(*data, buffer_size);
+    if (new_data == NULL) {
+        perror("realloc");
+        return 1;
+    }
+    *data = new_data;
 
     // point old pointer to the same offset in the new data
     *data_ptr = *data + used_size;
+
+    return 0;
 }
 
 
 // write data to a packet, if the buffer is too small, increase its size
-void write_to_packet(
+//
+// return 0 for success
+int write_to_packet(
   const void* src,                // source data
   char** packet,            // destination
   char** packet_ptr,        // location in the destination that will be written to
@@ -1866,10 +3051,13 @@ void write_to_packet(
   size_t size               // the number of bytes to write
 
 ){
-    upsize(packet, packet_ptr, packet_remaining, size);
+    if (upsize(packet, packet_ptr, packet_remaining, size) != 0) {
+        return 1;
+    }
     memcpy(*packet_ptr, src, size);
     *packet_ptr += size;
     *packet_remaining -= size;
+    return 0;
 }
 
 
@@ -1884,14 +3072,19 @@ int dynamic_mpack_write(
 ) {
     int result = 0;
     if(*packet_remaining <= 0){
-        upsize(packet, packet_ptr, packet_remaining, 1);
+        if (upsize(packet, packet_ptr, packet_remaining, MPACK_MAX_TOKEN_LEN + extra_size) != 0) {
+            return MPACK_ERROR;
+        }
     }
     result = mpack_write(tokbuf, packet_ptr, packet_remaining, token);
-    if (result == MPACK_EOF || *packet_remaining == 0) {
-        upsize(packet, packet_ptr, packet_remaining, token->length + extra_size);
-        if (result == MPACK_EOF) {
-            mpack_write(tokbuf, packet_ptr, packet_remaining, token);
+    // Only grow when the token did not fit. Growing eagerly when the buffer
+    // is exactly full would reallocate exactly-sized buffers after their last
+    // token.
+    if (result == MPACK_EOF) {
+        if (upsize(packet, packet_ptr, packet_remaining, MPACK_MAX_TOKEN_LEN + extra_size) != 0) {
+            return MPACK_ERROR;
         }
+        result = mpack_write(tokbuf, packet_ptr, packet_remaining, token);
     }
     return result;
 }
@@ -2003,16 +3196,560 @@ void free_schema(Schema* schema) {
     free(schema);
 }
 
-//  The main function for writing MessagePack
-int pack_data(
-  const void* mlc,           // input data structure
-  const Schema* schema,      // input data schema
-  char** packet,             // a pointer to the messagepack data
-  char** packet_ptr,         // the current position in the buffer
-  size_t* packet_remaining,  // bytes from current position to the packet end
-  mpack_tokbuf_t* tokbuf
-) {
-    mpack_token_t token;
+// compiled schemas ####
+
+// A compiled schema is a Schema tree stored in a single allocation. The nodes
+// are laid out in preorder, so walking the tree reads memory front to back,
+// and all parameter, offset and key arrays follow the nodes in the same
+// block. The root node is at the start of the block, so the whole schema is
+// released with one call to free. Compiled schemas must not be passed to
+// free_schema.
+
+typedef struct schema_plan_counts_t {
+    size_t nodes;
+    size_t params;
+    size_t key_chars;
+    size_t keys;
+} schema_plan_counts_t;
+
+// Read a size character, failing at the end of the schema string
+static bool schema_plan_size(const char** schema_ptr, size_t* size){
+    if(**schema_ptr == '\0'){
+        fprintf(stderr, "Truncated schema\n");
+        return false;
+    }
+    *size = parse_schema_size(schema_ptr);
+    return true;
+}
+
+// Count the space needed for a compiled schema and check the schema string.
+// Returns false if the schema string is invalid.
+static bool schema_plan_count(const char** schema_ptr, schema_plan_counts_t* counts){
+    char c = **schema_ptr;
+    (*schema_ptr)++;
+    size_t size;
+
+    counts->nodes++;
+
+    switch(c){
+      case SCHEMA_ARRAY:
+        counts->params++;
+        return schema_plan_count(schema_ptr, counts);
+      case SCHEMA_TUPLE:
+      case SCHEMA_MAP:
+        if(!schema_plan_size(schema_ptr, &size)){
+            return false;
+        }
+        counts->params += size;
+        for(size_t i = 0; i < size; i++){
+            if(c == SCHEMA_MAP){
+                size_t key_size;
+                if(!schema_plan_size(schema_ptr, &key_size)){
+                    return false;
+                }
+                if(strnlen(*schema_ptr, key_size) < key_size){
+                    fprintf(stderr, "Truncated record key in schema\n");
+                    return false;
+                }
+                counts->keys++;
+                counts->key_chars += key_size + 1;
+                *schema_ptr += key_size;
+            }
+            if(!schema_plan_count(schema_ptr, counts)){
+                return false;
+            }
+        }
+        return true;
+      case SCHEMA_NIL:
+      case SCHEMA_BOOL:
+        return true;
+      case SCHEMA_SINT:
+      case SCHEMA_UINT:
+        if(!schema_plan_size(schema_ptr, &size)){
+            return false;
+        }
+        if(size != 1 && size != 2 && size != 4 && size != 8){
+            fprintf(stderr, "Integers may only have widths of 1, 2, 4, or 8 bytes; found %lu\n", size);
+            return false;
+        }
+        return true;
+      case SCHEMA_FLOAT:
+        if(!schema_plan_size(schema_ptr, &size)){
+            return false;
+        }
+        if(size != 4 && size != 8){
+            fprintf(stderr, "Floats may only have widths of 4 or 8 bytes, found %lu\n", size);
+            return false;
+        }
+        return true;
+      case SCHEMA_STRING:
+        // strings carry a u1 parameter for compatibility with arrays
+        counts->nodes++;
+        counts->params++;
+        return true;
+      default:
+        fprintf(stderr, "Unrecognized schema type '%c'\n", c);
+        return false;
+    }
+}
+
+// Space in a compiled schema block that has not yet been handed out
+typedef struct schema_plan_cursor_t {
+    Schema* node;
+    Schema** param;
+    size_t* offset;
+    char** key;
+    char* key_char;
+} schema_plan_cursor_t;
+
+static Schema* schema_plan_node(schema_plan_cursor_t* cursor, morloc_serial_type type, size_t width, size_t size, size_t n_params){
+    Schema* schema = cursor->node++;
+    schema->type = type;
+    schema->size = size;
+    schema->width = width;
+    schema->offsets = NULL;
+    schema->parameters = NULL;
+    schema->keys = NULL;
+    if(n_params > 0){
+        schema->parameters = cursor->param;
+        schema->offsets = cursor->offset;
+        cursor->param += n_params;
+        cursor->offset += n_params;
+    }
+    return schema;
+}
+
+static void schema_plan_set_offsets(Schema* schema, size_t n_params){
+    size_t width = 0;
+    for(size_t i = 0; i < n_params; i++){
+        schema->offsets[i] = width;
+        width += schema->parameters[i]->width;
+    }
+    schema->width = width;
+}
+
+// Build a compiled schema from a string already checked by schema_plan_count
+static Schema* schema_plan_build(const char** schema_ptr, schema_plan_cursor_t* cursor){
+    char c = **schema_ptr;
+    (*schema_ptr)++;
+    size_t size;
+    Schema* schema;
+
+    switch(c){
+      case SCHEMA_ARRAY:
+        schema = schema_plan_node(cursor, MORLOC_ARRAY, sizeof(Array), 1, 1);
+        schema->parameters[0] = schema_plan_build(schema_ptr, cursor);
+        schema->offsets[0] = 0;
+        return schema;
+      case SCHEMA_TUPLE:
+        size = parse_schema_size(schema_ptr);
+        schema = schema_plan_node(cursor, MORLOC_TUPLE, 0, size, size);
+        for(size_t i = 0; i < size; i++){
+            schema->parameters[i] = schema_plan_build(schema_ptr, cursor);
+        }
+        schema_plan_set_offsets(schema, size);
+        return schema;
+      case SCHEMA_MAP:
+        size = parse_schema_size(schema_ptr);
+        schema = schema_plan_node(cursor, MORLOC_MAP, 0, size, size);
+        schema->keys = cursor->key;
+        cursor->key += size;
+        for(size_t i = 0; i < size; i++){
+            size_t key_size = parse_schema_size(schema_ptr);
+            memcpy(cursor->key_char, *schema_ptr, key_size);
+            cursor->key_char[key_size] = '\0';
+            schema->keys[i] = cursor->key_char;
+            cursor->key_char += key_size + 1;
+            *schema_ptr += key_size;
+            schema->parameters[i] = schema_plan_build(schema_ptr, cursor);
+        }
+        schema_plan_set_offsets(schema, size);
+        return schema;
+      case SCHEMA_NIL:
+        return schema_plan_node(cursor, MORLOC_NIL, 1, 0, 0);
+      case SCHEMA_BOOL:
+        return schema_plan_node(cursor, MORLOC_BOOL, 1, 0, 0);
+      case SCHEMA_SINT:
+        size = parse_schema_size(schema_ptr);
+        switch(size){
+          case 1: return schema_plan_node(cursor, MORLOC_SINT8, size, 0, 0);
+          case 2: return schema_plan_node(cursor, MORLOC_SINT16, size, 0, 0);
+          case 4: return schema_plan_node(cursor, MORLOC_SINT32, size, 0, 0);
+          default: return schema_plan_node(cursor, MORLOC_SINT64, size, 0, 0);
+        }
+      case SCHEMA_UINT:
+        size = parse_schema_size(schema_ptr);
+        switch(size){
+          case 1: return schema_plan_node(cursor, MORLOC_UINT8, size, 0, 0);
+          case 2: return schema_plan_node(cursor, MORLOC_UINT16, size, 0, 0);
+          case 4: return schema_plan_node(cursor, MORLOC_UINT32, size, 0, 0);
+          default: return schema_plan_node(cursor, MORLOC_UINT64, size, 0, 0);
+        }
+      case SCHEMA_FLOAT:
+        size = parse_schema_size(schema_ptr);
+        if(size == 4){
+            return schema_plan_node(cursor, MORLOC_FLOAT32, size, 0, 0);
+        }
+        return schema_plan_node(cursor, MORLOC_FLOAT64, size, 0, 0);
+      default: // SCHEMA_STRING
+        schema = schema_plan_node(cursor, MORLOC_STRING, sizeof(Array), 0, 1);
+        schema->parameters[0] = schema_plan_node(cursor, MORLOC_UINT8, 1, 0, 0);
+        schema->offsets[0] = 0;
+        return schema;
+    }
+}
+
+// Compile a schema string into a single allocation. The caller owns the
+// result and releases it with free (not free_schema). Returns NULL if the
+// schema string is invalid.
+Schema* compile_schema(const char* schema_str){
+    schema_plan_counts_t counts = {0, 0, 0, 0};
+    const char* schema_ptr = schema_str;
+    if(!schema_plan_count(&schema_ptr, &counts)){
+        return NULL;
+    }
+
+    size_t size = counts.nodes * sizeof(Schema)
+                + counts.params * (sizeof(Schema*) + sizeof(size_t))
+                + counts.keys * sizeof(char*)
+                + counts.key_chars;
+
+    char* block = (char*)malloc(size);
+    if(block == NULL){
+        perror("malloc");
+        return NULL;
+    }
+
+    schema_plan_cursor_t cursor;
+    cursor.node = (Schema*)block;
+    cursor.param = (Schema**)(cursor.node + counts.nodes);
+    cursor.offset = (size_t*)(cursor.param + counts.params);
+    cursor.key = (char**)(cursor.offset + counts.params);
+    cursor.key_char = (char*)(cursor.key + counts.keys);
+
+    schema_ptr = schema_str;
+    return schema_plan_build(&schema_ptr, &cursor);
+}
+
+// Compiled schemas are cached by their schema string for the life of the
+// process. The cache is an open addressing hash table that only grows.
+typedef struct schema_cache_entry_t {
+    uint64_t hash;
+    char* schema_str;
+    const Schema* schema;
+} schema_cache_entry_t;
+
+static schema_cache_entry_t* schema_cache = NULL;
+static size_t schema_cache_capacity = 0;
+static size_t schema_cache_count = 0;
+static pthread_rwlock_t schema_cache_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+// FNV-1a
+static uint64_t schema_hash(const char* schema_str, size_t length){
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for(size_t i = 0; i < length; i++){
+        hash ^= (uint8_t)schema_str[i];
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+// Find a cached schema, the caller must hold schema_cache_lock
+static const Schema* schema_cache_find(const char* schema_str, uint64_t hash){
+    if(schema_cache_capacity == 0){
+        return NULL;
+    }
+    size_t mask = schema_cache_capacity - 1;
+    for(size_t i = hash & mask; schema_cache[i].schema_str != NULL; i = (i + 1) & mask){
+        if(schema_cache[i].hash == hash && strcmp(schema_cache[i].schema_str, schema_str) == 0){
+            return schema_cache[i].schema;
+        }
+    }
+    return NULL;
+}
+
+// Add a schema to the cache, the caller must hold schema_cache_lock for writing
+static int schema_cache_insert(char* schema_str, uint64_t hash, const Schema* schema){
+    // keep the load factor below 3/4
+    if(4 * (schema_cache_count + 1) > 3 * schema_cache_capacity){
+        size_t capacity = schema_cache_capacity == 0 ? 64 : 2 * schema_cache_capacity;
+        schema_cache_entry_t* entries = (schema_cache_entry_t*)calloc(capacity, sizeof(schema_cache_entry_t));
+        if(entries == NULL){
+            perror("calloc");
+            return 1;
+        }
+        for(size_t i = 0; i < schema_cache_capacity; i++){
+            if(schema_cache[i].schema_str == NULL){
+                continue;
+            }
+            size_t j = schema_cache[i].hash & (capacity - 1);
+            while(entries[j].schema_str != NULL){
+                j = (j + 1) & (capacity - 1);
+            }
+            entries[j] = schema_cache[i];
+        }
+        free(schema_cache);
+        schema_cache = entries;
+        schema_cache_capacity = capacity;
+    }
+
+    size_t mask = schema_cache_capacity - 1;
+    size_t i = hash & mask;
+    while(schema_cache[i].schema_str != NULL){
+        i = (i + 1) & mask;
+    }
+    schema_cache[i].hash = hash;
+    schema_cache[i].schema_str = schema_str;
+    schema_cache[i].schema = schema;
+    schema_cache_count++;
+    return 0;
+}
+
+// Get the compiled schema for a schema string, compiling it on first use.
+// The result is owned by the cache and must not be freed or modified.
+// Returns NULL if the schema string is invalid.
+const Schema* get_schema(const char* schema_str){
+    size_t length = strlen(schema_str);
+    uint64_t hash = schema_hash(schema_str, length);
+
+    pthread_rwlock_rdlock(&schema_cache_lock);
+    const Schema* schema = schema_cache_find(schema_str, hash);
+    pthread_rwlock_unlock(&schema_cache_lock);
+
+    if(schema != NULL){
+        return schema;
+    }
+
+    Schema* compiled = compile_schema(schema_str);
+    if(compiled == NULL){
+        return NULL;
+    }
+
+    char* key = (char*)malloc(length + 1);
+    if(key == NULL){
+        perror("malloc");
+        free(compiled);
+        return NULL;
+    }
+    memcpy(key, schema_str, length + 1);
+
+    pthread_rwlock_wrlock(&schema_cache_lock);
+    // another thread may have compiled the same schema in the meantime
+    schema = schema_cache_find(schema_str, hash);
+    if(schema == NULL && schema_cache_insert(key, hash, compiled) == 0){
+        schema = compiled;
+        compiled = NULL;
+        key = NULL;
+    }
+    pthread_rwlock_unlock(&schema_cache_lock);
+
+    free(compiled);
+    free(key);
+
+    return schema;
+}
+
+// Write every element of a numeric array at the full width of its schema type
+// (e.g., every i4 as an int 32) instead of the smallest encoding that holds
+// the value. The output is larger but its size depends only on the schema and
+// the array length, and the elements are encoded without branching on value.
+#ifndef MORLOC_PACK_FIXED_WIDTH
+# define MORLOC_PACK_FIXED_WIDTH 0
+#endif
+
+static inline void mpk_put_be16(unsigned char* p, uint16_t v){
+    p[0] = (unsigned char)(v >> 8);
+    p[1] = (unsigned char)v;
+}
+
+static inline void mpk_put_be32(unsigned char* p, uint32_t v){
+    p[0] = (unsigned char)(v >> 24);
+    p[1] = (unsigned char)(v >> 16);
+    p[2] = (unsigned char)(v >> 8);
+    p[3] = (unsigned char)v;
+}
+
+static inline void mpk_put_be64(unsigned char* p, uint64_t v){
+    mpk_put_be32(p, (uint32_t)(v >> 32));
+    mpk_put_be32(p + 4, (uint32_t)v);
+}
+
+// Encoded sizes of primitives, matching the choices of mpack_wpint,
+// mpack_wnint and mpack_wfloat
+static inline size_t mpk_uint_size(uint64_t v){
+    return v <= 0x7f ? 1 : v <= 0xff ? 2 : v <= 0xffff ? 3 : v <= 0xffffffff ? 5 : 9;
+}
+
+static inline size_t mpk_sint_size(int64_t v){
+    if (v >= 0) return mpk_uint_size((uint64_t)v);
+    return v > -32 ? 1 : v >= INT8_MIN ? 2 : v >= INT16_MIN ? 3 : v >= INT32_MIN ? 5 : 9;
+}
+
+static inline size_t mpk_float_size(double v){
+    return mpack_fits_single(v) ? 5 : 9;
+}
+
+static inline size_t mpk_write_uint(unsigned char* p, uint64_t v){
+    if (v <= 0x7f) {
+        p[0] = (unsigned char)v;
+        return 1;
+    } else if (v <= 0xff) {
+        p[0] = 0xcc;
+        p[1] = (unsigned char)v;
+        return 2;
+    } else if (v <= 0xffff) {
+        p[0] = 0xcd;
+        mpk_put_be16(p + 1, (uint16_t)v);
+        return 3;
+    } else if (v <= 0xffffffff) {
+        p[0] = 0xce;
+        mpk_put_be32(p + 1, (uint32_t)v);
+        return 5;
+    } else {
+        p[0] = 0xcf;
+        mpk_put_be64(p + 1, v);
+        return 9;
+    }
+}
+
+static inline size_t mpk_write_sint(unsigned char* p, int64_t v){
+    if (v >= 0) {
+        return mpk_write_uint(p, (uint64_t)v);
+    } else if (v > -32) {
+        p[0] = (unsigned char)(int8_t)v;
+        return 1;
+    } else if (v >= INT8_MIN) {
+        p[0] = 0xd0;
+        p[1] = (unsigned char)(int8_t)v;
+        return 2;
+    } else if (v >= INT16_MIN) {
+        p[0] = 0xd1;
+        mpk_put_be16(p + 1, (uint16_t)(int16_t)v);
+        return 3;
+    } else if (v >= INT32_MIN) {
+        p[0] = 0xd2;
+        mpk_put_be32(p + 1, (uint32_t)(int32_t)v);
+        return 5;
+    } else {
+        p[0] = 0xd3;
+        mpk_put_be64(p + 1, (uint64_t)v);
+        return 9;
+    }
+}
+
+static inline size_t mpk_write_float(unsigned char* p, double v){
+    if (mpack_fits_single(v)) {
+        float f = (float)v;
+        uint32_t bits;
+        memcpy(&bits, &f, sizeof(bits));
+        p[0] = 0xca;
+        mpk_put_be32(p + 1, bits);
+        return 5;
+    } else {
+        uint64_t bits;
+        memcpy(&bits, &v, sizeof(bits));
+        p[0] = 0xcb;
+        mpk_put_be64(p + 1, bits);
+        return 9;
+    }
+}
+
+// Loop over a primitive array, reading each element as `ctype`
+#define FOR_EACH_PRIMITIVE(ctype, data, n, x, body) \
+    for (size_t _i = 0; _i < (n); _i++) { \
+        ctype x; \
+        memcpy(&x, (data) + _i * sizeof(ctype), sizeof(ctype)); \
+        body; \
+    }
+
+// Exact number of bytes needed to encode the elements of a primitive array
+static size_t pack_primitive_array_size(morloc_serial_type type, size_t width, const char* data, size_t n){
+    size_t size = 0;
+
+    if (type == MORLOC_NIL || type == MORLOC_BOOL) {
+        return n;
+    }
+
+    if (MORLOC_PACK_FIXED_WIDTH) {
+        return n * (1 + width);
+    }
+
+    switch(type){
+      case MORLOC_UINT8:   FOR_EACH_PRIMITIVE(uint8_t,  data, n, x, size += mpk_uint_size(x)); break;
+      case MORLOC_UINT16:  FOR_EACH_PRIMITIVE(uint16_t, data, n, x, size += mpk_uint_size(x)); break;
+      case MORLOC_UINT32:  FOR_EACH_PRIMITIVE(uint32_t, data, n, x, size += mpk_uint_size(x)); break;
+      case MORLOC_UINT64:  FOR_EACH_PRIMITIVE(uint64_t, data, n, x, size += mpk_uint_size(x)); break;
+      case MORLOC_SINT8:   FOR_EACH_PRIMITIVE(int8_t,   data, n, x, size += mpk_sint_size(x)); break;
+      case MORLOC_SINT16:  FOR_EACH_PRIMITIVE(int16_t,  data, n, x, size += mpk_sint_size(x)); break;
+      case MORLOC_SINT32:  FOR_EACH_PRIMITIVE(int32_t,  data, n, x, size += mpk_sint_size(x)); break;
+      case MORLOC_SINT64:  FOR_EACH_PRIMITIVE(int64_t,  data, n, x, size += mpk_sint_size(x)); break;
+      case MORLOC_FLOAT32: FOR_EACH_PRIMITIVE(float,    data, n, x, size += mpk_float_size(x)); break;
+      case MORLOC_FLOAT64: FOR_EACH_PRIMITIVE(double,   data, n, x, size += mpk_float_size(x)); break;
+      default:
+        break;
+    }
+
+    return size;
+}
+
+// Encode the elements of a primitive array into `out`, which must have room
+// for pack_primitive_array_size bytes. Returns the number of bytes written.
+static size_t pack_primitive_array(morloc_serial_type type, const char* data, size_t n, char* out){
+    unsigned char* p = (unsigned char*)out;
+
+    if (type == MORLOC_NIL) {
+        memset(p, 0xc0, n);
+        return n;
+    }
+
+    if (type == MORLOC_BOOL) {
+        for (size_t i = 0; i < n; i++) {
+            p[i] = data[i] ? 0xc3 : 0xc2;
+        }
+        return n;
+    }
+
+    if (MORLOC_PACK_FIXED_WIDTH) {
+        // every element is a type byte followed by the big-endian value
+        switch(type){
+          case MORLOC_UINT8:   FOR_EACH_PRIMITIVE(uint8_t,  data, n, x, (p[0] = 0xcc, p[1] = x, p += 2)); break;
+          case MORLOC_SINT8:   FOR_EACH_PRIMITIVE(uint8_t,  data, n, x, (p[0] = 0xd0, p[1] = x, p += 2)); break;
+          case MORLOC_UINT16:  FOR_EACH_PRIMITIVE(uint16_t, data, n, x, (p[0] = 0xcd, mpk_put_be16(p + 1, x), p += 3)); break;
+          case MORLOC_SINT16:  FOR_EACH_PRIMITIVE(uint16_t, data, n, x, (p[0] = 0xd1, mpk_put_be16(p + 1, x), p += 3)); break;
+          case MORLOC_UINT32:  FOR_EACH_PRIMITIVE(uint32_t, data, n, x, (p[0] = 0xce, mpk_put_be32(p + 1, x), p += 5)); break;
+          case MORLOC_SINT32:  FOR_EACH_PRIMITIVE(uint32_t, data, n, x, (p[0] = 0xd2, mpk_put_be32(p + 1, x), p += 5)); break;
+          case MORLOC_FLOAT32: FOR_EACH_PRIMITIVE(uint32_t, data, n, x, (p[0] = 0xca, mpk_put_be32(p + 1, x), p += 5)); break;
+          case MORLOC_UINT64:  FOR_EACH_PRIMITIVE(uint64_t, data, n, x, (p[0] = 0xcf, mpk_put_be64(p + 1, x), p += 9)); break;
+          case MORLOC_SINT64:  FOR_EACH_PRIMITIVE(uint64_t, data, n, x, (p[0] = 0xd3, mpk_put_be64(p + 1, x), p += 9)); break;
+          case MORLOC_FLOAT64: FOR_EACH_PRIMITIVE(uint64_t, data, n, x, (p[0] = 0xcb, mpk_put_be64(p + 1, x), p += 9)); break;
+          default:
+            break;
+        }
+        return (size_t)(p - (unsigned char*)out);
+    }
+
+    switch(type){
+      case MORLOC_UINT8:   FOR_EACH_PRIMITIVE(uint8_t,  data, n, x, p += mpk_write_uint(p, x)); break;
+      case MORLOC_UINT16:  FOR_EACH_PRIMITIVE(uint16_t, data, n, x, p += mpk_write_uint(p, x)); break;
+      case MORLOC_UINT32:  FOR_EACH_PRIMITIVE(uint32_t, data, n, x, p += mpk_write_uint(p, x)); break;
+      case MORLOC_UINT64:  FOR_EACH_PRIMITIVE(uint64_t, data, n, x, p += mpk_write_uint(p, x)); break;
+      case MORLOC_SINT8:   FOR_EACH_PRIMITIVE(int8_t,   data, n, x, p += mpk_write_sint(p, x)); break;
+      case MORLOC_SINT16:  FOR_EACH_PRIMITIVE(int16_t,  data, n, x, p += mpk_write_sint(p, x)); break;
+      case MORLOC_SINT32:  FOR_EACH_PRIMITIVE(int32_t,  data, n, x, p += mpk_write_sint(p, x)); break;
+      case MORLOC_SINT64:  FOR_EACH_PRIMITIVE(int64_t,  data, n, x, p += mpk_write_sint(p, x)); break;
+      case MORLOC_FLOAT32: FOR_EACH_PRIMITIVE(float,    data, n, x, p += mpk_write_float(p, x)); break;
+      case MORLOC_FLOAT64: FOR_EACH_PRIMITIVE(double,   data, n, x, p += mpk_write_float(p, x)); break;
+      default:
+        break;
+    }
+
+    return (size_t)(p - (unsigned char*)out);
+}
+
+
+// Build the MessagePack token that heads a voidstar value
+static int pack_token(const void* mlc, const Schema* schema, mpack_token_t* token_out) {
+    mpack_token_t token;
     Array* array;
 
     switch (schema->type) {
@@ -2068,7 +3805,29 @@ int pack_data(
             return 1;
     }
 
-    dynamic_mpack_write(tokbuf, packet, packet_ptr, packet_remaining, &token, 0);
+    *token_out = token;
+    return 0;
+}
+
+
+//  The main function for writing MessagePack
+int pack_data(
+  const void* mlc,           // input data structure
+  const Schema* schema,      // input data schema
+  char** packet,             // a pointer to the messagepack data
+  char** packet_ptr,         // the current position in the buffer
+  size_t* packet_remaining,  // bytes from current position to the packet end
+  mpack_tokbuf_t* tokbuf
+) {
+    mpack_token_t token;
+
+    if (pack_token(mlc, schema, &token) != 0) {
+        return 1;
+    }
+
+    if (dynamic_mpack_write(tokbuf, packet, packet_ptr, packet_remaining, &token, 0) != MPACK_OK) {
+        return 1;
+    }
 
     size_t array_length;
     size_t array_width;
@@ -2076,39 +3835,61 @@ int pack_data(
 
     switch(schema->type){
       case MORLOC_STRING:
-        array = (Array*)mlc;
-        write_to_packet(rel2abs(array->data), packet, packet_ptr, packet_remaining, array->size);
+        {
+          ArrayView view = array_view((Array*)mlc, 1);
+          if (write_to_packet(view.data, packet, packet_ptr, packet_remaining, view.size) != 0) {
+              return 1;
+          }
+        }
         break;
       case MORLOC_ARRAY:
         {
-          array_length = ((Array*)mlc)->size;
-          char* data = (char*)rel2abs(((Array*)mlc)->data);
           array_schema = schema->parameters[0];
           array_width = array_schema->width;
+          ArrayView view = array_view((Array*)mlc, array_width);
+          array_length = view.size;
+          char* data = view.data;
+
+          // Primitive arrays are sized exactly, reserved once and encoded
+          // without per-element tokens
+          if (is_fixed_width(array_schema->type) && tokbuf->plen == 0) {
+              size_t size = pack_primitive_array_size(array_schema->type, array_width, data, array_length);
+              if (upsize(packet, packet_ptr, packet_remaining, size) != 0) {
+                  return 1;
+              }
+              pack_primitive_array(array_schema->type, data, array_length, *packet_ptr);
+              *packet_ptr += size;
+              *packet_remaining -= size;
+              break;
+          }
 
           for (size_t i = 0; i < array_length; i++) {
-              pack_data(
-                data + i * array_width,
-                array_schema,
-                packet,
-                packet_ptr,
-                packet_remaining,
-                tokbuf
-              );
+              if (pack_data(
+                    array_view_at(view, i),
+                    array_schema,
+                    packet,
+                    packet_ptr,
+                    packet_remaining,
+                    tokbuf
+                  ) != 0) {
+                  return 1;
+              }
           }
         }
         break;
       case MORLOC_MAP:
       case MORLOC_TUPLE:
         for (size_t i = 0; i < schema->size; i++) {
-            pack_data(
-              (char*)mlc + schema->offsets[i],
-              schema->parameters[i],
-              packet,
-              packet_ptr,
-              packet_remaining,
-              tokbuf
-            );
+            if (pack_data(
+                  (char*)mlc + schema->offsets[i],
+                  schema->parameters[i],
+                  packet,
+                  packet_ptr,
+                  packet_remaining,
+                  tokbuf
+                ) != 0) {
+                return 1;
+            }
         }
         break;
       case MORLOC_NIL:
@@ -2131,14 +3912,122 @@ int pack_data(
 }
 
 
+// Encoded sizes of MessagePack headers, matching mpack_wstr and mpack_warray
+static inline size_t mpk_str_header_size(size_t len){
+    return len < 0x20 ? 1 : len < 0x100 ? 2 : len < 0x10000 ? 3 : 5;
+}
+
+static inline size_t mpk_array_header_size(size_t len){
+    return len < 0x10 ? 1 : len < 0x10000 ? 3 : 5;
+}
+
+// Write the headers whose sizes are given above, returning the bytes written
+static inline size_t mpk_write_str_header(unsigned char* p, size_t len){
+    if (len < 0x20) {
+        p[0] = (unsigned char)(0xa0 | len);
+        return 1;
+    } else if (len < 0x100) {
+        p[0] = 0xd9;
+        p[1] = (unsigned char)len;
+        return 2;
+    } else if (len < 0x10000) {
+        p[0] = 0xda;
+        mpk_put_be16(p + 1, (uint16_t)len);
+        return 3;
+    }
+    p[0] = 0xdb;
+    mpk_put_be32(p + 1, (uint32_t)len);
+    return 5;
+}
+
+static inline size_t mpk_write_array_header(unsigned char* p, size_t len){
+    if (len < 0x10) {
+        p[0] = (unsigned char)(0x90 | len);
+        return 1;
+    } else if (len < 0x10000) {
+        p[0] = 0xdc;
+        mpk_put_be16(p + 1, (uint16_t)len);
+        return 3;
+    }
+    p[0] = 0xdd;
+    mpk_put_be32(p + 1, (uint32_t)len);
+    return 5;
+}
+
+// Calculate the exact number of bytes pack_data will write for a voidstar.
+// This is the mirror of msg_size.
+size_t pack_size(const void* mlc, const Schema* schema){
+    size_t size = 0;
+    const Array* array;
+    const Schema* element;
+
+    switch(schema->type){
+      case MORLOC_NIL:
+      case MORLOC_BOOL:
+        return 1;
+      case MORLOC_UINT8:
+      case MORLOC_UINT16:
+      case MORLOC_UINT32:
+      case MORLOC_UINT64:
+      case MORLOC_SINT8:
+      case MORLOC_SINT16:
+      case MORLOC_SINT32:
+      case MORLOC_SINT64:
+      case MORLOC_FLOAT32:
+      case MORLOC_FLOAT64:
+        // a single element is always written compactly
+        switch(schema->type){
+          case MORLOC_UINT8:   return mpk_uint_size(*(uint8_t*)mlc);
+          case MORLOC_UINT16:  return mpk_uint_size(*(uint16_t*)mlc);
+          case MORLOC_UINT32:  return mpk_uint_size(*(uint32_t*)mlc);
+          case MORLOC_UINT64:  return mpk_uint_size(*(uint64_t*)mlc);
+          case MORLOC_SINT8:   return mpk_sint_size(*(int8_t*)mlc);
+          case MORLOC_SINT16:  return mpk_sint_size(*(int16_t*)mlc);
+          case MORLOC_SINT32:  return mpk_sint_size(*(int32_t*)mlc);
+          case MORLOC_SINT64:  return mpk_sint_size(*(int64_t*)mlc);
+          case MORLOC_FLOAT32: return mpk_float_size(*(float*)mlc);
+          default:             return mpk_float_size(*(double*)mlc);
+        }
+      case MORLOC_STRING:
+        array = (const Array*)mlc;
+        return mpk_str_header_size(array->size) + array->size;
+      case MORLOC_ARRAY:
+        array = (const Array*)mlc;
+        element = schema->parameters[0];
+        {
+            ArrayView view = array_view(array, element->width);
+            size = mpk_array_header_size(view.size);
+            if (is_fixed_width(element->type)) {
+                return size + pack_primitive_array_size(element->type, element->width, view.data, view.size);
+            }
+            for (size_t i = 0; i < view.size; i++) {
+                size += pack_size(array_view_at(view, i), element);
+            }
+        }
+        return size;
+      case MORLOC_MAP:
+      case MORLOC_TUPLE:
+        size = mpk_array_header_size(schema->size);
+        for (size_t i = 0; i < schema->size; i++) {
+            size += pack_size((const char*)mlc + schema->offsets[i], schema->parameters[i]);
+        }
+        return size;
+      default:
+        return 0;
+    }
+}
+
+
 #define MPACK_TOKBUF_INITIAL_VALUE { { 0 }, { (mpack_token_type_t)0, 0, { .value = { 0 } } }, 0, 0, 0 }
 
 int pack_with_schema(const void* mlc, const Schema* schema, char** packet, size_t* packet_size) {
     *packet_size = 0;
 
-    *packet = (char*)malloc(BUFFER_SIZE * sizeof(char));
+    // Size the output exactly so it is allocated once and never copied
+    size_t packet_remaining = pack_size(mlc, schema);
+
+    *packet = (char*)malloc(packet_remaining * sizeof(char));
     if (*packet == NULL) return 1;
-    size_t packet_remaining = BUFFER_SIZE;
     char* packet_ptr = *packet;
 
     mpack_tokbuf_t tokbuf = MPACK_TOKBUF_INITIAL_VALUE;
@@ -2157,36 +4046,273 @@ int pack_with_schema(const void* mlc, const Schema* schema, char** packet, size_
 }
 
 
+// Write the MessagePack encoding of a voidstar into a buffer owned by the
+// caller. `packet_used` is set to the number of bytes required. If this is
+// more than `packet_size`, nothing is written and 1 is returned.
+int pack_with_schema_to_buffer(const void* mlc, const Schema* schema, char* packet, size_t packet_size, size_t* packet_used) {
+    *packet_used = pack_size(mlc, schema);
+    if (*packet_used > packet_size) {
+        return 1;
+    }
+
+    size_t packet_remaining = packet_size;
+    char* packet_ptr = packet;
+
+    mpack_tokbuf_t tokbuf = MPACK_TOKBUF_INITIAL_VALUE;
+
+    // passing a NULL buffer handle keeps pack_data from resizing the buffer,
+    // writing past its end is an error
+    int pack_result = pack_data(mlc, schema, NULL, &packet_ptr, &packet_remaining, &tokbuf);
+
+    *packet_used = packet_ptr - packet;
+
+    return pack_result;
+}
+
+
 // Take a morloc datastructure and convert it to MessagePack
 int pack(const void* mlc, const char* schema_str, char** mpk, size_t* mpk_size) {
-    Schema* schema = parse_schema(&schema_str);
+    const Schema* schema = get_schema(schema_str);
+    if (schema == NULL) {
+        return 1;
+    }
     return pack_with_schema(mlc, schema, mpk, mpk_size);
 }
 
 
-
-// nested msg_sizers
-size_t msg_size(const char* mgk, size_t mgk_size, const Schema* schema);
-size_t msg_size_r(const Schema* schema, mpack_tokbuf_t* tokbuf, const char** buf_ptr, size_t* buf_remaining, mpack_token_t* token);
-size_t msg_size_bytes(mpack_tokbuf_t* tokbuf, const char** buf_ptr, size_t* buf_remaining, mpack_token_t* token);
-size_t msg_size_array(const Schema* schema, mpack_tokbuf_t* tokbuf, const char** buf_ptr, size_t* buf_remaining, mpack_token_t* token);
-size_t msg_size_tuple(const Schema* schema, mpack_tokbuf_t* tokbuf, const char** buf_ptr, size_t* buf_remaining, mpack_token_t* token);
-size_t msg_size_map(const Schema* schema, mpack_tokbuf_t* tokbuf, const char** buf_ptr, size_t* buf_remaining, mpack_token_t* token);
-
-size_t msg_size_bytes(mpack_tokbuf_t* tokbuf, const char** buf_ptr, size_t* buf_remaining, mpack_token_t* token){
-    mpack_read(tokbuf, buf_ptr, buf_remaining, token);
-    size_t array_size = token->length;
-
-    size_t str_idx = 0;
-    while((array_size - str_idx) > 0){
-        mpack_read(tokbuf, buf_ptr, buf_remaining, token);
-        str_idx += token->length;
+// streaming pack ####
+
+// The bounded buffer behind pack_with_schema_to_sink. Bytes are appended at
+// `ptr` and the whole buffer is handed to the sink when it fills.
+typedef struct mpk_writer_s {
+    char* buffer;
+    char* ptr;         // the current position in the buffer
+    size_t remaining;  // bytes from current position to the buffer end
+    size_t capacity;
+    size_t written;    // bytes already handed to the sink
+    mpk_sink_t sink;
+    void* ctx;
+    int status;        // nonzero once the sink has failed
+} mpk_writer_t;
+
+static int mpk_writer_flush(mpk_writer_t* writer){
+    size_t used = writer->ptr - writer->buffer;
+    if (used > 0 && writer->status == 0) {
+        writer->status = writer->sink(writer->ctx, writer->buffer, used);
+        writer->written += used;
     }
-    return array_size + sizeof(Array);
+    writer->ptr = writer->buffer;
+    writer->remaining = writer->capacity;
+    return writer->status;
 }
 
-size_t msg_size_array(const Schema* schema, mpack_tokbuf_t* tokbuf, const char** buf_ptr, size_t* buf_remaining, mpack_token_t* token){
-    mpack_read(tokbuf, buf_ptr, buf_remaining, token);
+// Write a token, flushing whenever it does not fit. A token split across the
+// buffer end is finished from the tokbuf pending bytes after the flush.
+static int mpk_writer_token(mpk_writer_t* writer, mpack_tokbuf_t* tokbuf, mpack_token_t* token){
+    // mpack_write needs at least one free byte
+    if (writer->remaining == 0 && mpk_writer_flush(writer) != 0) {
+        return 1;
+    }
+    while (mpack_write(tokbuf, &writer->ptr, &writer->remaining, token) == MPACK_EOF) {
+        if (mpk_writer_flush(writer) != 0) return 1;
+    }
+    return writer->status;
+}
+
+static int mpk_writer_bytes(mpk_writer_t* writer, const char* data, size_t size){
+    // payloads larger than the buffer go to the sink directly
+    if (size >= writer->capacity) {
+        if (mpk_writer_flush(writer) != 0) return 1;
+        writer->status = writer->sink(writer->ctx, data, size);
+        writer->written += size;
+        return writer->status;
+    }
+    while (size > 0) {
+        if (writer->remaining == 0 && mpk_writer_flush(writer) != 0) return 1;
+        size_t count = size < writer->remaining ? size : writer->remaining;
+        memcpy(writer->ptr, data, count);
+        writer->ptr += count;
+        writer->remaining -= count;
+        data += count;
+        size -= count;
+    }
+    return writer->status;
+}
+
+// The streaming mirror of pack_data
+static int pack_data_to_writer(const void* mlc, const Schema* schema, mpk_writer_t* writer, mpack_tokbuf_t* tokbuf){
+    mpack_token_t token;
+
+    if (pack_token(mlc, schema, &token) != 0) {
+        return 1;
+    }
+    if (mpk_writer_token(writer, tokbuf, &token) != 0) {
+        return 1;
+    }
+
+    switch(schema->type){
+      case MORLOC_STRING:
+        {
+          ArrayView view = array_view((const Array*)mlc, 1);
+          return mpk_writer_bytes(writer, view.data, view.size);
+        }
+      case MORLOC_ARRAY:
+        {
+          const Schema* array_schema = schema->parameters[0];
+          size_t array_width = array_schema->width;
+          ArrayView view = array_view((const Array*)mlc, array_width);
+
+          // Primitive arrays are encoded in batches that are guaranteed to
+          // fit in the space left in the buffer
+          if (is_fixed_width(array_schema->type)) {
+              size_t i = 0;
+              while (i < view.size) {
+                  size_t n = writer->remaining / MPACK_MAX_TOKEN_LEN;
+                  if (n == 0) {
+                      if (mpk_writer_flush(writer) != 0) return 1;
+                      continue;
+                  }
+                  if (n > view.size - i) {
+                      n = view.size - i;
+                  }
+                  size_t size = pack_primitive_array(array_schema->type, (const char*)array_view_at(view, i), n, writer->ptr);
+                  writer->ptr += size;
+                  writer->remaining -= size;
+                  i += n;
+              }
+              return 0;
+          }
+
+          for (size_t i = 0; i < view.size; i++) {
+              if (pack_data_to_writer(array_view_at(view, i), array_schema, writer, tokbuf) != 0) {
+                  return 1;
+              }
+          }
+        }
+        return 0;
+      case MORLOC_MAP:
+      case MORLOC_TUPLE:
+        for (size_t i = 0; i < schema->size; i++) {
+            if (pack_data_to_writer((const char*)mlc + schema->offsets[i], schema->parameters[i], writer, tokbuf) != 0) {
+                return 1;
+            }
+        }
+        return 0;
+      default:
+        return 0;
+    }
+}
+
+int pack_with_schema_to_sink(const void* mlc, const Schema* schema, mpk_sink_t sink, void* ctx, size_t buffer_size, size_t* mpk_size) {
+    if (mpk_size != NULL) {
+        *mpk_size = 0;
+    }
+
+    // the buffer must at least hold one whole token
+    if (buffer_size == 0) {
+        buffer_size = MPK_WRITER_DEFAULT_BUFFER_SIZE;
+    } else if (buffer_size < MPACK_MAX_TOKEN_LEN) {
+        buffer_size = MPACK_MAX_TOKEN_LEN;
+    }
+
+    mpk_writer_t writer;
+    writer.buffer = (char*)malloc(buffer_size);
+    if (writer.buffer == NULL) {
+        perror("malloc");
+        return 1;
+    }
+    writer.ptr = writer.buffer;
+    writer.remaining = buffer_size;
+    writer.capacity = buffer_size;
+    writer.written = 0;
+    writer.sink = sink;
+    writer.ctx = ctx;
+    writer.status = 0;
+
+    mpack_tokbuf_t tokbuf = MPACK_TOKBUF_INITIAL_VALUE;
+
+    int pack_result = pack_data_to_writer(mlc, schema, &writer, &tokbuf);
+    if (mpk_writer_flush(&writer) != 0) {
+        pack_result = 1;
+    }
+
+    if (mpk_size != NULL) {
+        *mpk_size = writer.written;
+    }
+
+    free(writer.buffer);
+    return pack_result;
+}
+
+// Sink for a file descriptor, `ctx` points to the int descriptor
+int mpk_fd_sink(void* ctx, const char* data, size_t size) {
+    int fd = *(int*)ctx;
+    while (size > 0) {
+        ssize_t count = write(fd, data, size);
+        if (count < 0) {
+            if (errno == EINTR) continue;
+            perror("write");
+            return 1;
+        }
+        data += count;
+        size -= (size_t)count;
+    }
+    return 0;
+}
+
+// Sink for a stdio stream, `ctx` is the FILE*
+int mpk_file_sink(void* ctx, const char* data, size_t size) {
+    if (fwrite(data, 1, size, (FILE*)ctx) != size) {
+        perror("fwrite");
+        return 1;
+    }
+    return 0;
+}
+
+int pack_with_schema_to_fd(const void* mlc, const Schema* schema, int fd, size_t* mpk_size) {
+    return pack_with_schema_to_sink(mlc, schema, mpk_fd_sink, &fd, MPK_WRITER_DEFAULT_BUFFER_SIZE, mpk_size);
+}
+
+// stdio already buffers, so only a small staging buffer is used
+int pack_with_schema_to_file(const void* mlc, const Schema* schema, FILE* file, size_t* mpk_size) {
+    return pack_with_schema_to_sink(mlc, schema, mpk_file_sink, file, BUFFER_SIZE, mpk_size);
+}
+
+
+
+// nested msg_sizers
+size_t msg_size(const char* mgk, size_t mgk_size, const Schema* schema);
+size_t msg_size_bound(const Schema* schema, size_t mgk_size);
+size_t msg_size_r(const Schema* schema, mpack_tokbuf_t* tokbuf, const char** buf_ptr, size_t* buf_remaining, mpack_token_t* token);
+size_t msg_size_bytes(mpack_tokbuf_t* tokbuf, const char** buf_ptr, size_t* buf_remaining, mpack_token_t* token);
+size_t msg_size_array(const Schema* schema, mpack_tokbuf_t* tokbuf, const char** buf_ptr, size_t* buf_remaining, mpack_token_t* token);
+size_t msg_size_tuple(const Schema* schema, mpack_tokbuf_t* tokbuf, const char** buf_ptr, size_t* buf_remaining, mpack_token_t* token);
+size_t msg_size_map(const Schema* schema, mpack_tokbuf_t* tokbuf, const char** buf_ptr, size_t* buf_remaining, mpack_token_t* token);
+
+// Skip the data of a string or binary token whose header was just read
+static size_t msg_size_bytes_data(mpack_tokbuf_t* tokbuf, const char** buf_ptr, size_t* buf_remaining, mpack_token_t* token){
+    size_t array_size = token->length;
+
+    size_t str_idx = 0;
+    while((array_size - str_idx) > 0){
+        mpack_read(tokbuf, buf_ptr, buf_remaining, token);
+        str_idx += token->length;
+    }
+    return array_size + sizeof(Array);
+}
+
+size_t msg_size_bytes(mpack_tokbuf_t* tokbuf, const char** buf_ptr, size_t* buf_remaining, mpack_token_t* token){
+    mpack_read(tokbuf, buf_ptr, buf_remaining, token);
+    return msg_size_bytes_data(tokbuf, buf_ptr, buf_remaining, token);
+}
+
+size_t msg_size_array(const Schema* schema, mpack_tokbuf_t* tokbuf, const char** buf_ptr, size_t* buf_remaining, mpack_token_t* token){
+    mpack_read(tokbuf, buf_ptr, buf_remaining, token);
+    // binary data is rejected by parse_array unless the elements are bytes,
+    // so it is only sized as a byte array here
+    if(token->type == MPACK_TOKEN_BIN){
+        return msg_size_bytes_data(tokbuf, buf_ptr, buf_remaining, token);
+    }
     size_t array_length = token->length;
     size_t size = sizeof(Array);
     for(size_t i = 0; i < array_length; i++){
@@ -2243,19 +4369,90 @@ size_t msg_size(const char* mgk, size_t mgk_size, const Schema* schema) {
 }
 
 
+// The fewest MessagePack bytes that can encode a value of this schema. Only
+// the bytes present for every value are counted: headers of arrays and
+// strings, but not their contents.
+static size_t msg_min_size(const Schema* schema){
+    size_t size = 1;
+    switch(schema->type){
+      case MORLOC_MAP:
+      case MORLOC_TUPLE:
+        for(size_t i = 0; i < schema->size; i++){
+            size += msg_min_size(schema->parameters[i]);
+        }
+        return size;
+      default:
+        return size;
+    }
+}
+
+// Find the largest ratio of voidstar bytes to MessagePack bytes across all
+// array elements in the schema. The ratio is stored as a fraction num/den.
+static void msg_max_ratio(const Schema* schema, size_t* num, size_t* den){
+    switch(schema->type){
+      case MORLOC_ARRAY:
+        {
+            const Schema* element = schema->parameters[0];
+            size_t width = element->width;
+            size_t min_size = msg_min_size(element);
+            if(width * (*den) > (*num) * min_size){
+                *num = width;
+                *den = min_size;
+            }
+            msg_max_ratio(element, num, den);
+        }
+        break;
+      case MORLOC_MAP:
+      case MORLOC_TUPLE:
+        for(size_t i = 0; i < schema->size; i++){
+            msg_max_ratio(schema->parameters[i], num, den);
+        }
+        break;
+      default:
+        break;
+    }
+}
+
+// Upper bound on the voidstar size of a well-formed MessagePack message of
+// `mgk_size` bytes, given that `string_ratio` voidstar bytes are needed per
+// string byte. The message is not read. Every array element takes at least
+// msg_min_size bytes of the message, so the space after the root object is
+// bounded by the largest width/msg_min_size ratio times the message length.
+static size_t msg_size_bound_ratio(const Schema* schema, size_t mgk_size, size_t string_ratio){
+    size_t num = string_ratio;
+    size_t den = 1;
+    msg_max_ratio(schema, &num, &den);
+
+    if(num == 0){
+        return schema->width;
+    }
+
+    if(mgk_size > (SIZE_MAX - schema->width - den) / num){
+        return SIZE_MAX;
+    }
+
+    return schema->width + (mgk_size * num + den - 1) / den;
+}
+
+size_t msg_size_bound(const Schema* schema, size_t mgk_size){
+    // string data is copied byte for byte, so the ratio is never below 1
+    return msg_size_bound_ratio(schema, mgk_size, 1);
+}
+
+
 
 // terminal parsers
 int parse_bool(        void* mlc, mpack_tokbuf_t* tokbuf, const char** buf_ptr, size_t* buf_remaining, mpack_token_t* token);
 int parse_nil(         void* mlc, mpack_tokbuf_t* tokbuf, const char** buf_ptr, size_t* buf_remaining, mpack_token_t* token);
-int parse_bytes(       void* mlc, void** cursor, mpack_tokbuf_t* tokbuf, const char** buf_ptr, size_t* buf_remaining, mpack_token_t* token);
+int parse_bytes(       void* mlc, void** cursor, mpack_tokbuf_t* tokbuf, const char** buf_ptr, size_t* buf_remaining, mpack_token_t* token, bool zero_copy);
 int parse_int(    morloc_serial_type, void* mlc, mpack_tokbuf_t* tokbuf, const char** buf_ptr, size_t* buf_remaining, mpack_token_t* token);
 int parse_float(  morloc_serial_type, void* mlc, mpack_tokbuf_t* tokbuf, const char** buf_ptr, size_t* buf_remaining, mpack_token_t* token);
 
 // nested parsers
-int parse_array( void* mlc, const Schema* schema, void** cursor, mpack_tokbuf_t* tokbuf, const char** buf_ptr, size_t* buf_remaining, mpack_token_t* token);
-int parse_map(   void* mlc, const Schema* schema, void** cursor, mpack_tokbuf_t* tokbuf, const char** buf_ptr, size_t* buf_remaining, mpack_token_t* token);
-int parse_tuple( void* mlc, const Schema* schema, void** cursor, mpack_tokbuf_t* tokbuf, const char** buf_ptr, size_t* buf_remaining, mpack_token_t* token);
-int parse_obj(   void* mlc, const Schema* schema, void** cursor, mpack_tokbuf_t* tokbuf, const char** buf_ptr, size_t* buf_remaining, mpack_token_t* token);
+int parse_array( void* mlc, const Schema* schema, void** cursor, mpack_tokbuf_t* tokbuf, const char** buf_ptr, size_t* buf_remaining, mpack_token_t* token, bool zero_copy);
+int parse_map(   void* mlc, const Schema* schema, void** cursor, mpack_tokbuf_t* tokbuf, const char** buf_ptr, size_t* buf_remaining, mpack_token_t* token, bool zero_copy);
+int parse_tuple( void* mlc, const Schema* schema, void** cursor, mpack_tokbuf_t* tokbuf, const char** buf_ptr, size_t* buf_remaining, mpack_token_t* token, bool zero_copy);
+int parse_obj(   void* mlc, const Schema* schema, void** cursor, mpack_tokbuf_t* tokbuf, const char** buf_ptr, size_t* buf_remaining, mpack_token_t* token, bool zero_copy);
 
 int parse_nil(void* mlc, mpack_tokbuf_t* tokbuf, const char** buf_ptr, size_t* buf_remaining, mpack_token_t* token){
     mpack_read(tokbuf, buf_ptr, buf_remaining, token);
@@ -2271,8 +4468,8 @@ int parse_bool(void* mlc, mpack_tokbuf_t* tokbuf, const char** buf_ptr, size_t*
     return 0;
 }
 
-int parse_int(morloc_serial_type schema_type, void* mlc, mpack_tokbuf_t* tokbuf, const char** buf_ptr, size_t* buf_remaining, mpack_token_t* token){
-    mpack_read(tokbuf, buf_ptr, buf_remaining, token);
+// Store an integer token that has already been read
+static int parse_int_token(morloc_serial_type schema_type, void* mlc, const mpack_token_t* token){
     switch(token->type){
       case MPACK_TOKEN_UINT:
         switch(schema_type){
@@ -2305,6 +4502,7 @@ int parse_int(morloc_serial_type schema_type, void* mlc, mpack_tokbuf_t* tokbuf,
         }
         break;
       case MPACK_TOKEN_SINT:
+        // only negative values are left as signed tokens
         switch(schema_type){
           case MORLOC_SINT8:
             *((int8_t*)mlc) = (int8_t)mpack_unpack_sint(*token);
@@ -2319,7 +4517,8 @@ int parse_int(morloc_serial_type schema_type, void* mlc, mpack_tokbuf_t* tokbuf,
             *((int64_t*)mlc) = (int64_t)mpack_unpack_sint(*token);
             break;
           default:
-            break;
+            fprintf(stderr, "Negative integer for unsigned type %d\n", schema_type);
+            return 1;
         }
         break;
       default:
@@ -2329,6 +4528,11 @@ int parse_int(morloc_serial_type schema_type, void* mlc, mpack_tokbuf_t* tokbuf,
     return 0;
 }
 
+int parse_int(morloc_serial_type schema_type, void* mlc, mpack_tokbuf_t* tokbuf, const char** buf_ptr, size_t* buf_remaining, mpack_token_t* token){
+    mpack_read(tokbuf, buf_ptr, buf_remaining, token);
+    return parse_int_token(schema_type, mlc, token);
+}
+
 int parse_float(morloc_serial_type schema_type, void* mlc, mpack_tokbuf_t* tokbuf, const char** buf_ptr, size_t* buf_remaining, mpack_token_t* token){
     mpack_read(tokbuf, buf_ptr, buf_remaining, token);
     if(schema_type == MORLOC_FLOAT32){
@@ -2341,19 +4545,38 @@ int parse_float(morloc_serial_type schema_type, void* mlc, mpack_tokbuf_t* tokbu
 }
 
 
-int parse_bytes(void* mlc, void** cursor, mpack_tokbuf_t* tokbuf, const char** buf_ptr, size_t* buf_remaining, mpack_token_t* token){
-    Array* result = (Array*) mlc;
-
-    mpack_read(tokbuf, buf_ptr, buf_remaining, token);
-    result->size = token->length;
+// Read the contents of a string or binary token whose header has already been
+// read into `result->size`. In zero-copy mode, if the data is in the shared
+// memory pool, `result->data` points to it directly. Otherwise it is copied
+// to the cursor.
+static int parse_bytes_data(Array* result, void** cursor, mpack_tokbuf_t* tokbuf, const char** buf_ptr, size_t* buf_remaining, mpack_token_t* token, bool zero_copy){
     result->data = abs2rel(*cursor);
-    *cursor = (char*)(*cursor) + result->size;
+
+    // A payload cut short by the end of the message is an error. It must not
+    // be copied, since a zero copy reservation has no room for it.
+    if(*buf_remaining < result->size){
+        fprintf(stderr, "String or binary data runs past the end of the message\n");
+        return 1;
+    }
+
+    if(zero_copy && result->size > 0){
+        relptr_t data = abs2rel((absptr_t)*buf_ptr);
+        if(data != RELNULL){
+            // the whole payload is available, so it is read as one chunk
+            mpack_read(tokbuf, buf_ptr, buf_remaining, token);
+            result->data = data;
+            return 0;
+        }
+    }
+
+    char* dest = (char*)(*cursor);
+    *cursor = dest + result->size;
 
     size_t str_idx = 0;
     while((result->size - str_idx) > 0){
         mpack_read(tokbuf, buf_ptr, buf_remaining, token);
         memcpy(
-          rel2abs(result->data + str_idx),
+          dest + str_idx,
           token->data.chunk_ptr,
           token->length * sizeof(char)
         );
@@ -2362,18 +4585,235 @@ int parse_bytes(void* mlc, void** cursor, mpack_tokbuf_t* tokbuf, const char** b
     return 0;
 }
 
-int parse_array(void* mlc, const Schema* schema, void** cursor, mpack_tokbuf_t* tokbuf, const char** buf_ptr, size_t* buf_remaining, mpack_token_t* token){
-    int exitcode = 0;
+int parse_bytes(void* mlc, void** cursor, mpack_tokbuf_t* tokbuf, const char** buf_ptr, size_t* buf_remaining, mpack_token_t* token, bool zero_copy){
     Array* result = (Array*) mlc;
 
-    size_t element_size = schema->width;
     mpack_read(tokbuf, buf_ptr, buf_remaining, token);
     result->size = token->length;
-    result->data = abs2rel(*cursor);
-    *cursor = (char*)(*cursor) + result->size * element_size;
 
-    for(size_t i = 0; i < result->size; i++){
-        exitcode = parse_obj(rel2abs(result->data + i * element_size), schema, cursor, tokbuf, buf_ptr, buf_remaining, token);
+    return parse_bytes_data(result, cursor, tokbuf, buf_ptr, buf_remaining, token, zero_copy);
+}
+
+// Read big-endian MessagePack values. Compilers reduce these to a single load
+// and byte swap.
+static inline uint16_t mpk_be16(const unsigned char* p){
+    return (uint16_t)(((uint16_t)p[0] << 8) | (uint16_t)p[1]);
+}
+
+static inline uint32_t mpk_be32(const unsigned char* p){
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) |
+           ((uint32_t)p[2] << 8)  |  (uint32_t)p[3];
+}
+
+static inline uint64_t mpk_be64(const unsigned char* p){
+    return ((uint64_t)mpk_be32(p) << 32) | (uint64_t)mpk_be32(p + 4);
+}
+
+// Store an integer in a voidstar slot, truncating it to the slot width
+static inline void store_int(morloc_serial_type type, char* dest, uint64_t value){
+    switch(type){
+      case MORLOC_UINT8:
+      case MORLOC_SINT8:
+        *(uint8_t*)dest = (uint8_t)value;
+        break;
+      case MORLOC_UINT16:
+      case MORLOC_SINT16:
+        { uint16_t x = (uint16_t)value; memcpy(dest, &x, sizeof(x)); }
+        break;
+      case MORLOC_UINT32:
+      case MORLOC_SINT32:
+        { uint32_t x = (uint32_t)value; memcpy(dest, &x, sizeof(x)); }
+        break;
+      default:
+        memcpy(dest, &value, sizeof(value));
+        break;
+    }
+}
+
+// Count the leading bytes below 0x80 (positive fixints), 8 bytes at a time
+static size_t fixint_run(const unsigned char* p, size_t n){
+    size_t k = 0;
+    uint64_t word;
+    while (k + 8 <= n) {
+        memcpy(&word, p + k, 8);
+        if (word & 0x8080808080808080ULL) break;
+        k += 8;
+    }
+    while (k < n && p[k] < 0x80) k++;
+    return k;
+}
+
+// Count the leading values of `stride` bytes that all begin with `tag`
+static size_t tag_run(const unsigned char* p, size_t n, size_t stride, unsigned char tag){
+    size_t k = 0;
+    while (k < n && p[k * stride] == tag) k++;
+    return k;
+}
+
+// Decode up to `n` elements of a fixed-width primitive array directly from the
+// MessagePack bytes, bypassing the tokenizer. Runs of identically encoded
+// values (all float64, all positive fixints, ...) are decoded in branch-free
+// loops. Decoding stops at the end of the buffer or at any encoding that needs
+// the general parser, such as an integer in a float array. Returns the number
+// of elements written to `dest`.
+static size_t parse_primitive_array(morloc_serial_type type, size_t width, char* dest, size_t n, const char** buf_ptr, size_t* buf_remaining){
+    const unsigned char* start = (const unsigned char*)*buf_ptr;
+    const unsigned char* p = start;
+    const unsigned char* end = start + *buf_remaining;
+    size_t i = 0;
+    // negative values of unsigned types are left to parse_int_token
+    bool is_unsigned = type == MORLOC_UINT8 || type == MORLOC_UINT16 || type == MORLOC_UINT32 || type == MORLOC_UINT64;
+
+    switch(type){
+      case MORLOC_FLOAT64:
+      case MORLOC_FLOAT32:
+        while (i < n && p < end) {
+            size_t run;
+            if (*p == 0xcb) {
+                run = tag_run(p, MIN(n - i, (size_t)(end - p) / 9), 9, 0xcb);
+                for (size_t k = 0; k < run; k++) {
+                    uint64_t bits = mpk_be64(p + k * 9 + 1);
+                    double x;
+                    memcpy(&x, &bits, sizeof(x));
+                    if (type == MORLOC_FLOAT64) {
+                        memcpy(dest + (i + k) * width, &x, sizeof(x));
+                    } else {
+                        float y = (float)x;
+                        memcpy(dest + (i + k) * width, &y, sizeof(y));
+                    }
+                }
+                p += run * 9;
+            } else if (*p == 0xca) {
+                run = tag_run(p, MIN(n - i, (size_t)(end - p) / 5), 5, 0xca);
+                for (size_t k = 0; k < run; k++) {
+                    uint32_t bits = mpk_be32(p + k * 5 + 1);
+                    float y;
+                    memcpy(&y, &bits, sizeof(y));
+                    if (type == MORLOC_FLOAT64) {
+                        double x = (double)y;
+                        memcpy(dest + (i + k) * width, &x, sizeof(x));
+                    } else {
+                        memcpy(dest + (i + k) * width, &y, sizeof(y));
+                    }
+                }
+                p += run * 5;
+            } else {
+                break;
+            }
+            if (run == 0) break;
+            i += run;
+        }
+        break;
+
+      // any other token is left to parse_nil or parse_bool
+      case MORLOC_NIL:
+        while (i < n && p < end && *p == 0xc0) {
+            dest[i++] = 0;
+            p++;
+        }
+        break;
+      case MORLOC_BOOL:
+        while (i < n && p < end && (*p == 0xc2 || *p == 0xc3)) {
+            dest[i++] = (char)(*p++ == 0xc3);
+        }
+        break;
+
+      default:
+        while (i < n && p < end) {
+            unsigned char t = *p;
+            uint64_t value;
+            size_t len;
+
+            if (t < 0x80) {
+                // positive fixints are the most common encoding for small
+                // values, so copy or widen whole runs of them at once
+                size_t run = fixint_run(p, MIN(n - i, (size_t)(end - p)));
+                char* out = dest + i * width;
+                switch(width){
+                  case 1:
+                    memcpy(out, p, run);
+                    break;
+                  case 2:
+                    for (size_t k = 0; k < run; k++) { uint16_t x = p[k]; memcpy(out + 2 * k, &x, 2); }
+                    break;
+                  case 4:
+                    for (size_t k = 0; k < run; k++) { uint32_t x = p[k]; memcpy(out + 4 * k, &x, 4); }
+                    break;
+                  default:
+                    for (size_t k = 0; k < run; k++) { uint64_t x = p[k]; memcpy(out + 8 * k, &x, 8); }
+                    break;
+                }
+                p += run;
+                i += run;
+                continue;
+            } else if (t >= 0xe0) {
+                // negative fixint
+                if (is_unsigned) goto done;
+                value = (uint64_t)(int64_t)(int8_t)t;
+                len = 1;
+            } else {
+                switch(t){
+                  case 0xcc: len = 2; break;
+                  case 0xcd: len = 3; break;
+                  case 0xce: len = 5; break;
+                  case 0xcf: len = 9; break;
+                  case 0xd0: len = 2; break;
+                  case 0xd1: len = 3; break;
+                  case 0xd2: len = 5; break;
+                  case 0xd3: len = 9; break;
+                  default: goto done;
+                }
+                if ((size_t)(end - p) < len) goto done;
+                switch(t){
+                  case 0xcc: value = p[1]; break;
+                  case 0xcd: value = mpk_be16(p + 1); break;
+                  case 0xce: value = mpk_be32(p + 1); break;
+                  case 0xcf: value = mpk_be64(p + 1); break;
+                  case 0xd0: value = (uint64_t)(int64_t)(int8_t)p[1]; break;
+                  case 0xd1: value = (uint64_t)(int64_t)(int16_t)mpk_be16(p + 1); break;
+                  case 0xd2: value = (uint64_t)(int64_t)(int32_t)mpk_be32(p + 1); break;
+                  default:   value = mpk_be64(p + 1); break;
+                }
+                if (is_unsigned && t >= 0xd0 && (int64_t)value < 0) goto done;
+            }
+            store_int(type, dest + i * width, value);
+            p += len;
+            i++;
+        }
+        break;
+    }
+
+done:
+    *buf_ptr += p - start;
+    *buf_remaining -= (size_t)(p - start);
+    return i;
+}
+
+// Parse `n` consecutive array elements into `start`
+static int parse_elements(char* start, const Schema* schema, size_t n, void** cursor, mpack_tokbuf_t* tokbuf, const char** buf_ptr, size_t* buf_remaining, mpack_token_t* token, bool zero_copy){
+    int exitcode = 0;
+    size_t element_size = schema->width;
+
+    // Fixed-width elements can be decoded in bulk as long as the tokenizer
+    // holds no partially read token
+    if(is_fixed_width(schema->type) && tokbuf->plen == 0 && tokbuf->passthrough == 0){
+        size_t i = 0;
+        while(i < n){
+            i += parse_primitive_array(schema->type, element_size, start + i * element_size, n - i, buf_ptr, buf_remaining);
+            if(i < n){
+                // let the general parser handle the odd element
+                exitcode = parse_obj(start + i * element_size, schema, cursor, tokbuf, buf_ptr, buf_remaining, token, zero_copy);
+                if(exitcode != 0){
+                  return exitcode;
+                }
+                i++;
+            }
+        }
+        return 0;
+    }
+
+    for(size_t i = 0; i < n; i++){
+        exitcode = parse_obj(start + i * element_size, schema, cursor, tokbuf, buf_ptr, buf_remaining, token, zero_copy);
         if(exitcode != 0){
           return exitcode;
         }
@@ -2381,14 +4821,39 @@ int parse_array(void* mlc, const Schema* schema, void** cursor, mpack_tokbuf_t*
     return 0;
 }
 
-int parse_tuple(void* mlc, const Schema* schema, void** cursor, mpack_tokbuf_t* tokbuf, const char** buf_ptr, size_t* buf_remaining, mpack_token_t* token){
+int parse_array(void* mlc, const Schema* schema, void** cursor, mpack_tokbuf_t* tokbuf, const char** buf_ptr, size_t* buf_remaining, mpack_token_t* token, bool zero_copy){
+    Array* result = (Array*) mlc;
+
+    size_t element_size = schema->width;
+    mpack_read(tokbuf, buf_ptr, buf_remaining, token);
+    result->size = token->length;
+
+    // byte arrays may also be encoded as MessagePack binary data
+    if(token->type == MPACK_TOKEN_BIN){
+        if(!is_byte_type(schema->type)){
+            fprintf(stderr, "Binary data cannot be parsed as an array of type %d\n", schema->type);
+            return 1;
+        }
+        return parse_bytes_data(result, cursor, tokbuf, buf_ptr, buf_remaining, token, zero_copy);
+    }
+
+    // the elements are laid out at the cursor, which is already an absolute
+    // address, so they need no translation
+    char* start = (char*)(*cursor);
+    result->data = abs2rel(*cursor);
+    *cursor = (char*)(*cursor) + result->size * element_size;
+
+    return parse_elements(start, schema, result->size, cursor, tokbuf, buf_ptr, buf_remaining, token, zero_copy);
+}
+
+int parse_tuple(void* mlc, const Schema* schema, void** cursor, mpack_tokbuf_t* tokbuf, const char** buf_ptr, size_t* buf_remaining, mpack_token_t* token, bool zero_copy){
     size_t offset = 0;
     int exitcode = 0;
 
     mpack_read(tokbuf, buf_ptr, buf_remaining, token);
 
     for(size_t i = 0; i < schema->size; i++){
-        exitcode = parse_obj((char*)mlc + offset, schema->parameters[i], cursor, tokbuf, buf_ptr, buf_remaining, token);
+        exitcode = parse_obj((char*)mlc + offset, schema->parameters[i], cursor, tokbuf, buf_ptr, buf_remaining, token, zero_copy);
         if(exitcode != 0){
           return exitcode;
         }
@@ -2398,7 +4863,7 @@ int parse_tuple(void* mlc, const Schema* schema, void** cursor, mpack_tokbuf_t*
     return 0;
 }
 
-int parse_obj(void* mlc, const Schema* schema, void** cursor, mpack_tokbuf_t* tokbuf, const char** buf_ptr, size_t* buf_remaining, mpack_token_t* token){
+int parse_obj(void* mlc, const Schema* schema, void** cursor, mpack_tokbuf_t* tokbuf, const char** buf_ptr, size_t* buf_remaining, mpack_token_t* token, bool zero_copy){
     switch(schema->type){
       case MORLOC_NIL:
         return parse_nil(mlc, tokbuf, buf_ptr, buf_remaining, token);
@@ -2417,12 +4882,12 @@ int parse_obj(void* mlc, const Schema* schema, void** cursor, mpack_tokbuf_t* to
       case MORLOC_FLOAT64:
         return parse_float(schema->type, mlc, tokbuf, buf_ptr, buf_remaining, token);
       case MORLOC_STRING:
-        return parse_bytes(mlc, cursor, tokbuf, buf_ptr, buf_remaining, token);
+        return parse_bytes(mlc, cursor, tokbuf, buf_ptr, buf_remaining, token, zero_copy);
       case MORLOC_ARRAY:
-        return parse_array(mlc, schema->parameters[0], cursor, tokbuf, buf_ptr, buf_remaining, token);
+        return parse_array(mlc, schema->parameters[0], cursor, tokbuf, buf_ptr, buf_remaining, token, zero_copy);
       case MORLOC_MAP:
       case MORLOC_TUPLE:
-        return parse_tuple(mlc, schema, cursor, tokbuf, buf_ptr, buf_remaining, token);
+        return parse_tuple(mlc, schema, cursor, tokbuf, buf_ptr, buf_remaining, token, zero_copy);
       default:
         return 1;
     }
@@ -2443,17 +4908,852 @@ int unpack_with_schema(const char* mgk, size_t mgk_size, const Schema* schema, v
 
     void* cursor = (void*)((char*)mlc + schema->width);
 
-    int exitcode = parse_obj(mlc, schema, &cursor, &tokbuf, &mgk, &buf_remaining, &token);
+    int exitcode = parse_obj(mlc, schema, &cursor, &tokbuf, &mgk, &buf_remaining, &token, false);
 
     *mlcptr = mlc;
 
     return exitcode;
 }
 
-// take MessagePack data and set a pointer to an in-memory data structure
-int unpack(const char* mpk, size_t mpk_size, const char* schema_str, void** mlcptr) {
-    const Schema* schema = parse_schema(&schema_str);
-    return unpack_with_schema(mpk, mpk_size, schema, mlcptr);
+// Parse into a block of `reserved_size` bytes and return the unused tail to
+// the pool once the final size is known. Only if not even the address space
+// can be reserved is the block sized exactly with a pass of msg_size.
+static int unpack_reserved(const char* mgk, size_t mgk_size, const Schema* schema, size_t reserved_size, bool zero_copy, void** mlcptr) {
+
+    void* mlc = shreserve(reserved_size);
+    if (mlc == NULL) {
+        mlc = shmalloc(msg_size(mgk, mgk_size, schema));
+        if (mlc == NULL) {
+            return 1;
+        }
+    }
+
+    size_t buf_remaining = mgk_size;
+
+    mpack_tokbuf_t tokbuf = MPACK_TOKBUF_INITIAL_VALUE;
+    mpack_token_t token;
+
+    void* cursor = (void*)((char*)mlc + schema->width);
+
+    int exitcode = parse_obj(mlc, schema, &cursor, &tokbuf, &mgk, &buf_remaining, &token, zero_copy);
+
+    // commit the space that was used
+    size_t used_size = (size_t)((char*)cursor - (char*)mlc);
+    if (shrealloc(mlc, used_size) == NULL) {
+        exitcode = 1;
+    }
+
+    *mlcptr = mlc;
+
+    return exitcode;
+}
+
+// Unpack with one pass over the MessagePack data. Instead of pre-scanning the
+// message with msg_size, reserve a block that can hold any message of this
+// length (see msg_size_bound) and return the unused tail to the pool once the
+// final size is known. The reservation is made with shreserve, so untouched
+// pages of it are never backed by memory and the cost of over-reserving is
+// address space, not RSS.
+int unpack_with_schema_single_pass(const char* mgk, size_t mgk_size, const Schema* schema, void** mlcptr) {
+    return unpack_reserved(mgk, mgk_size, schema, msg_size_bound(schema, mgk_size), false, mlcptr);
+}
+
+// Unpack without copying string or binary data. If the MessagePack data is
+// itself stored in the shared memory pool, string and binary payloads are
+// left where they are and the voidstar arrays point into the message, so the
+// message must not be freed while the voidstar is in use. Messages outside
+// the pool cannot be addressed by relative pointers, so their strings are
+// copied as in unpack_with_schema_single_pass.
+int unpack_with_schema_zero_copy(const char* mgk, size_t mgk_size, const Schema* schema, void** mlcptr) {
+    if (abs2rel((absptr_t)mgk) == RELNULL) {
+        return unpack_with_schema_single_pass(mgk, mgk_size, schema, mlcptr);
+    }
+    return unpack_reserved(mgk, mgk_size, schema, msg_size_bound_ratio(schema, mgk_size, 0), true, mlcptr);
+}
+
+// Unpack into an arena rather than a block of its own. The voidstar is freed
+// with the arena, not with shfree. As in unpack_with_schema_single_pass, the
+// size bound is reserved and the unused tail is given back, so the message is
+// only read once.
+int unpack_with_schema_to_arena(const char* mgk, size_t mgk_size, const Schema* schema, sharena_t* arena, void** mlcptr) {
+    void* mlc = sharena_reserve(arena, msg_size_bound(schema, mgk_size));
+    if (mlc == NULL) {
+        return 1;
+    }
+
+    size_t buf_remaining = mgk_size;
+
+    mpack_tokbuf_t tokbuf = MPACK_TOKBUF_INITIAL_VALUE;
+    mpack_token_t token;
+
+    void* cursor = (void*)((char*)mlc + schema->width);
+
+    int exitcode = parse_obj(mlc, schema, &cursor, &tokbuf, &mgk, &buf_remaining, &token, false);
+
+    // keep the space that was used
+    if (sharena_commit(arena, mlc, (size_t)((char*)cursor - (char*)mlc)) != 0) {
+        exitcode = 1;
+    }
+
+    *mlcptr = mlc;
+
+    return exitcode;
+}
+
+// parallel unpack ####
+
+// Below this message size automatic parallel unpacking is not worth starting
+// threads for
+#define MPK_PARALLEL_MIN_SIZE 0x100000
+// Element ranges per thread, so threads that finish early can take more work
+#define MPK_PARALLEL_RANGES_PER_THREAD 4
+
+typedef enum { MPK_SCAN_SCALAR, MPK_SCAN_BYTES, MPK_SCAN_ARRAY } mpk_scan_kind;
+
+// Read the header of the MessagePack value at `p`. `length` is set to the
+// number of payload bytes of a string or binary value, or the number of
+// elements of an array. Returns the address after the header, or NULL if the
+// header is truncated or is not one pack writes.
+static const unsigned char* mpk_scan_header(const unsigned char* p, const unsigned char* end, mpk_scan_kind* kind, size_t* length){
+    if (p >= end) return NULL;
+    unsigned char t = *p;
+    size_t header = 1;
+    *kind = MPK_SCAN_SCALAR;
+    *length = 0;
+
+    if (t < 0x80 || t >= 0xe0 || t == 0xc0 || t == 0xc2 || t == 0xc3) {
+        return p + 1;
+    } else if (t >= 0xa0 && t <= 0xbf) {
+        *kind = MPK_SCAN_BYTES;
+        *length = t & 0x1f;
+        return p + 1;
+    } else if (t >= 0x90 && t <= 0x9f) {
+        *kind = MPK_SCAN_ARRAY;
+        *length = t & 0x0f;
+        return p + 1;
+    }
+
+    switch(t){
+      case 0xcc: case 0xd0: header = 2; break;
+      case 0xcd: case 0xd1: header = 3; break;
+      case 0xce: case 0xd2: case 0xca: header = 5; break;
+      case 0xcf: case 0xd3: case 0xcb: header = 9; break;
+      case 0xd9: case 0xc4: *kind = MPK_SCAN_BYTES; header = 2; break;
+      case 0xda: case 0xc5: *kind = MPK_SCAN_BYTES; header = 3; break;
+      case 0xdb: case 0xc6: *kind = MPK_SCAN_BYTES; header = 5; break;
+      case 0xdc: *kind = MPK_SCAN_ARRAY; header = 3; break;
+      case 0xdd: *kind = MPK_SCAN_ARRAY; header = 5; break;
+      default: return NULL;
+    }
+    if ((size_t)(end - p) < header) return NULL;
+
+    if (*kind != MPK_SCAN_SCALAR) {
+        *length = header == 2 ? p[1] : header == 3 ? mpk_be16(p + 1) : mpk_be32(p + 1);
+    }
+    return p + header;
+}
+
+// Skip one value, adding its voidstar size to `size` exactly as msg_size
+// would. This reads headers directly rather than through the tokenizer, so
+// it is much cheaper than parsing. Returns NULL for malformed data.
+static const unsigned char* mpk_scan(const Schema* schema, const unsigned char* p, const unsigned char* end, size_t* size){
+    mpk_scan_kind kind;
+    size_t length;
+    p = mpk_scan_header(p, end, &kind, &length);
+    if (p == NULL) return NULL;
+
+    switch(kind){
+      case MPK_SCAN_SCALAR:
+        if (!is_fixed_width(schema->type)) return NULL;
+        *size += schema->width;
+        return p;
+      case MPK_SCAN_BYTES:
+        if (schema->type != MORLOC_STRING && !(schema->type == MORLOC_ARRAY && is_byte_type(schema->parameters[0]->type))) return NULL;
+        if ((size_t)(end - p) < length) return NULL;
+        *size += sizeof(Array) + length;
+        return p + length;
+      case MPK_SCAN_ARRAY:
+        if (schema->type == MORLOC_ARRAY) {
+            *size += sizeof(Array);
+            for (size_t i = 0; i < length && p != NULL; i++) {
+                p = mpk_scan(schema->parameters[0], p, end, size);
+            }
+            return p;
+        }
+        if ((schema->type == MORLOC_TUPLE || schema->type == MORLOC_MAP) && length == schema->size) {
+            for (size_t i = 0; i < length && p != NULL; i++) {
+                p = mpk_scan(schema->parameters[i], p, end, size);
+            }
+            return p;
+        }
+        return NULL;
+    }
+    return NULL;
+}
+
+// A run of consecutive elements of the top-level array
+typedef struct mpk_parallel_range_s {
+    size_t first;       // index of the first element
+    size_t msg_offset;  // where the first element starts in the message
+    size_t heap_offset; // where its nested data starts in the voidstar heap
+} mpk_parallel_range_t;
+
+typedef struct mpk_parallel_job_s {
+    const char* mgk;
+    size_t mgk_size;
+    const Schema* element;
+    char* elements;     // the array's element block
+    char* heap;         // nested data of all elements, after the element block
+    const mpk_parallel_range_t* ranges; // n_ranges ranges and an end marker
+    size_t n_ranges;
+    size_t next;        // the next range to be taken
+    int status;
+} mpk_parallel_job_t;
+
+// Run `worker` on `n_threads` threads, one of which is the calling thread.
+// Workers take their share of the job from a shared counter, so if a thread
+// cannot be started the others do its work.
+static void mpk_parallel_run(void* (*worker)(void*), void* job, size_t n_threads){
+    size_t n_helpers = n_threads > 1 ? n_threads - 1 : 0;
+    pthread_t* helpers = (pthread_t*)malloc(n_helpers * sizeof(pthread_t) + 1);
+    size_t n_started = 0;
+    for (; helpers != NULL && n_started < n_helpers; n_started++) {
+        if (pthread_create(&helpers[n_started], NULL, worker, job) != 0) {
+            break;
+        }
+    }
+    worker(job);
+    for (size_t i = 0; i < n_started; i++) {
+        pthread_join(helpers[i], NULL);
+    }
+    free(helpers);
+}
+
+static void* mpk_parallel_worker(void* arg){
+    mpk_parallel_job_t* job = (mpk_parallel_job_t*)arg;
+    size_t r;
+    while ((r = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED)) < job->n_ranges) {
+        const mpk_parallel_range_t* range = job->ranges + r;
+        const char* buf = job->mgk + range->msg_offset;
+        size_t buf_remaining = job->mgk_size - range->msg_offset;
+        mpack_tokbuf_t tokbuf = MPACK_TOKBUF_INITIAL_VALUE;
+        mpack_token_t token;
+        void* cursor = job->heap + range->heap_offset;
+
+        int exitcode = parse_elements(
+            job->elements + range->first * job->element->width,
+            job->element,
+            range[1].first - range->first,
+            &cursor, &tokbuf, &buf, &buf_remaining, &token, false
+        );
+        if (exitcode != 0) {
+            __atomic_store_n(&job->status, exitcode, __ATOMIC_RELAXED);
+        }
+    }
+    return NULL;
+}
+
+// Unpack a top-level array on several threads. A structural pre-scan finds
+// where each element starts in the message and where its nested data goes in
+// the voidstar, then ranges of elements are parsed concurrently into their
+// disjoint parts of one exactly sized block. The result is identical to
+// unpack_with_schema and is freed with shfree.
+//
+// With `n_threads` 0, one thread per online CPU is used and messages smaller
+// than MPK_PARALLEL_MIN_SIZE are unpacked on the calling thread. Anything
+// other than an array is always unpacked on the calling thread.
+int unpack_with_schema_parallel(const char* mgk, size_t mgk_size, const Schema* schema, size_t n_threads, void** mlcptr) {
+    if (n_threads == 0) {
+        long n_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        n_threads = (n_cpus > 0 && mgk_size >= MPK_PARALLEL_MIN_SIZE) ? (size_t)n_cpus : 1;
+    }
+
+    if (schema->type != MORLOC_ARRAY || n_threads < 2) {
+        return unpack_with_schema(mgk, mgk_size, schema, mlcptr);
+    }
+
+    const Schema* element = schema->parameters[0];
+    const unsigned char* start = (const unsigned char*)mgk;
+    const unsigned char* end = start + mgk_size;
+
+    mpk_scan_kind kind;
+    size_t length;
+    const unsigned char* p = mpk_scan_header(start, end, &kind, &length);
+    if (p == NULL || kind != MPK_SCAN_ARRAY || length < 2) {
+        return unpack_with_schema(mgk, mgk_size, schema, mlcptr);
+    }
+
+    // Split the elements into ranges of roughly `target` message bytes. A new
+    // range only starts after at least `target` bytes, so there are at most
+    // max_ranges of them.
+    size_t max_ranges = n_threads * MPK_PARALLEL_RANGES_PER_THREAD;
+    size_t target = mgk_size / max_ranges + 1;
+    mpk_parallel_range_t* ranges = (mpk_parallel_range_t*)malloc((max_ranges + 2) * sizeof(mpk_parallel_range_t));
+    if (ranges == NULL) {
+        perror("malloc");
+        return 1;
+    }
+
+    size_t n_ranges = 0;
+    size_t heap_size = 0;
+    const unsigned char* range_start = NULL;
+    for (size_t i = 0; i < length; i++) {
+        if (range_start == NULL || (size_t)(p - range_start) >= target) {
+            mpk_parallel_range_t range = { i, (size_t)(p - start), heap_size };
+            ranges[n_ranges++] = range;
+            range_start = p;
+        }
+        size_t size = 0;
+        p = mpk_scan(element, p, end, &size);
+        if (p == NULL) {
+            // let the sequential parser deal with malformed data
+            free(ranges);
+            return unpack_with_schema(mgk, mgk_size, schema, mlcptr);
+        }
+        heap_size += size - element->width;
+    }
+    mpk_parallel_range_t range_end = { length, (size_t)(p - start), heap_size };
+    ranges[n_ranges] = range_end;
+
+    char* mlc = (char*)shmalloc(schema->width + length * element->width + heap_size);
+    if (mlc == NULL) {
+        free(ranges);
+        return 1;
+    }
+    Array* result = (Array*)mlc;
+    result->size = length;
+    result->data = abs2rel(mlc + schema->width);
+
+    mpk_parallel_job_t job;
+    job.mgk = mgk;
+    job.mgk_size = mgk_size;
+    job.element = element;
+    job.elements = mlc + schema->width;
+    job.heap = job.elements + length * element->width;
+    job.ranges = ranges;
+    job.n_ranges = n_ranges;
+    job.next = 0;
+    job.status = 0;
+
+    mpk_parallel_run(mpk_parallel_worker, &job, n_threads < n_ranges ? n_threads : n_ranges);
+    free(ranges);
+
+    *mlcptr = mlc;
+
+    return job.status;
+}
+
+
+// parallel pack ####
+
+// A run of consecutive elements of the array being packed
+typedef struct mpk_pack_range_s {
+    size_t first;  // index of the first element
+    size_t offset; // where its encoding starts in the packet
+    size_t size;   // the length of its encoding
+} mpk_pack_range_t;
+
+typedef struct mpk_pack_job_s {
+    const Schema* element;
+    ArrayView view;
+    char* packet;
+    mpk_pack_range_t* ranges; // n_ranges ranges and an end marker
+    size_t n_ranges;
+    size_t next;              // the next range to be taken
+    bool encode;              // measure the ranges or encode them
+    int status;
+} mpk_pack_job_t;
+
+static void* mpk_pack_worker(void* arg){
+    mpk_pack_job_t* job = (mpk_pack_job_t*)arg;
+    const Schema* element = job->element;
+    bool primitive = is_fixed_width(element->type);
+    size_t r;
+    while ((r = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED)) < job->n_ranges) {
+        mpk_pack_range_t* range = job->ranges + r;
+        size_t n = range[1].first - range->first;
+        char* data = (char*)array_view_at(job->view, range->first);
+
+        if (!job->encode) {
+            size_t size = 0;
+            if (primitive) {
+                size = pack_primitive_array_size(element->type, element->width, data, n);
+            } else {
+                for (size_t i = 0; i < n; i++) {
+                    size += pack_size(data + i * element->width, element);
+                }
+            }
+            range->size = size;
+            continue;
+        }
+
+        // every range must be encoded in exactly the space it was measured
+        // to need, or it would overwrite its neighbor
+        char* packet_ptr = job->packet + range->offset;
+        if (primitive) {
+            if (pack_primitive_array_size(element->type, element->width, data, n) != range->size) {
+                __atomic_store_n(&job->status, 1, __ATOMIC_RELAXED);
+                continue;
+            }
+            pack_primitive_array(element->type, data, n, packet_ptr);
+            continue;
+        }
+        size_t packet_remaining = range->size;
+        mpack_tokbuf_t tokbuf = MPACK_TOKBUF_INITIAL_VALUE;
+        for (size_t i = 0; i < n; i++) {
+            // the NULL handle is never resized, so overruns are errors
+            if (pack_data(data + i * element->width, element, NULL, &packet_ptr, &packet_remaining, &tokbuf) != 0) {
+                __atomic_store_n(&job->status, 1, __ATOMIC_RELAXED);
+                break;
+            }
+        }
+        if (packet_remaining != 0) {
+            __atomic_store_n(&job->status, 1, __ATOMIC_RELAXED);
+        }
+    }
+    return NULL;
+}
+
+// Pack a top-level array on several threads. The elements are split into
+// ranges, the encoded size of every range is measured concurrently, and then
+// every range is encoded concurrently straight into its place in the packet,
+// so no per-thread buffers need to be joined. The output is identical to
+// pack_with_schema.
+//
+// With `n_threads` 0, one thread per online CPU is used and arrays with an
+// element block smaller than MPK_PARALLEL_MIN_SIZE are packed on the calling
+// thread. Anything other than an array is always packed on the calling
+// thread.
+int pack_with_schema_parallel(const void* mlc, const Schema* schema, size_t n_threads, char** packet, size_t* packet_size) {
+    if (schema->type != MORLOC_ARRAY) {
+        return pack_with_schema(mlc, schema, packet, packet_size);
+    }
+
+    const Schema* element = schema->parameters[0];
+    ArrayView view = array_view((const Array*)mlc, element->width);
+
+    if (n_threads == 0) {
+        long n_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        n_threads = (n_cpus > 0 && view.size * element->width >= MPK_PARALLEL_MIN_SIZE) ? (size_t)n_cpus : 1;
+    }
+
+    if (n_threads < 2 || view.size < 2) {
+        return pack_with_schema(mlc, schema, packet, packet_size);
+    }
+
+    *packet = NULL;
+    *packet_size = 0;
+
+    size_t n_ranges = n_threads * MPK_PARALLEL_RANGES_PER_THREAD;
+    if (n_ranges > view.size) {
+        n_ranges = view.size;
+    }
+    mpk_pack_range_t* ranges = (mpk_pack_range_t*)calloc(n_ranges + 1, sizeof(mpk_pack_range_t));
+    if (ranges == NULL) {
+        perror("calloc");
+        return 1;
+    }
+    for (size_t r = 0; r <= n_ranges; r++) {
+        ranges[r].first = view.size * r / n_ranges;
+    }
+
+    mpk_pack_job_t job;
+    job.element = element;
+    job.view = view;
+    job.packet = NULL;
+    job.ranges = ranges;
+    job.n_ranges = n_ranges;
+    job.next = 0;
+    job.encode = false;
+    job.status = 0;
+    mpk_parallel_run(mpk_pack_worker, &job, n_threads);
+
+    size_t header_size = mpk_array_header_size(view.size);
+    size_t offset = header_size;
+    for (size_t r = 0; r < n_ranges; r++) {
+        ranges[r].offset = offset;
+        offset += ranges[r].size;
+    }
+
+    job.packet = (char*)malloc(offset);
+    if (job.packet == NULL) {
+        perror("malloc");
+        free(ranges);
+        return 1;
+    }
+
+    char* packet_ptr = job.packet;
+    size_t packet_remaining = header_size;
+    mpack_tokbuf_t tokbuf = MPACK_TOKBUF_INITIAL_VALUE;
+    mpack_token_t token = mpack_pack_array(view.size);
+    mpack_write(&tokbuf, &packet_ptr, &packet_remaining, &token);
+
+    job.next = 0;
+    job.encode = true;
+    mpk_parallel_run(mpk_pack_worker, &job, n_threads);
+
+    free(ranges);
+
+    if (job.status != 0) {
+        fprintf(stderr, "Failed to pack array on several threads\n");
+        free(job.packet);
+        return job.status;
+    }
+
+    *packet = job.packet;
+    *packet_size = offset;
+
+    return 0;
+}
+
+
+// Start decoding a message. If the total message size mgk_size is known, the
+// voidstar is a single block that is freed with shfree, as with
+// unpack_with_schema. If it is not known (0), or no block can be reserved for
+// it, the voidstar is allocated from the arena and freed with it.
+//
+// return 0 for success
+int mpk_decoder_init(mpk_decoder_t* dec, const Schema* schema, size_t mgk_size, sharena_t* arena){
+    memset(dec, 0, sizeof(mpk_decoder_t));
+    mpack_tokbuf_t tokbuf = MPACK_TOKBUF_INITIAL_VALUE;
+    dec->tokbuf = tokbuf;
+    dec->schema = schema;
+    dec->status = MPACK_EOF;
+
+    char* root = NULL;
+    if (mgk_size > 0) {
+        size_t reserved_size = msg_size_bound(schema, mgk_size);
+        dec->block = (char*)shreserve(reserved_size);
+        if (dec->block != NULL) {
+            root = dec->block;
+            dec->cursor = dec->block + schema->width;
+            dec->block_end = dec->block + reserved_size;
+        }
+    }
+    if (root == NULL && arena != NULL) {
+        dec->arena = arena;
+        root = (char*)sharena_alloc(arena, schema->width);
+        if (root == NULL) {
+            return 1;
+        }
+    }
+    if (root == NULL) {
+        if (mgk_size == 0) {
+            fprintf(stderr, "A decoder needs either the message size or an arena\n");
+        }
+        return 1;
+    }
+
+    dec->capacity = 16;
+    dec->stack = (mpk_decoder_frame_t*)malloc(dec->capacity * sizeof(mpk_decoder_frame_t));
+    if (dec->stack == NULL) {
+        mpk_decoder_free(dec);
+        return 1;
+    }
+    mpk_decoder_frame_t frame = { schema, root, 0, 1, MPK_FRAME_ROOT };
+    dec->stack[dec->depth++] = frame;
+    dec->result = root;
+
+    return 0;
+}
+
+// Space for the children of a value
+static char* mpk_decoder_alloc(mpk_decoder_t* dec, size_t size){
+    if (dec->arena != NULL) {
+        return (char*)sharena_alloc(dec->arena, size);
+    }
+    if (size > (size_t)(dec->block_end - dec->cursor)) {
+        fprintf(stderr, "Message is larger than its declared size\n");
+        return NULL;
+    }
+    char* ptr = dec->cursor;
+    dec->cursor += size;
+    return ptr;
+}
+
+static int mpk_decoder_push(mpk_decoder_t* dec, const Schema* schema, char* base, size_t size, int kind){
+    if (size == 0) {
+        return 0;
+    }
+    if (dec->depth == dec->capacity) {
+        size_t capacity = dec->capacity * 2;
+        mpk_decoder_frame_t* stack = (mpk_decoder_frame_t*)realloc(dec->stack, capacity * sizeof(mpk_decoder_frame_t));
+        if (stack == NULL) {
+            return 1;
+        }
+        dec->stack = stack;
+        dec->capacity = capacity;
+    }
+    mpk_decoder_frame_t frame = { schema, base, 0, size, kind };
+    dec->stack[dec->depth++] = frame;
+    return 0;
+}
+
+// Set up a string or binary payload of `size` bytes to be copied from the
+// following chunk tokens
+static int mpk_decoder_bytes(mpk_decoder_t* dec, void* dest, size_t size){
+    Array* array = (Array*)dest;
+    array->size = size;
+    char* data = mpk_decoder_alloc(dec, size);
+    if (data == NULL) {
+        return 1;
+    }
+    array->data = abs2rel(data);
+    dec->bytes_dest = data;
+    dec->bytes_remaining = size;
+    return 0;
+}
+
+// Store a value whose first token has been read
+static int mpk_decoder_value(mpk_decoder_t* dec, const Schema* schema, char* dest, const mpack_token_t* token){
+    switch(schema->type){
+      case MORLOC_NIL:
+        *((int8_t*)dest) = (int8_t)0;
+        return 0;
+      case MORLOC_BOOL:
+        *((uint8_t*)dest) = (uint8_t) mpack_unpack_boolean(*token) ? 1 : 0;
+        return 0;
+      case MORLOC_SINT8:
+      case MORLOC_SINT16:
+      case MORLOC_SINT32:
+      case MORLOC_SINT64:
+      case MORLOC_UINT8:
+      case MORLOC_UINT16:
+      case MORLOC_UINT32:
+      case MORLOC_UINT64:
+        return parse_int_token(schema->type, dest, token);
+      case MORLOC_FLOAT32:
+        *(float*)dest = (float)mpack_unpack_float(*token);
+        return 0;
+      case MORLOC_FLOAT64:
+        *(double*)dest = (double)mpack_unpack_float(*token);
+        return 0;
+      case MORLOC_STRING:
+        if (token->type != MPACK_TOKEN_STR && token->type != MPACK_TOKEN_BIN) {
+            break;
+        }
+        return mpk_decoder_bytes(dec, dest, token->length);
+      case MORLOC_ARRAY:
+        {
+            const Schema* element = schema->parameters[0];
+            // byte arrays may also be encoded as MessagePack binary data
+            if (token->type == MPACK_TOKEN_BIN && is_byte_type(element->type)) {
+                return mpk_decoder_bytes(dec, dest, token->length);
+            }
+            if (token->type != MPACK_TOKEN_ARRAY) {
+                break;
+            }
+            Array* array = (Array*)dest;
+            array->size = token->length;
+            char* data = mpk_decoder_alloc(dec, array->size * element->width);
+            if (data == NULL) {
+                return 1;
+            }
+            array->data = abs2rel(data);
+            return mpk_decoder_push(dec, schema, data, array->size, MPK_FRAME_ARRAY);
+        }
+      case MORLOC_MAP:
+      case MORLOC_TUPLE:
+        if (token->type != MPACK_TOKEN_ARRAY && token->type != MPACK_TOKEN_MAP) {
+            break;
+        }
+        return mpk_decoder_push(dec, schema, dest, schema->size, MPK_FRAME_TUPLE);
+      default:
+        break;
+    }
+    fprintf(stderr, "Unexpected token %d for schema type %d\n", token->type, schema->type);
+    return 1;
+}
+
+// Decode as much of the message as the buffer holds. The buffer pointer and
+// size are advanced past the bytes that were used, so any bytes after the end
+// of the message are left for the caller.
+//
+// return MPACK_OK when the message is complete, MPACK_EOF when more data is
+// needed, or MPACK_ERROR
+int mpk_decoder_feed(mpk_decoder_t* dec, const char** buf_ptr, size_t* buf_remaining){
+    mpack_token_t token;
+
+    while (dec->status == MPACK_EOF) {
+        // copy string and binary payloads straight from the buffer
+        if (dec->bytes_remaining > 0) {
+            if (*buf_remaining == 0) {
+                return MPACK_EOF;
+            }
+            mpack_read(&dec->tokbuf, buf_ptr, buf_remaining, &token);
+            memcpy(dec->bytes_dest, token.data.chunk_ptr, token.length);
+            dec->bytes_dest += token.length;
+            dec->bytes_remaining -= token.length;
+            continue;
+        }
+
+        // close finished containers
+        while (dec->depth > 0 && dec->stack[dec->depth - 1].index == dec->stack[dec->depth - 1].size) {
+            dec->depth--;
+        }
+        if (dec->depth == 0) {
+            dec->status = MPACK_OK;
+            break;
+        }
+
+        mpk_decoder_frame_t* frame = &dec->stack[dec->depth - 1];
+        const Schema* schema;
+        char* dest;
+        switch (frame->kind) {
+          case MPK_FRAME_ROOT:
+            schema = frame->schema;
+            dest = frame->base;
+            break;
+          case MPK_FRAME_ARRAY:
+            schema = frame->schema->parameters[0];
+            dest = frame->base + frame->index * schema->width;
+            break;
+          default:
+            schema = frame->schema->parameters[frame->index];
+            dest = frame->base + frame->schema->offsets[frame->index];
+            break;
+        }
+
+        // fixed-width elements are decoded in bulk as long as the tokenizer
+        // holds no partially read token
+        if (frame->kind == MPK_FRAME_ARRAY && is_fixed_width(schema->type) &&
+            dec->tokbuf.plen == 0 && dec->tokbuf.passthrough == 0 && *buf_remaining > 0) {
+            size_t n = parse_primitive_array(schema->type, schema->width, dest, frame->size - frame->index, buf_ptr, buf_remaining);
+            frame->index += n;
+            if (n > 0) {
+                continue;
+            }
+        }
+
+        if (*buf_remaining == 0) {
+            return MPACK_EOF;
+        }
+        int status = mpack_read(&dec->tokbuf, buf_ptr, buf_remaining, &token);
+        if (status == MPACK_EOF) {
+            // the rest of the buffer was a partial token, it is kept in tokbuf
+            return MPACK_EOF;
+        }
+        if (status != MPACK_OK) {
+            dec->status = MPACK_ERROR;
+            break;
+        }
+
+        // the frame may move when a child container is pushed
+        frame->index++;
+        if (mpk_decoder_value(dec, schema, dest, &token) != 0) {
+            dec->status = MPACK_ERROR;
+            break;
+        }
+    }
+
+    if (dec->status == MPACK_OK && dec->block != NULL && dec->stack != NULL) {
+        // commit the space that was used
+        if (shrealloc(dec->block, (size_t)(dec->cursor - dec->block)) == NULL) {
+            dec->status = MPACK_ERROR;
+        }
+    }
+    if (dec->stack != NULL) {
+        free(dec->stack);
+        dec->stack = NULL;
+    }
+    return dec->status;
+}
+
+// The voidstar of a complete message. It belongs to the caller, who frees it
+// with shfree (or with the arena), NULL if the message is not complete.
+void* mpk_decoder_result(mpk_decoder_t* dec){
+    if (dec->status != MPACK_OK) {
+        return NULL;
+    }
+    void* result = dec->result;
+    dec->result = NULL;
+    dec->block = NULL;
+    return result;
+}
+
+// Release a decoder, and its partial voidstar if the message was not taken
+void mpk_decoder_free(mpk_decoder_t* dec){
+    free(dec->stack);
+    dec->stack = NULL;
+    if (dec->block != NULL) {
+        shfree(dec->block);
+        dec->block = NULL;
+    }
+    dec->result = NULL;
+}
+
+// take MessagePack data and set a pointer to an in-memory data structure
+int unpack(const char* mpk, size_t mpk_size, const char* schema_str, void** mlcptr) {
+    const Schema* schema = get_schema(schema_str);
+    if (schema == NULL) {
+        return 1;
+    }
+    return unpack_with_schema(mpk, mpk_size, schema, mlcptr);
+}
+
+
+// Map a whole file read-only. The mapping is only read front to back, so the
+// kernel is told to read ahead aggressively and drop pages behind the reader.
+const char* mpk_map_file(const char* path, size_t* size) {
+    *size = 0;
+
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        perror("open");
+        return NULL;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) == -1) {
+        perror("fstat");
+        close(fd);
+        return NULL;
+    }
+
+    // an empty file cannot be mapped and holds no message
+    if (st.st_size == 0) {
+        fprintf(stderr, "Cannot unpack empty file '%s'\n", path);
+        close(fd);
+        return NULL;
+    }
+
+    void* data = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    // the mapping stays valid after the descriptor is closed
+    close(fd);
+    if (data == MAP_FAILED) {
+        perror("mmap");
+        return NULL;
+    }
+    madvise(data, (size_t)st.st_size, MADV_SEQUENTIAL);
+
+    *size = (size_t)st.st_size;
+    return (const char*)data;
+}
+
+void mpk_unmap_file(const char* data, size_t size) {
+    if (data != NULL && munmap((void*)data, size) == -1) {
+        perror("munmap");
+    }
+}
+
+// The single pass decoder is used so the mapping is only walked once
+int unpack_file_with_schema(const char* path, const Schema* schema, void** mlcptr) {
+    size_t size;
+    const char* data = mpk_map_file(path, &size);
+    if (data == NULL) {
+        return 1;
+    }
+    int result = unpack_with_schema_single_pass(data, size, schema, mlcptr);
+    mpk_unmap_file(data, size);
+    return result;
+}
+
+int unpack_file(const char* path, const char* schema_str, void** mlcptr) {
+    const Schema* schema = get_schema(schema_str);
+    if (schema == NULL) {
+        return 1;
+    }
+    return unpack_file_with_schema(path, schema, mlcptr);
 }
 
 
@@ -2,6 +2,8 @@
 #include <tuple>
 #include <vector>
 #include <algorithm>
+#include <thread>
+#include <sys/wait.h>
 
 std::vector<int32_t> generate_integers() {
     // Maximum and minimum 32-bit signed integers
@@ -196,6 +198,30 @@ const char* GREEN = "\033[32m"; // Green
 const char* RED = "\033[31m";   // Red
 const char* RESET = "\033[0m";  // Reset to default
 
+// Sink that collects streamed pack output
+int vector_sink(void* ctx, const char* data, size_t size) {
+    std::vector<char>* out = (std::vector<char>*)ctx;
+    out->insert(out->end(), data, data + size);
+    return 0;
+}
+
+// Unpack a message fed to a streaming decoder a few bytes at a time
+void* unpack_stream(const char* mgk, size_t mgk_size, const Schema* schema, size_t chunk_size, sharena_t* arena) {
+    mpk_decoder_t dec;
+    if(mpk_decoder_init(&dec, schema, arena ? 0 : mgk_size, arena) != 0){
+        return nullptr;
+    }
+    int status = MPACK_EOF;
+    for(size_t offset = 0; offset < mgk_size && status == MPACK_EOF; offset += chunk_size){
+        const char* chunk = mgk + offset;
+        size_t remaining = std::min(chunk_size, mgk_size - offset);
+        status = mpk_decoder_feed(&dec, &chunk, &remaining);
+    }
+    void* result = mpk_decoder_result(&dec);
+    mpk_decoder_free(&dec);
+    return result;
+}
+
 template<typename T>
 void generic_test(const std::string& description, const std::string& schema_str, const T& data) {
     try {
@@ -204,6 +230,10 @@ void generic_test(const std::string& description, const std::string& schema_str,
         const char* schema_ptr = schema_str.c_str();
         const Schema* schema = parse_schema(&schema_ptr);
 
+        // the compiled schema from the cache must be interchangeable with it
+        const Schema* compiled = get_schema(schema_str.c_str());
+        bool cache_match = get_schema(schema_str.c_str()) == compiled;
+
         // convert C++ data to morloc voidstar
         void* voidstar_in = toAnything(schema, data);
 
@@ -212,24 +242,819 @@ void generic_test(const std::string& description, const std::string& schema_str,
         size_t mesgpack_size;
         int pack_result = pack_with_schema(voidstar_in, schema, &mesgpack_ptr, &mesgpack_size);
 
+        // the same bytes should be written into a caller-provided buffer
+        std::vector<char> buffer(pack_size(voidstar_in, schema));
+        size_t buffer_used = 0;
+        pack_with_schema_to_buffer(voidstar_in, schema, buffer.data(), buffer.size(), &buffer_used);
+        bool buffer_match = buffer_used == mesgpack_size && memcmp(buffer.data(), mesgpack_ptr, mesgpack_size) == 0;
+
+        // and streamed through the smallest buffer, which holds a single token
+        std::vector<char> streamed;
+        size_t streamed_size = 0;
+        pack_with_schema_to_sink(voidstar_in, schema, vector_sink, &streamed, MPACK_MAX_TOKEN_LEN, &streamed_size);
+        bool sink_match = streamed_size == mesgpack_size && streamed.size() == mesgpack_size && memcmp(streamed.data(), mesgpack_ptr, mesgpack_size) == 0;
+
+        // and packed on several threads, for arrays
+        char* parallel_ptr;
+        size_t parallel_size;
+        pack_with_schema_parallel(voidstar_in, schema, 3, &parallel_ptr, &parallel_size);
+        bool parallel_match = parallel_size == mesgpack_size && memcmp(parallel_ptr, mesgpack_ptr, mesgpack_size) == 0;
+        free(parallel_ptr);
+
         // convert MessagePack back to voidstar
         void* voidstar_out;
         unpack_with_schema(mesgpack_ptr, mesgpack_size, schema, &voidstar_out);
 
+        // and again without the msg_size pre-scan
+        void* voidstar_single;
+        unpack_with_schema_single_pass(mesgpack_ptr, mesgpack_size, compiled, &voidstar_single);
+
+        // and again on several threads, for arrays
+        void* voidstar_parallel;
+        unpack_with_schema_parallel(mesgpack_ptr, mesgpack_size, compiled, 3, &voidstar_parallel);
+
+        // and again from a copy of the message in shared memory, which
+        // string data is not copied out of
+        char* mesgpack_shm = (char*)shmalloc(mesgpack_size);
+        memcpy(mesgpack_shm, mesgpack_ptr, mesgpack_size);
+        void* voidstar_zero_copy;
+        unpack_with_schema_zero_copy(mesgpack_shm, mesgpack_size, compiled, &voidstar_zero_copy);
+
+        // and again into an arena, as the language bindings do
+        sharena_t unpack_arena = {};
+        void* voidstar_arena = nullptr;
+        unpack_with_schema_to_arena(mesgpack_ptr, mesgpack_size, compiled, &unpack_arena, &voidstar_arena);
+
+        // and again from a stream of small chunks, into one block and into
+        // an arena
+        void* voidstar_stream = unpack_stream(mesgpack_ptr, mesgpack_size, compiled, 3, nullptr);
+        sharena_t arena = {};
+        void* voidstar_stream_arena = unpack_stream(mesgpack_ptr, mesgpack_size, compiled, 1, &arena);
+        if(voidstar_stream == nullptr || voidstar_stream_arena == nullptr){
+            throw std::runtime_error("streaming unpack failed");
+        }
+
         // convert voidstar to C++ data
         T* dumby = nullptr;
         T return_data = fromAnything(schema, voidstar_out, dumby);
+        T return_single = fromAnything(compiled, voidstar_single, dumby);
+        T return_zero_copy = fromAnything(compiled, voidstar_zero_copy, dumby);
+        T return_parallel = fromAnything(compiled, voidstar_parallel, dumby);
+        T return_stream = fromAnything(compiled, voidstar_stream, dumby);
+        T return_stream_arena = fromAnything(compiled, voidstar_stream_arena, dumby);
+        T return_arena = fromAnything(compiled, voidstar_arena, dumby);
+        shfree(voidstar_in);
+        shfree(voidstar_out);
+        shfree(voidstar_single);
+        shfree(voidstar_parallel);
+        shfree(voidstar_zero_copy);
+        shfree(voidstar_stream);
+        sharena_release(&arena);
+        sharena_release(&unpack_arena);
+        shfree(mesgpack_shm);
+        free(mesgpack_ptr);
 
-        if(return_data == data){
+        // name every path that did not reproduce the data
+        std::vector<std::pair<const char*, bool>> checks = {
+            {"two-pass unpack", return_data == data},
+            {"single-pass unpack", return_single == data},
+            {"zero-copy unpack", return_zero_copy == data},
+            {"parallel unpack", return_parallel == data},
+            {"stream unpack", return_stream == data},
+            {"arena stream unpack", return_stream_arena == data},
+            {"arena unpack", return_arena == data},
+            {"buffer pack", buffer_match},
+            {"sink pack", sink_match},
+            {"parallel pack", parallel_match},
+            {"schema cache", cache_match}
+        };
+        std::string failed;
+        for(const auto& check : checks){
+            if(!check.second){
+                failed += failed.empty() ? check.first : std::string(", ") + check.first;
+            }
+        }
+        if(failed.empty()){
             printf("%s: ... %spass%s\n", description.c_str(), GREEN, RESET);
         } else {
-            printf("%s: ... %svalue fail%s\n", description.c_str(), RED, RESET);
+            printf("%s: ... %svalue fail (%s)%s\n", description.c_str(), RED, failed.c_str(), RESET);
         }
     } catch (const std::exception& e) {
         printf("%s: ... %serror: %s%s\n", description.c_str(), RED, e.what(), RESET);
     }
 }
 
+// pack_data never resizes a caller's buffer, so output that does not fit
+// must fail rather than run past the end
+template<typename T>
+void short_buffer_test(const std::string& description, const std::string& schema_str, const T& data) {
+    const Schema* schema = get_schema(schema_str.c_str());
+    void* voidstar = toAnything(schema, data);
+    size_t size = pack_size(voidstar, schema);
+    bool pass = size > 0;
+
+    for(size_t short_size : {(size_t)0, size / 2, size - 1}){
+        std::vector<char> buffer(short_size + 16, 'G');
+        char* packet_ptr = buffer.data();
+        size_t packet_remaining = short_size;
+        mpack_tokbuf_t tokbuf = MPACK_TOKBUF_INITIAL_VALUE;
+        pass = pass && pack_data(voidstar, schema, NULL, &packet_ptr, &packet_remaining, &tokbuf) != 0;
+        pass = pass && std::all_of(buffer.begin() + short_size, buffer.end(), [](char c){ return c == 'G'; });
+    }
+    shfree(voidstar);
+
+    if(pass){
+        printf("%s: ... %spass%s\n", description.c_str(), GREEN, RESET);
+    } else {
+        printf("%s: ... %sfail%s\n", description.c_str(), RED, RESET);
+    }
+}
+
+// Schemas are checked against C++ types at compile time
+static_assert(mpk_schema_matches<std::vector<std::tuple<std::string, double, std::vector<int32_t>>>>("at3sf8ai4"), "record array");
+static_assert(mpk_schema_matches<std::tuple<std::string, uint32_t>>("m24names3ageu4"), "map as tuple");
+static_assert(!mpk_schema_matches<std::vector<double>>("af4"), "float width");
+static_assert(!mpk_schema_matches<std::tuple<std::string, uint32_t>>("t2su4i4"), "tuple size");
+static_assert(mpk_type<std::tuple<int8_t, double, std::string>>::width == 1 + 8 + sizeof(Array), "tuple width");
+
+// Convert with the layout derived from the C++ type and check that it is
+// interchangeable with the Schema based conversions
+template<typename T>
+void typed_test(const std::string& description, const std::string& schema_str, const T& data) {
+    const Schema* schema = get_schema(schema_str.c_str());
+    T* dumby = nullptr;
+
+    bool pass = mpk_schema_matches<T>(schema_str.c_str());
+
+    void* typed = mpk_to_voidstar(data);
+    void* untyped = toAnything(schema, data);
+    pass = pass && mpk_from_voidstar<T>(typed) == data;
+    pass = pass && fromAnything(schema, typed, dumby) == data;
+    pass = pass && mpk_from_voidstar<T>(untyped) == data;
+    shfree(typed);
+    shfree(untyped);
+
+    // the direct encoder writes the same bytes as the C packer
+    pass = pass && mpk_pack(data) == mpk_pack(data, mpk_schema_string<T>());
+    pass = pass && mpk_unpack<T>(mpk_pack(data)) == data;
+    pass = pass && mpk_unpack<T>(mpk_pack(data, schema_str)) == data;
+    pass = pass && mpk_unpack<T>(mpk_pack(data, schema_str), schema_str) == data;
+
+    if(pass){
+        printf("%s: ... %spass%s\n", description.c_str(), GREEN, RESET);
+    } else {
+        printf("%s: ... %svalue fail%s\n", description.c_str(), RED, RESET);
+    }
+}
+
+// Decode MessagePack that the C++ packer would not write, such as integers in
+// a float array or byte arrays as binary data, and reject malformed messages
+void direct_unpack_test(const std::string& description) {
+    bool pass = true;
+
+    std::vector<char> mixed = {(char)0x93, 0x01, (char)0xd0, (char)0xff, (char)0xcb, 0x40, 0x04, 0, 0, 0, 0, 0, 0};
+    pass = pass && mpk_unpack<std::vector<double>>(mixed) == std::vector<double>({1, -1, 2.5});
+
+    std::vector<char> binary = {(char)0xc4, 0x03, 0x01, 0x02, 0x03};
+    pass = pass && mpk_unpack<std::vector<uint8_t>>(binary) == std::vector<uint8_t>({1, 2, 3});
+
+    // but only u1 and i1 arrays, not other single byte elements like booleans
+    const char* bool_schema_str = "ab";
+    const Schema* bool_schema = parse_schema(&bool_schema_str);
+    void* bool_voidstar = nullptr;
+    pass = pass && unpack_with_schema(binary.data(), binary.size(), bool_schema, &bool_voidstar) != 0;
+    shfree(bool_voidstar);
+    // the bulk decoder hands the same encodings to the token parser as the
+    // element by element path would
+    auto unpack_bytes = [](const std::vector<char>& mgk, const char* schema_str, std::vector<uint8_t>& out){
+        void* voidstar = nullptr;
+        int status = unpack_with_schema(mgk.data(), mgk.size(), get_schema(schema_str), &voidstar);
+        if(status == 0){
+            ArrayView view = array_view((const Array*)voidstar, 1);
+            out.assign(view.data, view.data + view.size);
+        }
+        shfree(voidstar);
+        return status;
+    };
+    std::vector<uint8_t> bytes;
+    pass = pass && unpack_bytes({(char)0x93, (char)0xc3, (char)0xc0, (char)0xc2}, "ab", bytes) == 0 && bytes == std::vector<uint8_t>({1, 0, 0});
+    pass = pass && unpack_bytes({(char)0x92, (char)0xc0, (char)0xc3}, "az", bytes) == 0 && bytes == std::vector<uint8_t>({0, 0});
+    pass = pass && unpack_bytes({(char)0x92, 0x01, (char)0xd0, 0x05}, "au1", bytes) == 0 && bytes == std::vector<uint8_t>({1, 5});
+    pass = pass && unpack_bytes({(char)0x92, 0x01, (char)0xff}, "au1", bytes) != 0;
+    pass = pass && unpack_bytes({(char)0x92, 0x01, (char)0xd0, (char)0xfe}, "au1", bytes) != 0;
+
+    std::vector<char> binaries = {(char)0x92, (char)0xc4, 0x01, 0x01, (char)0xc4, 0x01, 0x00};
+    const Schema* bools_schema = get_schema("aab");
+    bool_voidstar = nullptr;
+    pass = pass && unpack_with_schema_parallel(binaries.data(), binaries.size(), bools_schema, 2, &bool_voidstar) != 0;
+    shfree(bool_voidstar);
+
+    std::vector<std::vector<char>> malformed = {
+        {},                                                      // empty
+        {(char)0x93, 0x01},                                      // truncated array
+        {(char)0xdd, (char)0xff, (char)0xff, (char)0xff, (char)0xff}, // length beyond the message
+        {(char)0xa5, 'c', 'a', 't'},                             // truncated string
+        {(char)0x93, (char)0xa1, 'a', 0x01, 0x02}                // string in a float array
+    };
+    for(const auto& bad : malformed){
+        try {
+            mpk_unpack<std::vector<double>>(bad);
+            pass = false;
+        } catch (const std::runtime_error&) { }
+    }
+
+    // a tuple must have exactly as many fields as the type
+    std::vector<char> pair = {(char)0x92, 0x01, 0x02};
+    try {
+        mpk_unpack<std::tuple<int, int, int>>(pair);
+        pass = false;
+    } catch (const std::runtime_error&) { }
+
+    if(pass){
+        printf("%s: ... %spass%s\n", description.c_str(), GREEN, RESET);
+    } else {
+        printf("%s: ... %sfail%s\n", description.c_str(), RED, RESET);
+    }
+}
+
+// A message that ends inside a string must fail rather than copy the string
+// past the end of the voidstar
+void truncated_unpack_test(const std::string& description) {
+    const Schema* schema = get_schema("as");
+    std::vector<std::string> data = {"cat", std::string(100, 'x')};
+    void* voidstar = toAnything(schema, data);
+    char* mesgpack_ptr;
+    size_t mesgpack_size;
+    bool pass = pack_with_schema(voidstar, schema, &mesgpack_ptr, &mesgpack_size) == 0;
+
+    // zero copy only applies to messages in shared memory
+    char* mesgpack_shm = (char*)shmalloc(mesgpack_size);
+    memcpy(mesgpack_shm, mesgpack_ptr, mesgpack_size);
+    for(size_t cut : {1, 50, 99}){
+        void* out = nullptr;
+        pass = pass && unpack_with_schema_zero_copy(mesgpack_shm, mesgpack_size - cut, schema, &out) != 0;
+        shfree(out);
+        out = nullptr;
+        pass = pass && unpack_with_schema_single_pass(mesgpack_ptr, mesgpack_size - cut, schema, &out) != 0;
+        shfree(out);
+    }
+    shfree(mesgpack_shm);
+    free(mesgpack_ptr);
+    shfree(voidstar);
+
+    if(pass){
+        printf("%s: ... %spass%s\n", description.c_str(), GREEN, RESET);
+    } else {
+        printf("%s: ... %sfail%s\n", description.c_str(), RED, RESET);
+    }
+}
+
+#if __cplusplus >= 201703L
+// Read records in place through views, both of a voidstar whose owner has
+// since freed it and of a freshly unpacked message
+template<typename Record>
+void view_test(const std::string& description, const std::vector<Record>& records) {
+    bool pass = true;
+
+    void* voidstar = mpk_to_voidstar(records);
+    auto view = mpk_view<std::vector<Record>>(voidstar);
+    // the view holds its own reference, so the block outlives this
+    shfree(voidstar);
+
+    pass = pass && view.size() == records.size();
+    size_t i = 0;
+    for (auto record : view) {
+        const Record& expected = records[i++];
+        std::string_view name = record.template get<0>();
+        pass = pass && name == std::get<0>(expected);
+        pass = pass && record.template get<1>() == std::get<1>(expected);
+        auto values = record.template get<2>();
+        pass = pass && std::equal(values.begin(), values.end(), std::get<2>(expected).begin(), std::get<2>(expected).end());
+    }
+
+    // views of elements keep the block alive after the array view is gone
+    if (!records.empty()) {
+        auto last = view[view.size() - 1].template get<0>();
+        view = mpk_array_view<Record>();
+        pass = pass && last == std::get<0>(records.back());
+    }
+
+    std::vector<double> doubles = {0.5, -1e300, 42};
+    auto doubles_view = mpk_unpack_view<std::vector<double>>(mpk_pack(doubles));
+    pass = pass && std::equal(doubles_view.begin(), doubles_view.end(), doubles.begin(), doubles.end());
+    pass = pass && doubles_view.data()[2] == 42 && doubles_view.subspan(1, 2)[0] == -1e300;
+
+    if(pass){
+        printf("%s: ... %spass%s\n", description.c_str(), GREEN, RESET);
+    } else {
+        printf("%s: ... %sfail%s\n", description.c_str(), RED, RESET);
+    }
+}
+#endif
+
+// Build containers in the shm pool, and build an array there that is handed
+// over as a voidstar without being copied
+void shm_container_test(const std::string& description, size_t n) {
+    bool pass = true;
+
+    std::vector<int64_t, mpk_shm_allocator<int64_t>> allocated;
+    mpk_shm_array<int32_t> ints;
+    for(size_t i = 0; i < n; i++){
+        allocated.push_back(-(int64_t)i);
+        ints.push_back((int32_t)(i * 7));
+    }
+    pass = pass && abs2rel(allocated.data()) != RELNULL;
+    pass = pass && abs2rel(ints.data()) != RELNULL;
+    for(size_t i = 0; i < n; i++){
+        pass = pass && allocated[i] == -(int64_t)i;
+    }
+
+#if defined(__cpp_lib_memory_resource)
+    std::pmr::vector<double> pmr_doubles(mpk_shm_memory_resource());
+    for(size_t i = 0; i < n; i++){
+        pmr_doubles.push_back(i * 0.5);
+    }
+    pass = pass && abs2rel(pmr_doubles.data()) != RELNULL;
+    for(size_t i = 0; i < n; i++){
+        pass = pass && pmr_doubles[i] == i * 0.5;
+    }
+#endif
+
+    int32_t* elements = ints.data();
+    void* voidstar = ints.release();
+    pass = pass && ints.empty();
+    pass = pass && (char*)elements == (char*)voidstar + sizeof(Array);
+
+    const Schema* schema = get_schema("ai4");
+    std::vector<int32_t> expected = fromAnything(schema, voidstar, static_cast<std::vector<int32_t>*>(nullptr));
+    pass = pass && expected.size() == n;
+    for(size_t i = 0; i < expected.size(); i++){
+        pass = pass && expected[i] == (int32_t)(i * 7);
+    }
+    pass = pass && mpk_unpack<std::vector<int32_t>>(mpk_pack(expected)) == expected;
+#if __cplusplus >= 201703L
+    auto view = mpk_view<std::vector<int32_t>>(voidstar);
+    shfree(voidstar);
+    pass = pass && std::equal(view.begin(), view.end(), expected.begin(), expected.end());
+#else
+    shfree(voidstar);
+#endif
+
+    // an empty array is still a valid voidstar
+    void* empty = mpk_shm_array<double>().release();
+    pass = pass && ((Array*)empty)->size == 0;
+    shfree(empty);
+
+    if(pass){
+        printf("%s: ... %spass%s\n", description.c_str(), GREEN, RESET);
+    } else {
+        printf("%s: ... %sfail%s\n", description.c_str(), RED, RESET);
+    }
+}
+
+// Allocate and free blocks of many sizes, checking that live blocks are never
+// overwritten and that freed space is reused and merged rather than growing
+// the pool
+void shm_test(const std::string& description, size_t n_blocks) {
+    size_t pool_size = total_shm_size();
+    bool pass = true;
+
+    for(size_t round = 0; round < 4; round++){
+        std::vector<uint8_t*> blocks(n_blocks);
+        for(size_t i = 0; i < n_blocks; i++){
+            size_t size = 1 + (i * 37 + round) % 300;
+            blocks[i] = (uint8_t*)shmalloc(size);
+            memset(blocks[i], (int)(i & 0xff), size);
+        }
+        // free every other block, then fill the holes with smaller blocks
+        for(size_t i = 0; i < n_blocks; i += 2){
+            shfree(blocks[i]);
+            blocks[i] = (uint8_t*)shmalloc(1 + i % 100);
+            memset(blocks[i], (int)(i & 0xff), 1 + i % 100);
+        }
+        for(size_t i = 0; i < n_blocks; i++){
+            size_t size = i % 2 == 0 ? 1 + i % 100 : 1 + (i * 37 + round) % 300;
+            for(size_t j = 0; j < size; j++){
+                pass = pass && blocks[i][j] == (uint8_t)(i & 0xff);
+            }
+            shfree(blocks[i]);
+        }
+        // after the first round, the pool should not need to grow
+        if(round == 0){
+            pool_size = total_shm_size();
+        }
+        pass = pass && total_shm_size() == pool_size;
+    }
+
+    // freed neighbors are merged, so a block spanning many of them fits once
+    // the small blocks cached by this thread are returned to the pool
+    shflush();
+    void* big = shmalloc(pool_size / 4);
+    pass = pass && big != NULL && total_shm_size() == pool_size;
+    shfree(big);
+
+    if(pass){
+        printf("%s: ... %spass%s\n", description.c_str(), GREEN, RESET);
+    } else {
+        printf("%s: ... %svalue fail%s\n", description.c_str(), RED, RESET);
+    }
+}
+
+// Many voidstars allocated from one arena, then released together
+void sharena_test(const std::string& description, size_t n_objects) {
+    const Schema* schema = get_schema("t2sai4");
+    bool pass = schema != NULL;
+
+    sharena_t arena;
+    pass = pass && sharena_begin(&arena, 0x1000) == 0;
+
+    size_t pool_size = 0;
+    for(size_t round = 0; round < 3; round++){
+        std::vector<void*> objects(n_objects);
+        for(size_t i = 0; i < n_objects; i++){
+            auto data = std::make_tuple(std::string(i % 50, 'x'), std::vector<int32_t>(i % 20, (int32_t)i));
+            objects[i] = toAnything(&arena, schema, data);
+            pass = pass && objects[i] != nullptr;
+        }
+        for(size_t i = 0; i < n_objects && pass; i++){
+            auto data = fromAnything(schema, objects[i], static_cast<std::tuple<std::string, std::vector<int32_t>>*>(nullptr));
+            pass = std::get<0>(data) == std::string(i % 50, 'x') &&
+                   std::get<1>(data) == std::vector<int32_t>(i % 20, (int32_t)i);
+        }
+        sharena_release(&arena);
+
+        // released chunks are reused, so the pool does not grow after the
+        // first round
+        if(round == 0){
+            pool_size = total_shm_size();
+        }
+        pass = pass && total_shm_size() == pool_size;
+    }
+
+    // mpk_pack and mpk_unpack use a scratch arena for their voidstar
+    for(size_t i = 0; i < n_objects; i++){
+        std::vector<std::string> data(i % 10, std::string(i % 30, 'y'));
+        pass = pass && mpk_unpack<std::vector<std::string>>(mpk_pack(data, "as"), "as") == data;
+    }
+
+    if(pass){
+        printf("%s: ... %spass%s\n", description.c_str(), GREEN, RESET);
+    } else {
+        printf("%s: ... %svalue fail%s\n", description.c_str(), RED, RESET);
+    }
+}
+
+// Write messages to a file with the streaming packer and load them back from
+// a mapping of the file
+void unpack_file_test(const std::string& description) {
+    bool pass = true;
+    char path[] = "/tmp/morloc-unpack-file-XXXXXX";
+    int fd = mkstemp(path);
+    if(fd == -1){
+        printf("%s: ... %smkstemp fail%s\n", description.c_str(), RED, RESET);
+        return;
+    }
+
+    // an empty file is an error, not an empty message
+    void* voidstar = nullptr;
+    pass = pass && unpack_file(path, "as", &voidstar) != 0;
+
+    std::vector<std::string> strings;
+    for(size_t i = 0; i < 1000; i++){
+        strings.push_back(std::string(i % 70, 'a' + i % 26));
+    }
+    const Schema* schema = get_schema("as");
+    void* strings_in = toAnything(schema, strings);
+    pass = pass && pack_with_schema_to_fd(strings_in, schema, fd, nullptr) == 0;
+    close(fd);
+    shfree(strings_in);
+
+    pass = pass && mpk_unpack_file<std::vector<std::string>>(path, "as") == strings;
+    pass = pass && unpack_file(path, "as", &voidstar) == 0;
+    pass = pass && voidstar != nullptr && fromAnything(schema, voidstar, static_cast<std::vector<std::string>*>(nullptr)) == strings;
+    shfree(voidstar);
+
+    std::vector<double> doubles(100000);
+    for(size_t i = 0; i < doubles.size(); i++){
+        doubles[i] = i * 0.5;
+    }
+    FILE* file = fopen(path, "wb");
+    schema = get_schema("af8");
+    void* doubles_in = toAnything(schema, doubles);
+    pass = pass && file != nullptr && pack_with_schema_to_file(doubles_in, schema, file, nullptr) == 0;
+    if(file != nullptr){
+        fclose(file);
+    }
+    shfree(doubles_in);
+    pass = pass && mpk_unpack_file<std::vector<double>>(path, "af8") == doubles;
+    pass = pass && mpk_unpack_file<std::vector<double>>(path) == doubles;
+#if __cplusplus >= 201703L
+    auto doubles_view = mpk_unpack_file_view<std::vector<double>>(path);
+    pass = pass && std::equal(doubles_view.begin(), doubles_view.end(), doubles.begin(), doubles.end());
+#endif
+
+    unlink(path);
+
+    if(pass){
+        printf("%s: ... %spass%s\n", description.c_str(), GREEN, RESET);
+    } else {
+        printf("%s: ... %svalue fail%s\n", description.c_str(), RED, RESET);
+    }
+}
+
+// Create pools with each volume option. Options the system cannot satisfy
+// must fall back to a working volume, so a hugetlbfs directory that does not
+// exist gives a volume advised to use transparent huge pages.
+void shm_options_test(const std::string& description) {
+    bool pass = true;
+
+    shm_options_t options[3] = { SHM_OPTIONS_DEFAULT, SHM_OPTIONS_DEFAULT, SHM_OPTIONS_DEFAULT };
+    options[0].populate = true;
+    options[1].pages = SHM_PAGES_ADVISE_HUGE;
+    options[1].populate = true;
+    options[1].numa_node = 0;
+    options[2].pages = SHM_PAGES_HUGETLB;
+    options[2].hugetlbfs_dir = "/nonexistent/hugepages";
+    unsigned int flags[3] = { 0, SHM_FLAG_HUGEPAGE, SHM_FLAG_HUGEPAGE };
+
+    for(size_t i = 0; i < 3; i++){
+        shm_t* shm = shinit_with_options("morloc-cpptest-options", 0, 1 << 22, &options[i]);
+        if(shm == NULL){
+            pass = false;
+            continue;
+        }
+        pass = pass && shm->flags == flags[i];
+
+        // the pool still grows past the first volume
+        size_t size = 3 << 21;
+        uint8_t* data = (uint8_t*)shmalloc(size);
+        pass = pass && data != NULL;
+        if(data != NULL){
+            memset(data, (int)i + 1, size);
+            for(size_t j = 0; j < size; j += 4096){
+                pass = pass && data[j] == (uint8_t)(i + 1);
+            }
+            shfree(data);
+        }
+        shclose();
+    }
+
+    if(pass){
+        printf("%s: ... %spass%s\n", description.c_str(), GREEN, RESET);
+    } else {
+        printf("%s: ... %svalue fail%s\n", description.c_str(), RED, RESET);
+    }
+}
+
+// A volume that another process put on hugetlbfs is opened by shinit, rather
+// than shadowed by a new POSIX object of the same name. A plain directory
+// stands in for the hugetlbfs mount.
+void shm_backing_test(const std::string& description) {
+    char dir[] = "/tmp/morloc-cpptest-hugetlbfs-XXXXXX";
+    bool pass = mkdtemp(dir) != NULL;
+
+    shm_options_t hugetlb = SHM_OPTIONS_DEFAULT;
+    hugetlb.pages = SHM_PAGES_HUGETLB;
+    hugetlb.hugetlbfs_dir = dir;
+    shm_t* shm = shinit_with_options("morloc-cpptest-backing", 0, 1 << 20, &hugetlb);
+    pass = pass && shm != NULL && (shm->flags & SHM_FLAG_HUGETLB);
+
+    uint8_t* data = (uint8_t*)shmalloc(64);
+    pass = pass && data != NULL;
+    if(pass){
+        memset(data, 0x42, 64);
+        relptr_t rel = abs2rel(data);
+
+        pid_t pid = fork();
+        if(pid == 0){
+            shm_options_t normal = SHM_OPTIONS_DEFAULT;
+            shm_t* other = shinit_with_options("morloc-cpptest-backing", 0, 1 << 20, &normal);
+            bool ok = other != NULL && (other->flags & SHM_FLAG_HUGETLB) && ((uint8_t*)rel2abs(rel))[63] == 0x42;
+            ok = ok && shm_open("morloc-cpptest-backing_0", O_RDONLY, 0) == -1;
+            _exit(ok ? 0 : 1);
+        }
+        int status = 0;
+        pass = pid > 0 && waitpid(pid, &status, 0) == pid && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+        shfree(data);
+    }
+    shclose();
+    // left behind only if the volume was shadowed
+    shm_unlink("morloc-cpptest-backing_0");
+    rmdir(dir);
+
+    if(pass){
+        printf("%s: ... %spass%s\n", description.c_str(), GREEN, RESET);
+    } else {
+        printf("%s: ... %svalue fail%s\n", description.c_str(), RED, RESET);
+    }
+}
+
+// Only the pages of a reservation that are written are backed by memory, so
+// it may be larger than the available memory, and its unused tail is returned
+// to the pool
+void shm_reserve_test(const std::string& description) {
+    shm_options_t options = SHM_OPTIONS_DEFAULT;
+    options.populate = true;
+    bool pass = shinit_with_options("morloc-cpptest-reserve", 0, 0x10000, &options) != NULL;
+
+    const size_t used = 0x100000;
+    char* data = (char*)shreserve(2 * get_available_memory());
+    pass = pass && data != NULL;
+    if(data != NULL){
+        memset(data, 0x5a, used);
+        pass = pass && shrealloc(data, used) == data;
+
+        // the tail is free for ordinary allocations
+        char* more = (char*)shmalloc(used);
+        pass = pass && more != NULL && abs2shm(more) == abs2shm(data);
+        shfree(more);
+        pass = pass && data[used - 1] == 0x5a;
+        shfree(data);
+    }
+    shclose();
+
+    if(pass){
+        printf("%s: ... %spass%s\n", description.c_str(), GREEN, RESET);
+    } else {
+        printf("%s: ... %svalue fail%s\n", description.c_str(), RED, RESET);
+    }
+}
+
+// Payloads that keep growing must not use up the volumes, and once they are
+// freed the trailing volumes can be given back to the system
+void shm_growth_test(const std::string& description) {
+    shm_options_t options = SHM_OPTIONS_DEFAULT;
+    options.min_volume_size = 0x10000;
+    bool pass = shinit_with_options("morloc-cpptest-growth", 0, 0x100, &options) != NULL;
+
+    std::vector<uint8_t*> blocks;
+    for(size_t size = 0x400; size <= ((size_t)1 << 25); size *= 2){
+        uint8_t* data = (uint8_t*)shmalloc(size);
+        pass = pass && data != NULL;
+        if(data != NULL){
+            memset(data, 0x5a, size);
+            blocks.push_back(data);
+        }
+    }
+
+    size_t n_volumes = 0;
+    for(size_t i = 0; i < MAX_VOLUME_NUMBER; i++){
+        n_volumes += volumes[i] != NULL;
+    }
+    pass = pass && n_volumes < 20;
+
+    // nothing can be released while the blocks are live
+    pass = pass && shtrim() == 0;
+    for(uint8_t* data : blocks){
+        shfree(data);
+    }
+    pass = pass && shtrim() > 0;
+
+    // pages that were already released are not counted again
+    pass = pass && shtrim() == 0;
+
+    // the released memory is still usable
+    uint8_t* data = (uint8_t*)shmalloc((size_t)1 << 24);
+    pass = pass && data != NULL;
+    if(data != NULL){
+        memset(data, 0x33, (size_t)1 << 24);
+        pass = pass && data[0] == 0x33 && data[((size_t)1 << 24) - 1] == 0x33;
+        shfree(data);
+    }
+    shclose();
+
+    if(pass){
+        printf("%s: ... %spass%s\n", description.c_str(), GREEN, RESET);
+    } else {
+        printf("%s: ... %svalue fail%s\n", description.c_str(), RED, RESET);
+    }
+}
+
+// Allocate and free blocks from several threads at once, each thread checking
+// that its live blocks are never overwritten by another thread
+void shm_thread_test(const std::string& description, size_t n_threads, size_t n_ops) {
+    std::vector<int> fails(n_threads, 0);
+    std::vector<std::thread> threads;
+    for(size_t t = 0; t < n_threads; t++){
+        threads.emplace_back([t, n_ops, &fails](){
+            std::vector<uint8_t*> blocks(64, nullptr);
+            std::vector<size_t> sizes(64, 0);
+            for(size_t i = 0; i < n_ops; i++){
+                size_t k = (i * 7 + t) % blocks.size();
+                if(blocks[k]){
+                    for(size_t j = 0; j < sizes[k]; j++){
+                        fails[t] += blocks[k][j] != (uint8_t)(t + k);
+                    }
+                    shfree(blocks[k]);
+                }
+                sizes[k] = i % 10 == 0 ? 1 + (i * 131) % 4000 : 1 + (i * 13) % 250;
+                blocks[k] = (uint8_t*)shmalloc(sizes[k]);
+                memset(blocks[k], (int)(t + k), sizes[k]);
+            }
+            for(size_t k = 0; k < blocks.size(); k++){
+                if(blocks[k]){
+                    shfree(blocks[k]);
+                }
+            }
+            shflush();
+        });
+    }
+    for(auto& thread : threads){
+        thread.join();
+    }
+
+    if(std::count(fails.begin(), fails.end(), 0) == (long)n_threads){
+        printf("%s: ... %spass%s\n", description.c_str(), GREEN, RESET);
+    } else {
+        printf("%s: ... %svalue fail%s\n", description.c_str(), RED, RESET);
+    }
+}
+
+// Take and drop references to one block from several processes at once, the
+// count must be back where it started when they are done
+void shm_refcount_test(const std::string& description, size_t n_procs, size_t n_ops) {
+    void* ptr = shmalloc(64);
+    bool pass = true;
+
+    std::vector<pid_t> pids;
+    for(size_t p = 0; p < n_procs; p++){
+        pid_t pid = fork();
+        if(pid == 0){
+            int status = 0;
+            for(size_t i = 0; i < n_ops; i++){
+                status |= shincref(ptr);
+                status |= shdecref(ptr);
+            }
+            _exit(status);
+        }
+        pids.push_back(pid);
+    }
+    for(pid_t pid : pids){
+        int status;
+        waitpid(pid, &status, 0);
+        pass = pass && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+    }
+
+    pass = pass && abs2blk(ptr)->reference_count == 1;
+
+    // the block survives until its last reference is dropped
+    shincref(ptr);
+    shfree(ptr);
+    pass = pass && abs2blk(ptr)->reference_count == 1;
+    shfree(ptr);
+
+    if(pass){
+        printf("%s: ... %spass%s\n", description.c_str(), GREEN, RESET);
+    } else {
+        printf("%s: ... %svalue fail%s\n", description.c_str(), RED, RESET);
+    }
+}
+
+// Small blocks cached by a process are returned to the pool when it exits or
+// closes the pool, leaving the volume a single free block again
+void shm_cache_exit_test(const std::string& description) {
+    bool pass = true;
+
+    for(int close_pool = 0; close_pool < 2; close_pool++){
+        shm_t* shm = shinit("morloc-cpptest-cache", 0, 0x100000);
+        if(shm == NULL){
+            pass = false;
+            continue;
+        }
+
+        fflush(stdout);
+        pid_t pid = fork();
+        if(pid == 0){
+            std::vector<void*> blocks;
+            for(size_t i = 0; i < 1000; i++){
+                blocks.push_back(shmalloc(8 + i % 200));
+            }
+            for(void* block : blocks){
+                shfree(block);
+            }
+            if(close_pool){
+                shclose();
+                _exit(0);
+            }
+            exit(0);
+        }
+        int status;
+        waitpid(pid, &status, 0);
+        pass = pass && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+
+        block_header_t* blk = (block_header_t*)(shm + 1);
+        pass = pass && blk->reference_count == 0 && blk->size + BLK_OVERHEAD + SHM_ALIGN > shm->volume_size;
+
+        shclose();
+    }
+
+    if(pass){
+        printf("%s: ... %spass%s\n", description.c_str(), GREEN, RESET);
+    } else {
+        printf("%s: ... %svalue fail%s\n", description.c_str(), RED, RESET);
+    }
+}
+
 int main() {
 
     shinit("morloc-cpptest", 0, 0x100);
@@ -256,6 +1081,7 @@ int main() {
     generic_test("Test int16", "i2", (int16_t)14);
     generic_test("Test int32", "i4", (int32_t)14);
     generic_test("Test int64", "i8", (int64_t)14);
+    generic_test("Test int64 below -2^32", "i8", (int64_t)-5000000000);
     generic_test("Test uint8",  "u1", (uint8_t)14);
     generic_test("Test uint16", "u2", (uint16_t)14);
     generic_test("Test uint32", "u4", (uint32_t)14);
@@ -273,6 +1099,9 @@ int main() {
     generic_test("Test array of integers", "ai4", std::vector<int32_t>{1, 2, 3, 4, 5});
     generic_test("Test array of float", "af4", std::vector<float>{1.0, 2.0, 3.0});
     generic_test("Test array of doubles", "af8", std::vector<double>{1.0, 2.0, 3.0});
+    generic_test("Test array of wide doubles", "af8", std::vector<double>{0.1, -1e300, 2.5, 1e-300, 3.0});
+    generic_test("Test array of mixed int8", "ai1", std::vector<int8_t>{1, -1, 127, -128, -33, -32, 0});
+    generic_test("Test array of wide int64", "ai8", std::vector<int64_t>{-5000000000, INT64_MIN, INT32_MIN, INT64_MAX, -31});
     generic_test("Test array of arrays of booleans", "aab", std::vector<std::vector<uint8_t>>{std::vector<uint8_t>{true,false,true}, std::vector<uint8_t>{false,true}});
     generic_test("Test array of arrays of int32", "aai4", std::vector<std::vector<int32_t>>{std::vector<int32_t>{99,-42}, std::vector<int32_t>{12,-4}});
   
@@ -305,11 +1134,60 @@ int main() {
     generic_test("range(1500) ai4", "ai4", range<int32_t>(  0, 1, 1500));
     generic_test("range(1500) ai8", "ai8", range<int64_t>(  0, 1, 1500));
   
+    // enough records for the parallel unpacker to split them into many ranges
+    std::vector<std::tuple<std::string, double, std::vector<int32_t>>> records;
+    for(int32_t i = 0; i < 500; i++){
+        records.push_back(std::make_tuple(std::string(i % 40, 'r'), i * 0.25, range<int32_t>(-i, 7, i % 20)));
+    }
+    generic_test("Test array of records", "at3sf8ai4", records);
+
+    short_buffer_test("Test packing strings into a short buffer", "as", std::vector<std::string>{"a", std::string(300, 'b'), ""});
+    short_buffer_test("Test packing doubles into a short buffer", "af8", std::vector<double>{1.5, -2, 1e300});
+    short_buffer_test("Test packing records into a short buffer", "at3sf8ai4", records);
+
+    // the size bound of these messages is many times their voidstar size, so
+    // the single pass and streaming decoders reserve far more than they use
+    generic_test("Test strings with a large reservation", "as", std::vector<std::string>(300000, std::string(15, 'x')));
+    generic_test("Test doubles with a large reservation", "af8", range<double>(0.5, 1, 1200000));
+
     generic_test("Test Alice", "m24names3ageu4", alice);
     generic_test("Test Bob weighted", "m34names3ageu46weightu4", bob);
     generic_test("Test Alice generic", "m34names3agei44infof8", alice2);
+
+    typed_test("Typed nil", "z", nullptr);
+    typed_test("Typed bool", "b", true);
+    typed_test("Typed int64", "i8", (int64_t)-5000000000);
+    typed_test("Typed float32", "f4", (float)3.14);
+    typed_test("Typed string", "s", std::string("cat"));
+    typed_test("Typed array of booleans", "ab", std::vector<uint8_t>{true, false, true});
+    typed_test("Typed vector of booleans", "ab", std::vector<bool>{true, false, false, true});
+    typed_test("Typed array of doubles", "af8", std::vector<double>{0.1, -1e300, 2.5});
+    typed_test("Typed array of arrays", "aai4", std::vector<std::vector<int32_t>>{{99, -42}, {}, {12}});
+    typed_test("Typed tuple", "t4bi4f8au1", std::make_tuple(true, 44, 42.7, std::vector<uint8_t>{1, 2, 3}));
+    typed_test("Typed map", "m24names3ageu4", std::make_tuple(std::string("Alice"), (uint32_t)42));
+    typed_test("Typed array of records", "at3sf8ai4", records);
+    typed_test("Typed integer edge cases", "ai4", generate_integers());
+    typed_test("Typed wide values", "t4i8u8f8s", std::make_tuple(INT64_MIN, (uint64_t)0xffffffffffffffff, -1e300, std::string(70000, 'x')));
+    direct_unpack_test("Test direct unpack of unusual encodings");
+    truncated_unpack_test("Test unpack of a truncated string");
+#if __cplusplus >= 201703L
+    view_test("Test views of records", records);
+#endif
+    shm_container_test("Test containers in shm", 10000);
+
+    shm_test("Test shm block reuse", 10000);
+    shm_thread_test("Test shm with 4 threads", 4, 100000);
+    shm_refcount_test("Test shm refcounts from 4 processes", 4, 100000);
+    sharena_test("Test shm arena", 10000);
+    unpack_file_test("Test unpack file");
   
     shclose();
 
+    shm_options_test("Test shm volume options");
+    shm_backing_test("Test shm volume opened on its existing backing");
+    shm_growth_test("Test shm growth and trim");
+    shm_reserve_test("Test shm reservation beyond the available memory");
+    shm_cache_exit_test("Test shm thread cache flushed at exit and close");
+
     return 0;
 }
@@ -1,4 +1,6 @@
 import pymorloc as mlc
+import os
+import tempfile
 import time
 from colorama import Fore, Style, init
 
@@ -217,11 +219,25 @@ for description, schema, data in test_cases:
         print(f"Error in pack: {e}")
         continue
 
+    # the same message should load from a file
+    try:
+        with tempfile.NamedTemporaryFile(delete=False) as f:
+            f.write(mesgpack_data)
+        file_result = mlc.mesgpack_file_to_py(f.name, schema)
+        file_voidstar = mlc.from_mesgpack_file(f.name, schema)
+        file_match = file_result == data and mlc.from_voidstar(file_voidstar, schema) == data
+        del file_voidstar
+        os.unlink(f.name)
+    except Exception as e:
+        print(f"{description:<{max_width}} {Fore.RED}fail from file{Style.RESET_ALL}")
+        print(f"Error in unpack: {e}")
+        continue
+
     end_time = time.time()
 
     elapsed_time = end_time - start_time
 
-    if result == data:
+    if result == data and file_match:
         print(f"{description:<{max_width}} {Fore.GREEN}pass{Style.RESET_ALL} ({elapsed_time:.4f}s)")
     else:
         print(f"{description:<{max_width}} {Fore.RED}fail{Style.RESET_ALL}")
@@ -234,4 +250,32 @@ for description, schema, data in test_cases:
     del voidstar
     del mesgpack_data
 
+# voidstars made between arena_begin and arena_release come from one arena and
+# are freed together
+try:
+    mlc.arena_begin(1 << 16)
+    arena_data = [[float(i)] * (i % 50) for i in range(1000)]
+    arena_voidstars = [mlc.to_voidstar(x, "af8") for x in arena_data]
+    arena_relptrs = [mlc.to_shm(x, "af8") for x in arena_data]
+    arena_match = [mlc.from_voidstar(v, "af8") for v in arena_voidstars] == arena_data and \
+                  [mlc.from_shm(r, "af8") for r in arena_relptrs] == arena_data
+    del arena_voidstars
+    mlc.arena_release()
+    # releasing twice is harmless and objects outside an arena still work
+    mlc.arena_release()
+    arena_match = arena_match and mlc.from_voidstar(mlc.to_voidstar([1.5], "af8"), "af8") == [1.5]
+    try:
+        mlc.arena_begin(-1)
+        arena_match = False
+    except ValueError:
+        pass
+except Exception as e:
+    arena_match = False
+    print(f"Error in arena: {e}")
+
+if arena_match:
+    print(f"{'Arena begin and release':<{max_width}} {Fore.GREEN}pass{Style.RESET_ALL}")
+else:
+    print(f"{'Arena begin and release':<{max_width}} {Fore.RED}fail{Style.RESET_ALL}")
+
 mlc.shm_close()